@@ -9,7 +9,9 @@
 #include <stdexcept>
 using namespace std;
 
+#include "compiler/bytecodeview.hh"
 #include "vm/exceptions.hh"
+#include "vm/zstring.hh"
 
 #define NO_ADDRESS (0xFFFFFFFF)
 
@@ -18,22 +20,28 @@ using namespace std;
 constexpr uint8_t Bytecode::_MAGIC[];
 
 Bytecode::Bytecode(vector<uint8_t> const& from_zb)
+    : Bytecode(BytecodeView(from_zb))
 {
-    if(from_zb.size() < 16 || !equal(begin(from_zb), begin(from_zb)+8, _MAGIC)) {
-        throw runtime_error("Not a valid ZB file.");
-    }
+}
 
-    uint64_t str_pos = *reinterpret_cast<uint64_t const*>(&from_zb[8]);
-    copy(begin(from_zb) + 16, begin(from_zb) + static_cast<int64_t>(str_pos), back_inserter(_code));
 
-    while(str_pos < from_zb.size()) {
-        string   s(reinterpret_cast<const char*>(&from_zb[str_pos]));
-        str_pos += s.size() + 1;
-        uint64_t h = *reinterpret_cast<uint64_t const*>(&from_zb[str_pos]);
-        str_pos += 8;
-        _strings.push_back({ s, h });
+Bytecode::Bytecode(BytecodeView const& view)
+    : _code(view.Code(), view.Code() + view.CodeSize()), _resolved(true)
+{
+    for(size_t i=0; i<view.StringCount(); ++i) {
+        BytecodeView::String const& s = view.GetString(static_cast<uint32_t>(i));
+        _strings.push_back({ string(s.str, s.len), s.hash });
+    }
+    for(size_t i=0; i<view.ConstantCount(); ++i) {
+        BytecodeView::Constant const& c = view.GetConstant(static_cast<uint32_t>(i));
+        _constants.emplace_back(c.code, c.code + c.size);
     }
-    assert(str_pos == from_zb.size());
+}
+
+
+bool Bytecode::ValidMagic(uint8_t const* data)
+{
+    return equal(data, data+8, _MAGIC);
 }
 
 
@@ -44,14 +52,28 @@ vector<uint8_t> Bytecode::GenerateZB()
     // magic number and version
     vector<uint8_t> data(begin(_MAGIC), end(_MAGIC));           // NOLINT - bug in linter
 
-    // string list position
-    uint64_t pos = 16 + _code.size();
+    // string list and constant pool positions
+    uint64_t const_pos = 24 + _code.size();
+    uint64_t pos = const_pos;
+    for(auto const& c: _constants) {
+        pos += 4 + c.size();
+    }
     uint8_t* bytes = reinterpret_cast<uint8_t*>(&pos);
     copy(bytes, bytes+8, back_inserter(data));
+    bytes = reinterpret_cast<uint8_t*>(&const_pos);
+    copy(bytes, bytes+8, back_inserter(data));
 
     // add code
     copy(begin(_code), end(_code), back_inserter(data));
 
+    // add constants (size + code)
+    for(auto const& c: _constants) {
+        uint32_t sz = static_cast<uint32_t>(c.size());
+        bytes = reinterpret_cast<uint8_t*>(&sz);
+        copy(bytes, bytes+4, back_inserter(data));
+        copy(begin(c), end(c), back_inserter(data));
+    }
+
     // add strings
     for(auto const& s: _strings) {                              // NOLINT - bug in linter
         copy(begin(s.str), end(s.str), back_inserter(data));
@@ -80,7 +102,7 @@ Bytecode::Bytecode(string const& code)
 void Bytecode::Add(Opcode op)
 {
     if(opcode_pars[op] == '0') {
-        _code.push_back(op);
+        AddOpcode(op);
     } else {
         throw invalid_argument("Parameter missing for opcode " + opcode_names[op]);
     }
@@ -90,7 +112,7 @@ void Bytecode::Add(Opcode op)
 void Bytecode::Add(Opcode op, double value)
 {
     if(opcode_pars[op] == 'd') {
-        _code.push_back(op);
+        AddOpcode(op);
         uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
         copy(bytes, bytes+8, back_inserter(_code));
     } else {
@@ -101,7 +123,7 @@ void Bytecode::Add(Opcode op, double value)
 
 void Bytecode::Add(Opcode op, uint8_t value)
 {
-    _code.push_back(op);
+    AddOpcode(op);
     if(opcode_pars[op] == '1') {
         _code.push_back(value);
     } else {
@@ -112,7 +134,7 @@ void Bytecode::Add(Opcode op, uint8_t value)
 
 void Bytecode::Add(Opcode op, uint16_t value)
 {
-    _code.push_back(op);
+    AddOpcode(op);
     if(opcode_pars[op] == '2') {
         uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
         copy(bytes, bytes+2, back_inserter(_code));
@@ -124,7 +146,7 @@ void Bytecode::Add(Opcode op, uint16_t value)
 
 void Bytecode::Add(Opcode op, uint32_t value)
 {
-    _code.push_back(op);
+    AddOpcode(op);
     if(opcode_pars[op] == '4') {                                                // NOLINT - bug in linter
         uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
         copy(bytes, bytes+4, back_inserter(_code));                             // NOLINT - bug in linter
@@ -136,7 +158,7 @@ void Bytecode::Add(Opcode op, uint32_t value)
 
 void Bytecode::Add(Opcode op, uint64_t value)
 {
-    _code.push_back(op);
+    AddOpcode(op);
     if(opcode_pars[op] == '8') {                                                // NOLINT - bug in linter
         uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
         copy(bytes, bytes+8, back_inserter(_code));                             // NOLINT - bug in linter
@@ -150,8 +172,8 @@ void Bytecode::Add(Opcode op, string const& s)
 {
     if(opcode_pars[op] == 's') {
         size_t sz = _strings.size();
-        _strings.push_back({ s, hash<string>()(s) });
-        _code.push_back(op);
+        _strings.push_back({ s, ZString::HashOf(s.data(), s.size()) });
+        AddOpcode(op);
         uint8_t* bytes = reinterpret_cast<uint8_t*>(&sz);
         copy(bytes, bytes+4, back_inserter(_code));
     } else {
@@ -163,7 +185,7 @@ void Bytecode::Add(Opcode op, string const& s)
 void Bytecode::Add(Opcode op, uint8_t pars, uint8_t optpars)
 {
     if(opcode_pars[op] == 'p') {
-        _code.push_back(op);
+        AddOpcode(op);
         _code.push_back(pars);
         _code.push_back(optpars);
     } else {
@@ -172,13 +194,80 @@ void Bytecode::Add(Opcode op, uint8_t pars, uint8_t optpars)
 }
 
 
+
+void Bytecode::AddOpcode(Opcode op)
+{
+    if(op == CALL) {
+        _last_call = _code.size();
+    }
+
+    // keep track of the constant pushes at the end of the code, for AddFolded
+    bool constant = (op == PNIL || op == PBF || op == PBT || op == PN8 || op == PNUM || op == PSTR || op == PCON);
+    if(constant && !_address_next) {
+        _const_run.push_back(_code.size());
+    } else {
+        _const_run.clear();
+    }
+    _address_next = false;
+    _code.push_back(op);
+}
+
+
+/* The values of a constant array or table are built by the instructions right
+ * before it. These instructions (with the PARY/PTBL/PTBX) are moved to the
+ * constant pool, and nested constants are copied into the new one, so that
+ * each constant is self-contained. Tables with a prototype are not folded.
+ *
+ * Arrays are immutable, so the VM builds constant arrays once per execution;
+ * tables are built again every time the PCON runs. */
+void Bytecode::AddFolded(Opcode op, uint16_t n)
+{
+    if(op != PARY && op != PTBL && op != PTBX) {
+        throw invalid_argument("Opcode " + opcode_names[op] + " can't be folded");
+    }
+    size_t count = (op == PARY) ? n : (op == PTBL) ? n * 3U + 1 : n * 2U + 1;
+
+    if(count > _const_run.size()) {
+        Add(op, n);
+        return;
+    }
+    uint64_t start = (count == 0) ? _code.size() : _const_run[_const_run.size() - count];
+    if(op != PARY && _code[start] != PNIL) {        // prototype
+        Add(op, n);
+        return;
+    }
+
+    vector<uint8_t> constant;
+    size_t first_nested = _constants.size();
+    for(size_t pos = start; pos < _code.size(); pos += OpcodeSize(static_cast<Opcode>(_code[pos]))) {
+        if(_code[pos] == PCON) {
+            uint32_t idx = GetCode<uint32_t>(pos + 1);
+            first_nested = min(first_nested, static_cast<size_t>(idx));
+            constant.insert(end(constant), begin(_constants[idx]), end(_constants[idx]));
+        } else {
+            constant.insert(end(constant), begin(_code) + static_cast<ssize_t>(pos),
+                    begin(_code) + static_cast<ssize_t>(pos + OpcodeSize(static_cast<Opcode>(_code[pos]))));
+        }
+    }
+    constant.push_back(op);
+    constant.push_back(static_cast<uint8_t>(n & 0xFF));
+    constant.push_back(static_cast<uint8_t>(n >> 8));
+
+    // the nested constants were the last ones added, and are not used anywhere else
+    _constants.resize(first_nested);
+    _constants.push_back(move(constant));
+    _code.resize(start);
+    _const_run.resize(_const_run.size() - count);
+    Add(PCON, static_cast<uint32_t>(_constants.size() - 1));
+}
+
 // }}}
 
 // {{{ LABELS
 
 Label Bytecode::CreateLabel()
 {
-    _labels.push_back({ NO_ADDRESS, {} });
+    _labels.push_back({ NO_ADDRESS, {}, {} });
     return _labels.size() - 1;
 }
 
@@ -186,6 +275,8 @@ Label Bytecode::CreateLabel()
 void Bytecode::SetLabel(Label const& lbl)
 {
     _labels[lbl].address = _code.size();
+    _const_run.clear();         // code might jump here: the values before it are not known
+    _last_call = UINT64_MAX;    // ...and the code after it doesn't always follow the last call
 }
 
 
@@ -199,6 +290,14 @@ uint64_t Bytecode::AddLabel(Label const& lbl)
 }
 
 
+double Bytecode::AddLabelNumber(Label const& lbl)
+{
+    _labels[lbl].number_refs.push_back(_code.size() + 1);
+    _address_next = true;
+    return 0;
+}
+
+
 void Bytecode::AdjustLabels()
 {
     for(auto const& label: _labels) {
@@ -208,8 +307,13 @@ void Bytecode::AdjustLabels()
             // overwrite 8 bytes of code with address
             memcpy(&_code[ref], &label.address, 8);
         }
+        for(auto const& ref: label.number_refs) {
+            double address = static_cast<double>(label.address);
+            memcpy(&_code[ref], &address, 8);
+        }
     }
     _labels.clear();
+    _resolved = true;
 }
 
 
@@ -220,6 +324,263 @@ uint64_t Bytecode::CurrentPos() const
 
 /// }}}
 
+// {{{ OPTIMIZATION
+
+/* The optimizer works on the code while the labels are still symbolic, so
+ * that instructions can be removed: `Rewrite` then moves every label to its
+ * new address. Code loaded from a ZB image (or already generated) has only
+ * plain addresses, and is not optimized. */
+void Bytecode::Optimize(unsigned level)
+{
+    if(level == 0 || _resolved) {
+        return;
+    }
+
+    bool changed;
+    do {
+        vector<bool> removed(_code.size(), false);
+        changed = RemoveDeadPushes(removed);
+        if(level >= 2) {
+            changed = RemoveEmptyScopes(removed) || changed;
+        }
+        if(changed) {
+            Rewrite(removed);
+        }
+    } while(changed && level >= 2);
+
+    vector<bool> removed(_code.size(), false);
+    map<size_t, vector<uint8_t>> replaced;
+    if(Fuse(removed, replaced)) {
+        Rewrite(removed, replaced);
+    }
+
+    ThreadJumps();
+
+    if(level >= 2) {
+        vector<bool> removed(_code.size(), false);
+        if(RemoveJumpsToNext(removed)) {
+            Rewrite(removed);
+        }
+    }
+}
+
+
+// push followed by a POP: both are removed, unless the POP is a jump target
+bool Bytecode::RemoveDeadPushes(vector<bool>& removed) const
+{
+    vector<bool> target(_code.size() + 1, false), operand(_code.size() + 1, false);
+    for(auto const& label: _labels) {
+        if(label.address != NO_ADDRESS) {
+            target[label.address] = true;
+        }
+        for(auto ref: label.refs) {
+            operand[ref - 1] = true;
+        }
+        for(auto ref: label.number_refs) {
+            operand[ref - 1] = true;
+        }
+    }
+
+    bool changed = false;
+    size_t pos = 0;
+    while(pos < _code.size()) {
+        size_t next = pos + OpcodeSize(static_cast<Opcode>(_code[pos]));
+        switch(_code[pos]) {
+            case PNIL: case PBF: case PBT: case PN8: case PNUM: case PSTR: case PCON: case GVAR: case GLOC:
+                if(next < _code.size() && _code[next] == POP && !target[next] && !operand[pos]) {
+                    removed[pos] = removed[next] = true;
+                    changed = true;
+                    next += OpcodeSize(POP);
+                }
+                break;
+            default:
+                break;
+        }
+        pos = next;
+    }
+    return changed;
+}
+
+
+// PSHS/POPS pairs that don't create any variables in their own level
+bool Bytecode::RemoveEmptyScopes(vector<bool>& removed) const
+{
+    struct Scope {
+        size_t pos;
+        bool   vars;
+    };
+    vector<Scope> scopes;
+
+    bool changed = false;
+    for(size_t pos = 0; pos < _code.size(); pos += OpcodeSize(static_cast<Opcode>(_code[pos]))) {
+        switch(_code[pos]) {
+            case PSHS:
+                scopes.push_back({ pos, false });
+                break;
+            case CVAR:
+            case CMVAR:
+                if(!scopes.empty()) {
+                    scopes.back().vars = true;
+                }
+                break;
+            case POPS:
+                if(scopes.empty()) {
+                    return changed;     // unbalanced code: leave it alone
+                }
+                if(!scopes.back().vars) {
+                    removed[scopes.back().pos] = removed[pos] = true;
+                    changed = true;
+                }
+                scopes.pop_back();
+                break;
+            default:
+                break;
+        }
+    }
+    return changed;
+}
+
+
+/* Superinstructions replace the sequences that are most common in real code
+ * (found with ZProfile), saving the dispatch of the instructions:
+ *
+ *   GVAR n; PSTR k; GET    ->  GETF n, k
+ *   PN8 x; CVAR            ->  CVN8 x
+ *   GVAR n; CALL 0, o      ->  CALLV n, 0, o       (with arguments, the GVAR would be the last one)
+ *
+ * The instructions after the first must not be jump targets. */
+bool Bytecode::Fuse(vector<bool>& removed, map<size_t, vector<uint8_t>>& replaced) const
+{
+    vector<bool> target(_code.size() + 1, false);
+    for(auto const& label: _labels) {
+        if(label.address != NO_ADDRESS) {
+            target[label.address] = true;
+        }
+    }
+
+    vector<size_t> ins;     // positions of the last instructions
+    bool changed = false;
+    for(size_t pos = 0; pos < _code.size(); pos += OpcodeSize(static_cast<Opcode>(_code[pos]))) {
+        if(target[pos]) {
+            ins.clear();
+        }
+        ins.push_back(pos);
+        if(ins.size() > 3) {
+            ins.erase(begin(ins));
+        }
+        size_t n = ins.size();
+
+        vector<uint8_t> fused;
+        size_t first = 0;
+        if(_code[pos] == GET && n >= 3 && _code[ins[n-3]] == GVAR && _code[ins[n-2]] == PSTR) {
+            first = ins[n-3];
+            fused = { GETF };
+            fused.insert(end(fused), &_code[first + 1], &_code[first + 5]);
+            fused.insert(end(fused), &_code[ins[n-2] + 1], &_code[ins[n-2] + 5]);
+        } else if(_code[pos] == CVAR && n >= 2 && _code[ins[n-2]] == PN8) {
+            first = ins[n-2];
+            fused = { CVN8, _code[first + 1] };
+        } else if(_code[pos] == CALL && _code[pos + 1] == 0 && n >= 2 && _code[ins[n-2]] == GVAR) {
+            first = ins[n-2];
+            fused = { CALLV };
+            fused.insert(end(fused), &_code[first + 1], &_code[first + 5]);
+            fused.insert(end(fused), &_code[pos + 1], &_code[pos + 3]);
+        } else {
+            continue;
+        }
+
+        replaced[first] = fused;
+        for(size_t i = n - 1; ins[i] != first; --i) {
+            removed[ins[i]] = true;
+        }
+        ins.clear();        // the superinstruction can't be part of another one
+        changed = true;
+    }
+    return changed;
+}
+
+
+// a label that points to a JMP is moved to the destination of the JMP
+void Bytecode::ThreadJumps()
+{
+    vector<Label> jump_to(_code.size() + 1, NO_ADDRESS);     // label of the JMP at each position
+    for(Label lbl = 0; lbl < _labels.size(); ++lbl) {
+        for(auto ref: _labels[lbl].refs) {
+            if(_code[ref - 1] == JMP) {
+                jump_to[ref - 1] = lbl;
+            }
+        }
+    }
+
+    for(auto& label: _labels) {
+        // bounded, as jumps might form a loop
+        for(size_t i = 0; i < _labels.size() && label.address != NO_ADDRESS && jump_to[label.address] != NO_ADDRESS; ++i) {
+            label.address = _labels[jump_to[label.address]].address;
+        }
+    }
+}
+
+
+bool Bytecode::RemoveJumpsToNext(vector<bool>& removed) const
+{
+    bool changed = false;
+    for(auto const& label: _labels) {
+        for(auto ref: label.refs) {
+            if(_code[ref - 1] == JMP && label.address == ref - 1 + OpcodeSize(JMP)) {
+                removed[ref - 1] = true;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+
+// removes the instructions marked in `removed` (and replaces the ones in
+// `replaced`), and fixes the labels
+void Bytecode::Rewrite(vector<bool> const& removed, map<size_t, vector<uint8_t>> const& replaced)
+{
+    vector<uint8_t> code;
+    code.reserve(_code.size());
+    vector<uint64_t> new_pos(_code.size() + 1, NO_ADDRESS);
+
+    for(size_t pos = 0; pos < _code.size(); ) {
+        size_t sz = OpcodeSize(static_cast<Opcode>(_code[pos]));
+        new_pos[pos] = code.size();
+        auto it = replaced.find(pos);
+        if(it != replaced.end()) {
+            code.insert(end(code), begin(it->second), end(it->second));
+        } else if(!removed[pos]) {
+            code.insert(end(code), begin(_code) + static_cast<ssize_t>(pos), begin(_code) + static_cast<ssize_t>(pos + sz));
+        }
+        pos += sz;
+    }
+    new_pos[_code.size()] = code.size();
+
+    auto fix_refs = [&](vector<uint64_t>& refs) {
+        vector<uint64_t> fixed;
+        for(auto ref: refs) {
+            if(!removed[ref - 1]) {
+                fixed.push_back(new_pos[ref - 1] + 1);
+            }
+        }
+        refs = move(fixed);
+    };
+    for(auto& label: _labels) {
+        if(label.address != NO_ADDRESS) {
+            label.address = new_pos[label.address];
+        }
+        fix_refs(label.refs);
+        fix_refs(label.number_refs);
+    }
+
+    _code = move(code);
+    _const_run.clear();
+    _last_call = UINT64_MAX;
+}
+
+// }}}
+
 // {{{ CREATE VARIABLE
 
 void Bytecode::CreateVariable(string const& name, bool mut)
@@ -229,12 +590,17 @@ void Bytecode::CreateVariable(string const& name, bool mut)
             throw zoe_syntax_error("Variable '" + name + "' already exists.");
         }
     }
-    _vars.push_back({ name, mut });
+    _vars.push_back({ name, mut, false });
 }
 
 
-uint32_t Bytecode::GetVariableIndex(string const& name, bool* mut)
+uint32_t Bytecode::GetVariableIndex(string const& name, bool* mut, VariableType* type)
 {
+    VariableType t;
+    if(!type) {
+        type = &t;
+    }
+
     uint32_t i = static_cast<uint32_t>(_vars.size());
     for(auto it = rbegin(_vars); it != rend(_vars); ++it) {
         --i;
@@ -242,7 +608,22 @@ uint32_t Bytecode::GetVariableIndex(string const& name, bool* mut)
             if(mut) {
                 *mut = it->mut;
             }
-            return i;
+
+            // level of the function of the variable (0 is the top level)
+            size_t level = 0;
+            while(level < _functions.size() && _functions[level].vars <= i) {
+                ++level;
+            }
+            bool global = (_scopes.size() == 1 || i < _scopes[1]);
+            if(level == _functions.size()) {
+                *type = (level == 0) ? GLOBAL : LOCAL;      // the top level has no frame
+                return (level == 0) ? i : i - _functions.back().vars;
+            } else if(level == 0 && global) {
+                *type = GLOBAL;
+                return i;
+            }
+            *type = UPVALUE;
+            return Capture(_functions.size(), level, i);
         }
     }
 
@@ -250,6 +631,34 @@ uint32_t Bytecode::GetVariableIndex(string const& name, bool* mut)
 }
 
 
+/* Index, in the upvalues of the function at `level`, of the variable `var`,
+ * that belongs to the function at `var_level`. The functions in between
+ * capture it too, so that it can be passed down when the closures are
+ * created. */
+uint32_t Bytecode::Capture(size_t level, size_t var_level, uint32_t var)
+{
+    Upvalue up;
+    if(level - 1 == var_level) {
+        up = { true, var - ((var_level == 0) ? 0 : _functions[var_level - 1].vars) };
+        _vars[var].captured = true;
+    } else {
+        up = { false, Capture(level - 1, var_level, var) };
+    }
+
+    vector<Upvalue>& upvalues = _functions[level - 1].upvalues;
+    for(size_t n = 0; n < upvalues.size(); ++n) {
+        if(upvalues[n].local == up.local && upvalues[n].index == up.index) {
+            return static_cast<uint32_t>(n);
+        }
+    }
+    if(upvalues.size() == UINT8_MAX) {
+        throw zoe_syntax_error("Too many variables captured by a function.");
+    }
+    upvalues.push_back(up);
+    return static_cast<uint32_t>(upvalues.size() - 1);
+}
+
+
 void Bytecode::PushScope()
 {
     _scopes.push_back(static_cast<uint32_t>(_vars.size()));
@@ -264,6 +673,62 @@ void Bytecode::PopScope()
     _vars.erase(begin(_vars) + last, end(_vars));
 }
 
+
+/* Escape analysis: the variables captured by closures were marked when the
+ * closures were compiled. Only the scopes with such variables need to close
+ * their upvalues (at the end of a function, the VM closes them on RET). */
+void Bytecode::CloseScope()
+{
+    uint32_t first = _scopes.back();
+    for(size_t i = first; i < _vars.size(); ++i) {
+        if(_vars[i].captured) {
+            Add(CLOSE, first - (_functions.empty() ? 0 : _functions.back().vars));
+            return;
+        }
+    }
+}
+
+// }}}
+
+// {{{ FUNCTIONS
+
+/* The parameters of a function are its first variables, followed by its
+ * locals. In the VM, they live in the frame of the call. */
+void Bytecode::PushFunction()
+{
+    PushScope();
+    _functions.push_back({ static_cast<uint32_t>(_vars.size()), {} });
+}
+
+
+vector<Bytecode::Upvalue> Bytecode::PopFunction()
+{
+    vector<Upvalue> upvalues = move(_functions.back().upvalues);
+    _functions.pop_back();
+    PopScope();
+    return upvalues;
+}
+
+
+/* A call is in tail position when its value is the value of the function:
+ * only the POPS (and CLOSE) that end the blocks of the function come after
+ * it. A TAILCALL reuses the frame of the function (the POPS are not
+ * executed, as the frame is discarded). */
+bool Bytecode::MarkTailCall()
+{
+    if(_functions.empty() || _last_call == UINT64_MAX) {     // no call since the last label
+        return false;
+    }
+    for(size_t pos = _last_call + OpcodeSize(CALL); pos < _code.size(); pos += OpcodeSize(static_cast<Opcode>(_code[pos]))) {
+        if(_code[pos] != POPS && _code[pos] != CLOSE) {
+            return false;
+        }
+    }
+    _code[_last_call] = TAILCALL;
+    _last_call = UINT64_MAX;
+    return true;
+}
+
 // }}}
 
 // {{{ DISASSEMBLER
@@ -288,39 +753,64 @@ string Bytecode::Disassemble() const
         pos += sz;
     }
 
+    for(size_t i = 0; i < _constants.size(); ++i) {
+        ss << "constant " << i << ":\n";
+        for(size_t p = 0; p < _constants[i].size(); p += OpcodeSize(static_cast<Opcode>(_constants[i][p]))) {
+            ss << "             " << DisassembleInstruction(&_constants[i][p], [this](uint32_t idx) { return _strings.at(idx).str; }) << "\n";
+        }
+    }
+
     return ss.str();
 }
 
 
 string Bytecode::DisassembleOpcode(size_t pos) const
 {
-    auto n = GetCode<uint8_t>(pos);
+    return DisassembleInstruction(&_code.at(pos), [this](uint32_t idx) { return _strings.at(idx).str; });
+}
+
+
+string Bytecode::DisassembleInstruction(uint8_t const* ins, function<string(uint32_t)> const& get_string)
+{
+    auto get = [ins](size_t pos, auto t) {
+        memcpy(&t, ins + pos, sizeof t);
+        return t;
+    };
+
+    uint8_t n = ins[0];
     stringstream ss;
     for(auto c: opcode_names[n]) {
         ss << static_cast<char>(tolower(c));
     }
-    ss << string(8 - opcode_names[n].size(), ' ');
+    ss << string((opcode_names[n].size() < 8) ? 8 - opcode_names[n].size() : 1, ' ');
     ss << setfill('0') << hex << uppercase;
     switch(opcode_pars[n]) {
         case '1':
-            ss << static_cast<int>(GetCode<uint8_t>(pos+1));
+            ss << static_cast<int>(ins[1]);
             break;
         case '2':
-            ss << GetCode<uint16_t>(pos+1);
+            ss << get(1, uint16_t());
             break;
         case '4':
-            ss << GetCode<uint32_t>(pos+1);
+            ss << get(1, uint32_t());
             break;
         case '8':
-            ss << GetCode<uint64_t>(pos+1);
+            ss << get(1, uint64_t());
             break;
         case 'd':
-            ss << GetCode<double>(pos+1);
+            ss << get(1, double());
             break;
-        case 's': {
-                String s = _strings.at(GetCode<uint32_t>(pos+1));
-                ss << "'" << s.str << "'";
-            }
+        case 's':
+            ss << "'" << get_string(get(1, uint32_t())) << "'";
+            break;
+        case 'f':
+            ss << get(1, uint32_t()) << ", '" << get_string(get(5, uint32_t())) << "'";
+            break;
+        case 'p':
+            ss << static_cast<int>(ins[1]) << ", " << static_cast<int>(ins[2]);
+            break;
+        case 'c':
+            ss << get(1, uint32_t()) << ", " << static_cast<int>(ins[5]);
             break;
     }
 
@@ -330,17 +820,11 @@ string Bytecode::DisassembleOpcode(size_t pos) const
 
 size_t Bytecode::OpcodeSize(Opcode op)
 {
-    switch(opcode_pars[op]) {
-        case '0': return 1;
-        case '1': return 2;
-        case '2': return 3;
-        case '4': return 5;
-        case '8': return 9;
-        case 'd': return 9;
-        case 's': return 5;
-        case 'p': return 3;
-        default: abort();
+    size_t sz = opcode_size(op);
+    if(sz == 0) {
+        abort();
     }
+    return sz;
 }
 
 // }}}
@@ -3,6 +3,8 @@
 
 #include <cassert>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <stack>
 #include <string>
 #include <vector>
@@ -18,7 +20,9 @@ public:
 
     // read/write code
     explicit Bytecode(vector<uint8_t> const& from_zb);
+    explicit Bytecode(class BytecodeView const& view);
     vector<uint8_t> GenerateZB();
+    static bool ValidMagic(uint8_t const* data);
 
     // parse code
     explicit Bytecode(string const& code);
@@ -34,6 +38,11 @@ public:
     void Add(Opcode op, string const& s);
     void Add(Opcode op, uint8_t pars, uint8_t optpars);
 
+    // add PARY, PTBL or PTBX. If all the values used by the instruction
+    // were pushed by constant instructions, they are replaced by a single
+    // PCON, that pushes a value from the constant pool.
+    void AddFolded(Opcode op, uint16_t n);
+
     // read code
     // {{{ T GetCode(uint64_t pos) const;
     template<typename T> typename enable_if<sizeof(T) == 1, T>::type GetCode(uint64_t pos) const {
@@ -50,44 +59,91 @@ public:
     struct LabelRef {
         uint64_t         address;
         vector<uint64_t> refs;
+        vector<uint64_t> number_refs;       // address pushed as a number (PNUM)
     };
     Label CreateLabel();
     void  SetLabel(Label const& lbl);
     uint64_t AddLabel(Label const& lbl);
+    double   AddLabelNumber(Label const& lbl);
     uint64_t CurrentPos() const;
 
-    // variables
+    // optimization (must happen before GenerateZB)
+    //   level 1: remove values pushed and popped right away, thread jumps to jumps,
+    //            replace common sequences by superinstructions
+    //   level 2: also remove scopes without variables and jumps to the next
+    //            instruction, and repeat until the code doesn't change
+    void Optimize(unsigned level);
+
+    // variables: the variables of a function (its parameters and locals) are
+    // LOCAL, and indexed from the start of its frame. The ones created outside
+    // of any function are GLOBAL, except the ones inside blocks, that are
+    // locals of the top level. The locals of the enclosing functions are
+    // captured as UPVALUEs, and indexed in the upvalues of the function.
+    enum VariableType { GLOBAL, LOCAL, UPVALUE };
     void     CreateVariable(string const& name, bool mut);
-    uint32_t GetVariableIndex(string const& name, bool* mut);
+    uint32_t GetVariableIndex(string const& name, bool* mut, VariableType* type=nullptr);
     void     PushScope();
     void     PopScope();
+    void     CloseScope();      // adds a CLOSE, if the variables of the scope were captured
+
+    // functions
+    struct Upvalue {
+        bool     local;     // a variable of the enclosing function, or one of its upvalues
+        uint32_t index;
+    };
+    void            PushFunction();
+    vector<Upvalue> PopFunction();     // returns the variables captured by the function
+    bool            MarkTailCall();    // the last CALL becomes a TAILCALL, if nothing but POPS follows it
 
     // get information
     struct String {
         string   str;
         uint64_t hash;
     };
-    vector<uint8_t> const& Code() const { return _code; }
-    vector<String> const&  Strings() const { return _strings; }
+    vector<uint8_t> const&         Code() const { return _code; }
+    vector<String> const&          Strings() const { return _strings; }
+    vector<vector<uint8_t>> const& Constants() const { return _constants; }
     string Disassemble() const;
     string DisassembleOpcode(size_t pos) const;
+    static string DisassembleInstruction(uint8_t const* ins, function<string(uint32_t)> const& get_string);
     static size_t OpcodeSize(Opcode op);
 
 private:
     vector<uint8_t>  _code = {};
     vector<String>   _strings = {};
     vector<LabelRef> _labels = {};
+    bool             _resolved = false;     // labels were replaced by addresses
+
+    // constant pool: each constant is the code that builds it (see AddFolded)
+    vector<vector<uint8_t>> _constants = {};
+    vector<uint64_t>        _const_run = {};        // positions of the constant pushes at the end of the code
+    bool                    _address_next = false;  // the next instruction pushes an address (not a constant)
 
     struct Variable {
         string name;
         bool   mut;
+        bool   captured;
+    };
+    struct Function {
+        uint32_t        vars;       // first variable
+        vector<Upvalue> upvalues;
     };
     vector<Variable> _vars = {};
     vector<uint32_t> _scopes = { 0 };
+    vector<Function> _functions = {};           // functions being compiled
+    uint64_t         _last_call = UINT64_MAX;   // position of the last CALL
 
+    void     AddOpcode(Opcode op);
+    uint32_t Capture(size_t level, size_t var_level, uint32_t var);
     void AdjustLabels();
-
-    constexpr static uint8_t _MAGIC[] { 0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00 };
+    bool RemoveDeadPushes(vector<bool>& removed) const;
+    bool RemoveEmptyScopes(vector<bool>& removed) const;
+    bool RemoveJumpsToNext(vector<bool>& removed) const;
+    bool Fuse(vector<bool>& removed, map<size_t, vector<uint8_t>>& replaced) const;
+    void ThreadJumps();
+    void Rewrite(vector<bool> const& removed, map<size_t, vector<uint8_t>> const& replaced = {});
+
+    constexpr static uint8_t _MAGIC[] { 0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00 };
 };
 
 #endif
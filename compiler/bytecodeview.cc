@@ -0,0 +1,155 @@
+#include "compiler/bytecodeview.hh"
+
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+#include "compiler/bytecode.hh"
+#include "vm/opcode.hh"
+#include "vm/zstring.hh"
+
+BytecodeView::BytecodeView(uint8_t const* data, size_t size)
+    : _data(data), _size(size)
+{
+    if(_size < 24 || !Bytecode::ValidMagic(_data)) {
+        throw runtime_error("Not a valid ZB file.");
+    }
+
+    // code
+    uint64_t str_pos, const_pos;
+    memcpy(&str_pos, _data + 8, 8);
+    memcpy(&const_pos, _data + 16, 8);
+    if(str_pos < 24 || str_pos > _size) {
+        throw runtime_error("Not a valid ZB file (invalid string position).");
+    }
+    if(const_pos < 24 || const_pos > str_pos) {
+        throw runtime_error("Not a valid ZB file (invalid constant pool position).");
+    }
+    _code = _data + 24;
+    _code_size = const_pos - 24;
+
+    // constants
+    for(uint64_t pos = const_pos; pos < str_pos; ) {
+        uint32_t sz = 0;
+        if(str_pos - pos >= 4) {
+            memcpy(&sz, _data + pos, 4);
+        }
+        if(str_pos - pos < 4 || str_pos - pos - 4 < sz) {
+            throw runtime_error("Not a valid ZB file (corrupted constant pool).");
+        }
+        _constants.push_back({ _data + pos + 4, sz, true });
+        pos += 4 + sz;
+    }
+
+    // strings
+    while(str_pos < _size) {
+        char const* s = reinterpret_cast<char const*>(_data + str_pos);
+        auto nul = find(_data + str_pos, _data + _size, 0);
+        if(nul == _data + _size || static_cast<size_t>(_data + _size - nul) < 9) {
+            throw runtime_error("Not a valid ZB file (corrupted string table).");
+        }
+        String str = { s, static_cast<size_t>(nul - (_data + str_pos)), 0 };
+        memcpy(&str.hash, nul + 1, 8);
+        if(str.hash != ZString::HashOf(str.str, str.len)) {     // interning relies on it
+            throw runtime_error("Not a valid ZB file (invalid string hash).");
+        }
+        _strings.push_back(str);
+        str_pos += str.len + 9;
+    }
+
+    for(auto& c: _constants) {
+        ValidateConstant(c);
+    }
+    ValidateCode();
+}
+
+
+void BytecodeView::ValidateCode() const
+{
+    // the interpreter trusts that every opcode is valid and complete, that
+    // every string exists, and that jumps land on an instruction (or at the
+    // end of the code), so this is checked beforehand
+    vector<bool> instruction(_code_size + 1, false);
+    instruction[_code_size] = true;
+    size_t p = 0;
+    while(p < _code_size) {
+        instruction[p] = true;
+        uint8_t op = _code[p];
+        if(op >= opcode_count || opcode_quickened(op)) {
+            throw domain_error("Invalid opcode " + to_string(op));
+        }
+        if(p + opcode_size(op) > _code_size) {
+            throw domain_error("Incomplete instruction at the end of the code");
+        }
+        if(opcode_pars[op] == 's' && GetCode<uint32_t>(p+1) >= _strings.size()) {
+            throw domain_error("Invalid string index " + to_string(GetCode<uint32_t>(p+1)));
+        }
+        if(opcode_pars[op] == 'f' && GetCode<uint32_t>(p+5) >= _strings.size()) {
+            throw domain_error("Invalid string index " + to_string(GetCode<uint32_t>(p+5)));
+        }
+        if(op == PCON && GetCode<uint32_t>(p+1) >= _constants.size()) {
+            throw domain_error("Invalid constant index " + to_string(GetCode<uint32_t>(p+1)));
+        }
+        p += opcode_size(op);
+    }
+
+    for(p = 0; p < _code_size; p += opcode_size(_code[p])) {
+        if(_code[p] == JMP || _code[p] == BT) {
+            uint64_t target = GetCode<uint64_t>(p+1);
+            if(target > _code_size || !instruction[target]) {
+                throw domain_error("Invalid jump target " + to_string(target));
+            }
+        }
+    }
+}
+
+
+void BytecodeView::ValidateConstant(Constant& c) const
+{
+    // a constant can only push values and build arrays and tables with them,
+    // and must leave exactly one value
+    size_t p = 0, depth = 0;
+    auto get16 = [&]() { uint16_t v; memcpy(&v, c.code + p + 1, 2); return static_cast<size_t>(v); };
+    while(p < c.size) {
+        uint8_t op = c.code[p];
+        if(op >= opcode_count || p + opcode_size(op) > c.size) {
+            throw domain_error("Invalid constant");
+        }
+        size_t used = 0;
+        switch(op) {
+            case PNIL: case PBF: case PBT: case PN8: case PNUM:
+                break;
+            case PSTR: {
+                    uint32_t idx;
+                    memcpy(&idx, c.code + p + 1, 4);
+                    if(idx >= _strings.size()) {
+                        throw domain_error("Invalid string index " + to_string(idx));
+                    }
+                }
+                break;
+            case PARY: used = get16(); break;
+            case PTBL: used = get16() * 3 + 1; c.shared = false; break;
+            case PTBX: used = get16() * 2 + 1; c.shared = false; break;
+            default:
+                throw domain_error("Invalid instruction in constant: " + opcode_names[op]);
+        }
+        if(used > depth) {
+            throw domain_error("Invalid constant");
+        }
+        depth = depth - used + 1;
+        p += opcode_size(op);
+    }
+    if(depth != 1) {
+        throw domain_error("Invalid constant");
+    }
+}
+
+
+string BytecodeView::DisassembleOpcode(size_t pos) const
+{
+    return Bytecode::DisassembleInstruction(_code + pos, [this](uint32_t idx) { 
+        return string(_strings.at(idx).str, _strings.at(idx).len); 
+    });
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,70 @@
+#ifndef COMPILER_BYTECODEVIEW_H_
+#define COMPILER_BYTECODEVIEW_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+// A BytecodeView is a read-only window over a ZB image (as generated by
+// `Bytecode::GenerateZB`). The header is parsed and the code is validated
+// once, in the constructor, and nothing is copied: the view points directly
+// to the image, that must outlive it.
+class BytecodeView {
+public:
+    BytecodeView(uint8_t const* data, size_t size);
+    explicit BytecodeView(vector<uint8_t> const& zb) : BytecodeView(zb.data(), zb.size()) {}
+    BytecodeView(BytecodeView const&) = default;
+    BytecodeView& operator=(BytecodeView const&) = default;
+
+    struct String {
+        char const* str;
+        size_t      len;
+        uint64_t    hash;
+    };
+
+    // image
+    uint8_t const* Data() const     { return _data; }
+    size_t         Size() const     { return _size; }
+
+    // code
+    uint8_t const* Code() const     { return _code; }
+    size_t         CodeSize() const { return _code_size; }
+    template<typename T> T GetCode(uint64_t pos) const {
+        T t;
+        memcpy(&t, _code + pos, sizeof(T));
+        return t;
+    }
+
+    // string table
+    size_t        StringCount() const { return _strings.size(); }
+    String const& GetString(uint32_t idx) const { return _strings[idx]; }   // index is validated with the code
+
+    // constant pool
+    struct Constant {
+        uint8_t const* code;        // instructions that build the constant
+        size_t         size;
+        bool           shared;      // true if it has no tables, so the same value can always be used
+    };
+    size_t          ConstantCount() const { return _constants.size(); }
+    Constant const& GetConstant(uint32_t idx) const { return _constants[idx]; }
+
+    // debugging
+    string DisassembleOpcode(size_t pos) const;
+
+private:
+    uint8_t const*   _data;
+    size_t           _size;
+    uint8_t const*   _code = nullptr;
+    size_t           _code_size = 0;
+    vector<String>   _strings = {};     // pointers to the strings in the image
+    vector<Constant> _constants = {};
+
+    void ValidateCode() const;
+    void ValidateConstant(Constant& c) const;
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
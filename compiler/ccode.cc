@@ -0,0 +1,246 @@
+#include "compiler/ccode.hh"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <set>
+#include <sstream>
+
+#include "compiler/bytecodeview.hh"
+#include "compiler/compiledchunk.hh"
+
+// {{{ CODE GENERATION
+
+// a C++ literal for a number, or "" if there's none (NaN and infinities,
+// found by their bits, as the release build assumes finite math)
+static string number_literal(double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof bits);
+    if((bits & 0x7FF0000000000000) == 0x7FF0000000000000) {
+        return "";
+    }
+    stringstream ss;
+    ss << setprecision(numeric_limits<double>::max_digits10) << v;
+    string s = ss.str();
+    if(s.find_first_of(".e") == string::npos) {
+        s += ".0";
+    }
+    return s;
+}
+
+
+// text that can be safely placed in a comment
+static string comment(string s)
+{
+    for(char& c: s) {
+        if(c == '\\' || static_cast<unsigned char>(c) < 0x20) {
+            c = '?';
+        }
+    }
+    return s;
+}
+
+
+string GenerateCpp(uint8_t const* image, size_t image_size, string const& source_name)
+{
+    CompiledChunk chunk(BytecodeView(image, image_size));
+    BytecodeView const& view = chunk.View();
+    uint8_t const* const code = view.Code();
+    size_t const size = view.CodeSize();
+    auto operand = [code](size_t pos, auto t) {
+        memcpy(&t, code + pos + 1, sizeof t);
+        return t;
+    };
+
+    set<uint8_t> shared;
+#define X(op) shared.insert(op);
+    SHARED_OPCODES
+#undef X
+
+    // find the targets of the jumps (gotos), and of calls and returns (dispatched by a switch)
+    set<uint64_t> labels, dispatch(begin(chunk.Functions()), end(chunk.Functions()));
+    for(size_t p = 0; p < size; p += opcode_size(code[p])) {
+        switch(code[p]) {
+            case JMP:
+            case BT:
+                labels.insert(operand(p, uint64_t()));
+                break;
+            case CALL:
+            case CALLV:
+            case RESUME:        // continued by RET or YIELD
+            case YIELD:         // continued by RESUME
+                dispatch.insert(p + opcode_size(code[p]));
+                break;
+            default:
+                break;
+        }
+    }
+    labels.insert(begin(dispatch), end(dispatch));
+
+    stringstream ss;
+    ss << setfill('0') << hex << uppercase;
+    auto label = [&](uint64_t addr) {
+        stringstream l;
+        l << "L_" << setfill('0') << hex << uppercase << setw(8) << addr;
+        return l.str();
+    };
+    auto line = [&](uint64_t p, string const& statement) {
+        string prefix = labels.count(p) ? label(p) + ":" : "";
+        ss << prefix << string(16 - prefix.size(), ' ') << statement;
+        if(statement.size() < 48) {
+            ss << string(48 - statement.size(), ' ');
+        }
+        ss << "  // " << comment(view.DisassembleOpcode(p)) << "\n";
+    };
+    auto hexnum = [](uint64_t n) {
+        stringstream h;
+        h << "0x" << hex << uppercase << n;
+        return h.str();
+    };
+
+    ss << "// Generated by `zoe --emit-c` from '" << comment(source_name) << "'. Do not edit.\n\n";
+    ss << "#include \"compiler/ccode.hh\"\n";
+    ss << "#include \"vm/exceptions.hh\"\n";
+    ss << "#include \"vm/zinstructions.hh\"\n";
+    ss << "#include \"vm/zoevm.hh\"\n\n";
+
+    // the image
+    ss << "static const uint8_t image[] = {";
+    for(size_t i = 0; i < image_size; ++i) {
+        ss << ((i % 16 == 0) ? "\n    " : " ") << "0x" << setw(2) << static_cast<int>(image[i]) << ",";
+    }
+    ss << "\n};\n\n";
+
+    ss << "static void run(ZoeVM::Native& z)\n{\n";
+    ss << "    ZoeVM& vm = z.VM();\n";
+    ss << "    uint8_t const* const code = z.Code();\n";
+    ss << "    (void) vm; (void) code;\n";
+    if(!dispatch.empty()) {
+        ss << "    uint64_t addr;\n";
+    }
+    ss << "\n";
+
+    for(size_t p = 0; p < size; p += opcode_size(code[p])) {
+        uint8_t op = code[p];
+        string number;
+        switch(op) {
+            case PNIL:
+                line(p, "vm.Push(nullptr);");
+                break;
+            case PBT:
+            case PBF:
+                line(p, string("vm.Push(ZBox(") + ((op == PBT) ? "true" : "false") + "));");
+                break;
+            case PN8:
+                line(p, "vm.Push(ZBox(" + number_literal(operand(p, uint8_t())) + "));");
+                break;
+            case PNUM:
+                number = number_literal(operand(p, double()));
+                if(number.empty()) {
+                    line(p, "z.Step<PNUM>(code + " + hexnum(p) + ");");
+                } else {
+                    line(p, "vm.Push(ZBox(" + number + "));");
+                }
+                break;
+            case POP:
+                line(p, "vm.Pop();");
+                break;
+            case JMP:
+                line(p, "goto " + label(operand(p, uint64_t())) + ";");
+                break;
+            case CALL:
+                line(p, "addr = z.Call(" + to_string(code[p + 1]) + ", " + hexnum(p + opcode_size(op)) + "); goto dispatch;");
+                break;
+            case CALLV:
+                line(p, "addr = z.CallVariable(" + to_string(operand(p, uint32_t())) + ", " + to_string(code[p + 5]) + ", " +
+                        hexnum(p + opcode_size(op)) + "); goto dispatch;");
+                break;
+            case TAILCALL:
+                line(p, "addr = z.TailCall(" + to_string(code[p + 1]) + "); goto dispatch;");
+                break;
+            case RET:
+                line(p, "addr = z.Return(); goto dispatch;");
+                break;
+            case RESUME:
+                line(p, "addr = z.Resume(" + hexnum(p + opcode_size(op)) + "); goto dispatch;");
+                break;
+            case YIELD:
+                line(p, "addr = z.Yield(" + hexnum(p + opcode_size(op)) + "); goto dispatch;");
+                break;
+            default:
+                if(shared.count(op)) {
+                    line(p, "z.Step<" + opcode_names[op] + ">(code + " + hexnum(p) + ");");
+                } else {    // not implemented yet
+                    line(p, "throw domain_error(\"Invalid opcode " + to_string(op) + "\");");
+                }
+                break;
+        }
+    }
+    if(labels.count(size)) {
+        ss << label(size) << ":\n";
+    }
+    ss << "    return;\n";
+
+    if(!dispatch.empty()) {
+        ss << "\ndispatch:\n";
+        ss << "    switch(addr) {\n";
+        for(uint64_t addr: dispatch) {
+            ss << "        case " << hexnum(addr) << ": goto " << label(addr) << ";\n";
+        }
+        ss << "        default: throw zoe_internal_error(\"Invalid address.\");\n";
+        ss << "    }\n";
+    }
+    ss << "}\n\n";
+
+    ss << "int main(int argc, char* argv[])\n{\n";
+    ss << "    return CompiledMain(argc, argv, image, sizeof image, run);\n";
+    ss << "}\n";
+    return ss.str();
+}
+
+// }}}
+
+// {{{ RUNTIME
+
+int CompiledMain(int argc, char* argv[], uint8_t const* image, size_t size, ZoeVM::NativeCode code)
+{
+    try {
+        BytecodeView view(image, size);
+
+        if(argc == 3 && string(argv[1]) == "--benchmark") {
+            int n = stoi(argv[2]);
+            auto measure = [n](function<void(ZoeVM&)> const& f) {      // each run needs a new VM (not measured)
+                chrono::duration<double> total(0);
+                for(int i = 0; i < n; ++i) {
+                    ZoeVM Z;
+                    auto start = chrono::steady_clock::now();
+                    f(Z);
+                    total += chrono::steady_clock::now() - start;
+                }
+                return total.count();
+            };
+            double interpreted = measure([&](ZoeVM& Z) { Z.ExecuteBytecode(view); });
+            double compiled = measure([&](ZoeVM& Z) { Z.ExecuteNative(view, code); });
+            cout << "interpreter: " << interpreted << " s\n";
+            cout << "compiled:    " << compiled << " s (" << (interpreted / compiled) << "x)\n";
+            return EXIT_SUCCESS;
+        }
+
+        ZoeVM Z;
+        Z.ExecuteNative(view, code);
+    } catch(exception const& e) {
+        cerr << "error: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// }}}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
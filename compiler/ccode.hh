@@ -0,0 +1,36 @@
+#ifndef COMPILER_CCODE_H_
+#define COMPILER_CCODE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "vm/zoevm.hh"
+
+// Ahead-of-time compilation of a ZB image to a C++ translation unit
+// (`zoe --emit-c`). Each instruction becomes straight-line code that calls
+// into the VM (ZoeVM::Native). The bodies of the instructions are inlined
+// from vm/zinstructions.hh, so that the C++ compiler can optimize across
+// instructions:
+//
+//     L_00000010: vm.Push(ZBox(42.0));                     // pn8     2A
+//                 z.Step<PSTR>(code + 0x11);               // pstr    'a'
+//                 goto L_00000020;                         // jmp     20
+//
+// Jumps become gotos. Calls and returns, and the switches between coroutines
+// (whose addresses are only known when the code runs) go through a `switch`
+// with every possible target. The image
+// is embedded in the generated code, as the strings and the constants are
+// still loaded from it.
+//
+// The generated code has a `main` that calls CompiledMain, and must be
+// linked against the VM library.
+string GenerateCpp(uint8_t const* image, size_t size, string const& source_name);
+
+// Runs the code (or, with `--benchmark N`, compares it to the interpreter).
+int CompiledMain(int argc, char* argv[], uint8_t const* image, size_t size, ZoeVM::NativeCode code);
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
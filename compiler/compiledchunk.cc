@@ -0,0 +1,53 @@
+#include "compiler/compiledchunk.hh"
+
+#include <algorithm>
+
+#include "vm/opcode.hh"
+
+CompiledChunk::CompiledChunk(vector<uint8_t> zb)
+    : _zb(move(zb)), _view(_zb)
+{
+    Prepare();
+}
+
+
+CompiledChunk::CompiledChunk(BytecodeView const& view)
+    : _zb(), _view(view)
+{
+    Prepare();
+}
+
+
+void CompiledChunk::Prepare()
+{
+    uint8_t const* code = _view.Code();
+    size_t size = _view.CodeSize();
+
+    vector<bool> instruction(size + 1, false);
+    _cache_idx.assign(size, 0);
+    for(size_t p = 0; p < size; p += opcode_size(code[p])) {
+        instruction[p] = true;
+        if(code[p] == GET || code[p] == SET || code[p] == GETF) {
+            _cache_idx[p] = static_cast<uint32_t>(_caches++);
+        }
+    }
+
+    for(size_t p = 0; p < size; p += opcode_size(code[p])) {
+        if(code[p] == PNUM) {
+            double v = _view.GetCode<double>(p + 1);
+            if(v >= 0 && v < static_cast<double>(size) && instruction[static_cast<size_t>(v)]) {
+                _functions.push_back(static_cast<uint64_t>(v));
+            }
+        }
+    }
+    sort(begin(_functions), end(_functions));
+    _functions.erase(unique(begin(_functions), end(_functions)), end(_functions));
+}
+
+
+bool CompiledChunk::IsFunction(uint64_t addr) const
+{
+    return binary_search(begin(_functions), end(_functions), addr);
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
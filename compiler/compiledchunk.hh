@@ -0,0 +1,56 @@
+#ifndef COMPILER_COMPILEDCHUNK_H_
+#define COMPILER_COMPILEDCHUNK_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+using namespace std;
+
+#include "compiler/bytecodeview.hh"
+
+// A CompiledChunk is a ZB image prepared for execution: validated (see
+// BytecodeView), with the strings and their hashes, the constant pool, the
+// slots of the inline caches and the addresses of the functions found once.
+// It is immutable, so the same chunk can be run by any number of VMs, in any
+// number of threads:
+//
+//     auto chunk = CompiledChunk::Create(Bytecode(code).GenerateZB());
+//     Z1.ExecuteChunk(chunk);
+//     Z2.ExecuteChunk(chunk);
+//
+// What each execution changes (the inline caches, and the code with the
+// quickened opcodes) is kept by the VM, apart from the chunk.
+class CompiledChunk {
+public:
+    explicit CompiledChunk(vector<uint8_t> zb);                 // keeps the image
+    explicit CompiledChunk(BytecodeView const& view);           // the image must outlive the chunk
+
+    static shared_ptr<CompiledChunk const> Create(vector<uint8_t> zb) { return make_shared<CompiledChunk const>(move(zb)); }
+
+    CompiledChunk(CompiledChunk const&) = delete;               // the view points to the image
+    CompiledChunk& operator=(CompiledChunk const&) = delete;
+
+    BytecodeView const& View() const { return _view; }
+
+    // inline caches: one for each GET, SET and GETF instruction
+    size_t   InlineCaches() const { return _caches; }
+    uint32_t InlineCache(size_t pos) const { return _cache_idx[pos]; }
+
+    // functions: the addresses pushed by PNUM that are the start of an
+    // instruction (PFUN and PCLO only accept those)
+    vector<uint64_t> const& Functions() const { return _functions; }
+    bool                    IsFunction(uint64_t addr) const;
+
+private:
+    void Prepare();
+
+    vector<uint8_t> const _zb;
+    BytecodeView const    _view;
+    size_t                _caches = 0;
+    vector<uint32_t>      _cache_idx = {};     // by position of the instruction
+    vector<uint64_t>      _functions = {};     // sorted
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -96,6 +96,9 @@ pub             { return _PUB; }
 let             { return LET; }
 del             { return _DEL; }
 fn              { return FN; }
+coroutine       { return _COROUTINE; }
+resume          { return _RESUME; }
+yield           { return _YIELD; }
 
 '                     { yy_push_state(STR, yyscanner); yylval->str = new string(); }
 <STR>\\n              { yylval->str->append(1, '\n'); }
@@ -114,6 +117,14 @@ fn              { return FN; }
 <SB>\}                { yy_pop_state(yyscanner);
                         yylval->str = new string(); }
 
+\*\*            { return _POW;   }
+\%\/            { return _IDIV;  }
+\<\<            { return _SHL;   }
+\>\>            { return _SHR;   }
+\<\=            { return _LTE;   }
+\=\=            { return _EQ;    }
+\!\=            { return _NEQ;   }
+
 {SPECIALCHARS}  { return yytext[0]; }
 
 {IDENTIFIER}    { yylval->str = new string(yytext); return IDENTIFIER; }
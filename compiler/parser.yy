@@ -30,7 +30,7 @@ using namespace std;
 static void add_number(Bytecode& b, double num);
 static void add_variables(Bytecode& b, vector<string> const& names, bool mut);
 void yyerror(YYLTYPE* yylloc, void* scanner, Bytecode& b, const char *s) __attribute__((noreturn));
-static Label function_header(Bytecode& b);
+static Label function_header(Bytecode& b, vector<string> const& pars);
 static void function_footer(Bytecode& b, uint8_t n_pars, Label end);
 
 %}
@@ -82,15 +82,24 @@ using namespace std;
 %token <number>  NUMBER
 %token <boolean> BOOLEAN
 %token <str>     STRING IDENTIFIER
-%token NIL SEP _MUT _PUB _DEL LET FN
+%token NIL SEP _MUT _PUB _DEL LET FN _COROUTINE _RESUME _YIELD
+%token _POW _IDIV _SHL _SHR _LTE _EQ _NEQ
 
 %type <boolean> mut_opt
 %type <str> string strings
-%type <vec> varnames
-%type <integer> array_items table_items table_items_x     /* $$ is a counter */
+%type <vec> varnames function_pars
+%type <integer> array_items table_items table_items_x call_pars     /* $$ is a counter */
 %type <u8> properties                                     /* $$ is a TableConfig instance */
 
+%precedence _YIELD
 %nonassoc '='
+%nonassoc _EQ _NEQ '<' _LTE
+%left '&' '^' '|'
+%left _SHL _SHR
+%left '+' '-'
+%left '*' '/' _IDIV '%'
+%right _POW
+%precedence _UNARY
 %precedence '['
 %left '.'
 %precedence '('  /* lowest? */
@@ -133,13 +142,40 @@ exp: literal_exp
    | function_def
    | exp function_call
    | block
+   | operator_exp
+   | coroutine_exp
    ;
 
-block: '{' { b.PushScope(); b.Add(PSHS); b.Add(PNIL); } code '}' { b.Add(POPS); b.PopScope(); }
+block: '{' { b.PushScope(); b.Add(PSHS); b.Add(PNIL); } code '}' { b.CloseScope(); b.Add(POPS); b.PopScope(); }
      | '{' '}'
      ;
 
 
+//
+// OPERATORS
+//
+operator_exp: exp '+' exp           { b.Add(ADD);  }
+            | exp '-' exp           { b.Add(SUB);  }
+            | exp '*' exp           { b.Add(MUL);  }
+            | exp '/' exp           { b.Add(DIV);  }
+            | exp _IDIV exp         { b.Add(IDIV); }
+            | exp '%' exp           { b.Add(MOD);  }
+            | exp _POW exp          { b.Add(POW);  }
+            | exp '&' exp           { b.Add(AND);  }
+            | exp '|' exp           { b.Add(OR);   }
+            | exp '^' exp           { b.Add(XOR);  }
+            | exp _SHL exp          { b.Add(SHL);  }
+            | exp _SHR exp          { b.Add(SHR);  }
+            | exp '<' exp           { b.Add(LT);   }
+            | exp _LTE exp          { b.Add(LTE);  }
+            | exp _EQ exp           { b.Add(EQ);   }
+            | exp _NEQ exp          { b.Add(EQ); b.Add(BNOT); }
+            | '-' exp %prec _UNARY  { b.Add(UNM);  }
+            | '~' exp %prec _UNARY  { b.Add(NOT);  }
+            | '!' exp %prec _UNARY  { b.Add(BNOT); }
+            | '(' exp ')'
+            ;
+
 // 
 // LITERAL EXPRESSIONS
 //
@@ -162,7 +198,9 @@ strings: string             { $$ = new string(*$1); delete $1; }
 var_get: IDENTIFIER { 
             string id = *$1; delete $1;
             try {
-                b.Add(GVAR, b.GetVariableIndex(id, nullptr));
+                Bytecode::VariableType type;
+                uint32_t n = b.GetVariableIndex(id, nullptr, &type);
+                b.Add((type == Bytecode::LOCAL) ? GLOC : (type == Bytecode::UPVALUE) ? GUPV : GVAR, n);
             } catch(zoe_syntax_error const& e) {
                 yyerror(&yylloc, scanner, b, e.what());
             }
@@ -204,10 +242,11 @@ var_init: LET mut_opt IDENTIFIER {
 
 var_assign: IDENTIFIER '=' exp  { 
                 bool mut;
+                Bytecode::VariableType type;
                 string s = *$1; delete $1;
                 uint32_t n;
                 try {
-                    n = b.GetVariableIndex(s, &mut);
+                    n = b.GetVariableIndex(s, &mut, &type);
                 } catch(zoe_syntax_error const& e) {
                     yyerror(&yylloc, scanner, b, e.what());
                 }
@@ -215,7 +254,7 @@ var_assign: IDENTIFIER '=' exp  {
                     yyerror(&yylloc, scanner, b, ("Variable '" + s + "' is not mutable.").c_str());
                     return 1;
                 }
-                b.Add(SVAR, n);
+                b.Add((type == Bytecode::LOCAL) ? SLOC : (type == Bytecode::UPVALUE) ? SUPV : SVAR, n);
             }
           ;
 
@@ -230,7 +269,7 @@ varnames: IDENTIFIER                { $$ = new vector<string>({*$1}); delete $1;
 // 
 // ARRAY INITIALIZATION
 //
-array_init: '[' array_items opt_comma ']' { b.Add(PARY, static_cast<uint16_t>($2)); }
+array_init: '[' array_items opt_comma ']' { b.AddFolded(PARY, static_cast<uint16_t>($2)); }
           ;
 
 opt_comma: %empty
@@ -246,9 +285,9 @@ array_items: %empty              { $$ = 0; }
 // TABLE INITIALIZATION
 //
 table_init: '%' opt_identifier '{' table_items opt_comma '}' 
-              { b.Add(PTBL, static_cast<uint16_t>($table_items)); }
+              { b.AddFolded(PTBL, static_cast<uint16_t>($table_items)); }
           | '&' opt_identifier '{' table_items_x opt_comma '}'
-              { b.Add(PTBX, static_cast<uint16_t>($table_items_x)); }
+              { b.AddFolded(PTBX, static_cast<uint16_t>($table_items_x)); }
           ;
 
 opt_identifier: %empty     { b.Add(PNIL); }
@@ -300,21 +339,46 @@ get_op: table_exp { b.Add(GET); }
 // 
 // FUNCTION DEFINITION
 //
-function_def: FN '(' function_pars ')' { $<label>1 = function_header(b); } block { function_footer(b, /*TODO*/ 0, $<label>1); }
+function_def: FN '(' function_pars ')' { 
+                $<integer>$ = $function_pars->size();
+                try {
+                    $<label>1 = function_header(b, *$function_pars);
+                } catch(zoe_syntax_error const& e) {
+                    delete $function_pars;
+                    yyerror(&yylloc, scanner, b, e.what());
+                }
+                delete $function_pars;
+            } block { 
+                function_footer(b, static_cast<uint8_t>($<integer>5), $<label>1);
+            }
             ;
 
-function_pars: %empty
+function_pars: %empty       { $$ = new vector<string>(); }
+             | varnames
+             ;
+
+//
+// COROUTINES
+//
+coroutine_exp: _COROUTINE exp %prec _UNARY  { b.Add(PCOR);   }
+             | _RESUME exp %prec _UNARY     { b.Add(RESUME); }
+             | _YIELD exp                   { b.Add(YIELD);  }
              ;
 
 //
 // FUNCTION CALLS
 //
-function_call: '(' call_pars ')' { b.Add(CALL, 0, 0); }
+function_call: '(' call_pars ')' { 
+                if($call_pars > UINT8_MAX) {
+                    yyerror(&yylloc, scanner, b, "Too many arguments.");
+                }
+                b.Add(CALL, static_cast<uint8_t>($call_pars), 0);
+            }
              ;
 
-call_pars: %empty
-         | exp
-         | exp ',' call_pars
+call_pars: %empty                { $$ = 0; }
+         | exp                   { $$ = 1; }
+         | exp ',' call_pars     { $$ = $3 + 1; }
          ;
 
 %%
@@ -330,20 +394,38 @@ static void add_number(Bytecode& b, double num)
 }
 
 
-static Label function_header(Bytecode& b)
+static Label function_header(Bytecode& b, vector<string> const& pars)
 {
-    Label end = b.CreateLabel();                            // label to the end of the function
-    b.Add(PNUM, static_cast<double>(b.CurrentPos() + 18));  // push function address (current + 9 (push) + 9 (jmp)
+    if(pars.size() > UINT8_MAX) {
+        throw zoe_syntax_error("Too many parameters.");
+    }
+    Label start = b.CreateLabel(),                          // label to the start of the function
+          end = b.CreateLabel();                            // label to the end of the function
+    b.Add(PNUM, b.AddLabelNumber(start));                   // push function address
     b.Add(JMP, b.AddLabel(end));                            // jump to the end of the function
+    b.SetLabel(start);
+    b.PushFunction();
+    for(string const& par: pars) {                          // the arguments are the first variables of the frame
+        b.CreateVariable(par, false);
+    }
     return end;
 }
 
 
 static void function_footer(Bytecode& b, uint8_t n_pars, Label end)
 {
+    b.MarkTailCall();                       // a call in tail position reuses the frame
+    vector<Bytecode::Upvalue> upvalues = b.PopFunction();
     b.Add(RET);                             // return from function
     b.SetLabel(end);                        // label to the end of the function
-    b.Add(PFUN, n_pars);                    // push function (function address is in the stack)
+    if(upvalues.empty()) {
+        b.Add(PFUN, n_pars);                // push function (function address is in the stack)
+    } else {
+        for(Bytecode::Upvalue const& up: upvalues) {    // push the upvalues, and create a closure with them
+            b.Add(up.local ? CAPL : CAPU, up.index);
+        }
+        b.Add(PCLO, n_pars, static_cast<uint8_t>(upvalues.size()));
+    }
 }
 
 
@@ -0,0 +1,312 @@
+#include "compiler/registercode.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+
+#include "compiler/bytecodeview.hh"
+
+// {{{ TRANSLATION
+
+namespace {
+
+// An entry of the (simulated) stack: a register, or a constant string.
+struct Ref {
+    bool     str;
+    uint32_t idx;
+};
+
+}
+
+/* The stack code is translated by simulating the stack. Each stack position
+ * `p` owns the temporary register `temps + p`, but an entry might point
+ * somewhere else: to a variable (GVAR), a constant string (PSTR) or a
+ * temporary that is above it (the result of SET). Such an entry is only
+ * copied to its own register (`materialize`) when needed: when an
+ * instruction requires its operands in consecutive registers, or when the
+ * register it points to is about to be overwritten. */
+bool RegisterCode::Translate(BytecodeView const& view, string* reason)
+{
+    uint8_t const* const code = view.Code();
+    uint8_t const* const end = code + view.CodeSize();
+    auto operand16 = [](uint8_t const* p) { uint16_t v; memcpy(&v, p + 1, 2); return v; };
+    auto operand32 = [](uint8_t const* p) { uint32_t v; memcpy(&v, p + 1, 4); return v; };
+    auto fail = [&](string const& why) { *reason = why; return false; };
+
+    // first pass: the temporaries come after the maximum number of variables
+    size_t nvars = 0, max_vars = 0;
+    vector<size_t> scopes;
+    for(uint8_t const* p = code; p != end; p += opcode_size(*p)) {
+        if(*p == CVAR) {
+            ++nvars;
+        } else if(*p == CMVAR) {
+            nvars += operand16(p);
+        } else if(*p == PSHS) {
+            scopes.push_back(nvars);
+        } else if(*p == POPS) {
+            if(scopes.empty()) {
+                return fail("scope underflow");
+            }
+            nvars = scopes.back();
+            scopes.pop_back();
+        }
+        max_vars = max(max_vars, nvars);
+    }
+    uint32_t const temps = static_cast<uint32_t>(max_vars);
+
+    // second pass: emit code
+    _code.clear();
+    _numbers.clear();
+    _caches = 0;
+    _pops = 0;
+    nvars = 0;
+    scopes.clear();
+    vector<Ref> stack;
+    size_t max_reg = temps;
+
+    auto emit = [&](RegOpcode op, uint8_t flags, uint32_t a, uint32_t b, uint32_t c, uint32_t x) {
+        max_reg = max(max_reg, static_cast<size_t>(a) + 1);
+        _code.push_back({ op, flags, static_cast<uint16_t>(a), static_cast<uint16_t>(b), static_cast<uint16_t>(c), x, 0 });
+    };
+    auto temp = [&](size_t p) { return static_cast<uint32_t>(temps + p); };
+
+    // copy the entries below `below` that point to `reg`, which is about to be overwritten
+    function<void(uint32_t, size_t)> clobber;
+    auto materialize = [&](size_t p) {
+        Ref& r = stack[p];
+        if(r.str) {
+            clobber(temp(p), p);
+            emit(RSTR, 0, temp(p), 0, 0, r.idx);
+        } else if(r.idx != temp(p)) {
+            clobber(temp(p), p);
+            emit(RMOVE, 0, temp(p), r.idx, 0, 0);
+        }
+        stack[p] = { false, temp(p) };
+    };
+    clobber = [&](uint32_t reg, size_t below) {
+        for(size_t p = 0; p < below; ++p) {
+            if(!stack[p].str && stack[p].idx == reg) {
+                materialize(p);
+            }
+        }
+    };
+    auto reg = [&](size_t p) {      // register of an operand (constants are loaded)
+        if(stack[p].str) {
+            materialize(p);
+        }
+        return stack[p].idx;
+    };
+    auto push = [&](RegOpcode op, uint8_t flags, uint32_t x) {
+        size_t p = stack.size();
+        stack.push_back({ false, temp(p) });
+        clobber(temp(p), p);
+        emit(op, flags, temp(p), 0, 0, x);
+    };
+    auto write_var = [&](uint32_t var, size_t p) {  // copy entry p to a variable
+        clobber(var, stack.size());
+        if(stack[p].str) {
+            emit(RSTR, 0, var, 0, 0, stack[p].idx);
+        } else if(stack[p].idx != var) {
+            emit(RMOVE, 0, var, stack[p].idx, 0, 0);
+        }
+    };
+    auto collapse = [&](size_t n) {     // put the last n entries in consecutive registers
+        for(size_t p = stack.size() - n; p < stack.size(); ++p) {
+            materialize(p);
+        }
+    };
+
+    for(uint8_t const* p = code; p != end; p += opcode_size(*p)) {
+        size_t d = stack.size();
+        size_t need = 0;
+        switch(*p) {
+            case PARY: need = operand16(p); break;
+            case PTBL: need = operand16(p) * 3U + 1; break;
+            case PTBX: need = operand16(p) * 2U + 1; break;
+            case CVAR: case CMVAR: case SVAR: need = 1; break;
+            case GET: need = 2; break;
+            case SET: need = 3; break;
+            default: break;
+        }
+        if(need > d) {
+            return fail("the code uses values that were in the stack before it started");
+        }
+
+        switch(*p) {
+            case NOP:
+                break;
+            case PNIL:
+                push(RNIL, 0, 0);
+                break;
+            case PBF:
+            case PBT:
+                push(RBOOL, 0, (*p == PBT) ? 1 : 0);
+                break;
+            case PN8:
+                _numbers.push_back(p[1]);
+                push(RNUM, 0, static_cast<uint32_t>(_numbers.size() - 1));
+                break;
+            case PNUM: {
+                    double v;
+                    memcpy(&v, p + 1, sizeof v);
+                    _numbers.push_back(v);
+                    push(RNUM, 0, static_cast<uint32_t>(_numbers.size() - 1));
+                }
+                break;
+            case PSTR:
+                stack.push_back({ true, operand32(p) });
+                break;
+            case PCON:
+                push(RCON, 0, operand32(p));
+                break;
+            case PARY:
+            case PTBL:
+            case PTBX: {
+                    collapse(need);
+                    emit((*p == PARY) ? RARY : RTBL, (*p == PTBX) ? 1 : 0, temp(d - need), temp(d - need), 0,
+                            static_cast<uint32_t>(need));
+                    stack.resize(d - need);
+                    stack.push_back({ false, temp(d - need) });
+                }
+                break;
+            case POP:
+                if(stack.empty()) {
+                    ++_pops;        // a value left by the previous code
+                } else {
+                    stack.pop_back();
+                }
+                break;
+            case CVAR:
+                write_var(static_cast<uint32_t>(nvars++), d - 1);
+                break;
+            case CMVAR: {
+                    uint16_t n = operand16(p);
+                    uint32_t ary = reg(d - 1);
+                    for(uint32_t v = 0; v < n; ++v) {
+                        clobber(static_cast<uint32_t>(nvars + v), d);
+                    }
+                    emit(RUNPK, 0, static_cast<uint32_t>(nvars), ary, 0, n);
+                    max_reg = max(max_reg, nvars + n);
+                    nvars += n;
+                }
+                break;
+            case GVAR:
+            case SVAR: {
+                    uint32_t n = operand32(p);
+                    if(n >= nvars) {
+                        return fail("invalid variable");
+                    }
+                    if(*p == GVAR) {
+                        stack.push_back({ false, n });
+                    } else {
+                        write_var(n, d - 1);
+                    }
+                }
+                break;
+            case GETF: {
+                    uint32_t n = operand32(p);
+                    if(n >= nvars) {
+                        return fail("invalid variable");
+                    }
+                    uint32_t k;
+                    memcpy(&k, p + 5, 4);
+                    stack.push_back({ false, temp(d) });
+                    clobber(temp(d), d);
+                    emit(RGETK, 0, temp(d), n, 0, k);
+                    _code.back().ic = _caches++;
+                }
+                break;
+            case CVN8:
+                _numbers.push_back(p[1]);
+                push(RNUM, 0, static_cast<uint32_t>(_numbers.size() - 1));
+                write_var(static_cast<uint32_t>(nvars++), d);
+                break;
+            case PSHS:
+                scopes.push_back(nvars);
+                break;
+            case POPS:
+                nvars = scopes.back();
+                scopes.pop_back();
+                for(size_t q = 0; q < d; ++q) {     // entries pointing to variables that are gone
+                    if(!stack[q].str && stack[q].idx >= nvars && stack[q].idx < temps) {
+                        materialize(q);
+                    }
+                }
+                break;
+            case GET: {
+                    uint32_t obj = reg(d - 2);
+                    Ref key = stack[d - 1];
+                    clobber(temp(d - 2), d - 2);
+                    if(key.str) {
+                        emit(RGETK, 0, temp(d - 2), obj, 0, key.idx);
+                    } else {
+                        emit(RGET, 0, temp(d - 2), obj, key.idx, 0);
+                    }
+                    _code.back().ic = _caches++;
+                    stack.resize(d - 2);
+                    stack.push_back({ false, temp(d - 2) });
+                }
+                break;
+            case SET: {
+                    uint32_t obj = reg(d - 3);
+                    uint32_t value = reg(d - 1);
+                    Ref key = stack[d - 2];
+                    if(key.str) {
+                        emit(RSETK, p[1], obj, 0, value, key.idx);
+                    } else {
+                        emit(RSET, p[1], obj, key.idx, value, 0);
+                    }
+                    max_reg = max(max_reg, static_cast<size_t>(value) + 1);
+                    _code.back().ic = _caches++;
+                    stack.resize(d - 3);
+                    stack.push_back({ false, value });      // the value stays in the stack
+                }
+                break;
+            default:
+                return fail("opcode " + opcode_names[*p] + " is not supported");
+        }
+
+        if(temps + stack.size() >= 0xFFFF) {
+            return fail("too many registers");
+        }
+    }
+
+    // the values left in the stack are the results
+    collapse(stack.size());
+    max_reg = max(max_reg, temps + stack.size());
+    _registers = static_cast<uint16_t>(max_reg);
+    _variables = static_cast<uint16_t>(nvars);
+    _results = static_cast<uint16_t>(stack.size());
+    _temps = static_cast<uint16_t>(temps);
+    return true;
+}
+
+// }}}
+
+// {{{ DEBUGGING
+
+string RegisterCode::Disassemble() const
+{
+#define X(a) #a
+    static const char* names[] = { REG_OPCODE_TABLE };
+#undef X
+
+    stringstream ss;
+    ss << setfill('0') << hex << uppercase;
+    for(size_t i = 0; i < _code.size(); ++i) {
+        RegInstruction const& ins = _code[i];
+        ss << setw(4) << i << ":  " << left << setfill(' ') << setw(7) << names[ins.op] << right << setfill('0')
+           << "r" << ins.a << ", r" << ins.b << ", r" << ins.c << ", " << ins.x;
+        if(ins.flags) {
+            ss << "  [" << static_cast<int>(ins.flags) << "]";
+        }
+        ss << "\n";
+    }
+    return ss.str();
+}
+
+// }}}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,87 @@
+#ifndef COMPILER_REGISTERCODE_H_
+#define COMPILER_REGISTERCODE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "vm/opcode.hh"
+
+class BytecodeView;
+
+/* Register-machine encoding of the stack bytecode. Instructions have three
+ * register operands: `a` is the destination, `b` and `c` are sources.
+ *
+ * The registers of a frame are the variables (created by
+ * `Bytecode::CreateVariable`, that keep their indexes) followed by the
+ * temporaries, which replace the positions of the stack. Reading a variable
+ * or a constant string doesn't need an instruction: the instructions that
+ * use them read the variable register directly, or take the string as an
+ * operand (GETK/SETK).
+ *
+ *   RNIL   a              a = nil
+ *   RBOOL  a, x           a = (x != 0)
+ *   RNUM   a, x           a = numbers[x]
+ *   RSTR   a, x           a = strings[x]
+ *   RMOVE  a, b           a = b
+ *   RCON   a, x           a = constants[x]
+ *   RARY   a, b, x        a = [ b, b+1, ..., b+x-1 ]
+ *   RTBL   a, b, x        a = table with proto and fields in b ... b+x-1 (flags: 1 = PTBX)
+ *   RGET   a, b, c        a = b[c]
+ *   RGETK  a, b, x        a = b[strings[x]]
+ *   RSET   a, b, c        a[b] = c (flags: TableConfig)
+ *   RSETK  a, x, c        a[strings[x]] = c (flags: TableConfig)
+ *   RUNPK  a, b, x        a+x-1 ... a = items of the array b
+ */
+
+#define REG_OPCODE_TABLE                                                            \
+    X(RNIL), X(RBOOL), X(RNUM), X(RSTR), X(RMOVE), X(RCON), X(RARY), X(RTBL),      \
+    X(RGET), X(RGETK), X(RSET), X(RSETK), X(RUNPK)
+
+#define X(a) a
+enum RegOpcode : uint8_t {
+    REG_OPCODE_TABLE
+};
+#undef X
+
+struct RegInstruction {
+    RegOpcode op;
+    uint8_t   flags;
+    uint16_t  a, b, c;
+    uint32_t  x;
+    uint32_t  ic;       // inline cache index (GET/SET)
+};
+
+class RegisterCode {
+public:
+    // Translates the stack code. Returns false (and the reason) if the code
+    // uses features not supported by the register backend (branches and
+    // function calls), or that depend on the state of the VM.
+    bool Translate(BytecodeView const& view, string* reason);
+
+    vector<RegInstruction> const& Code() const { return _code; }
+    vector<double> const&         Numbers() const { return _numbers; }
+    uint16_t                      Registers() const { return _registers; }
+    uint16_t                      TempBase() const { return _temps; }           // first temporary register
+    uint16_t                      Variables() const { return _variables; }      // variables alive at the end
+    uint16_t                      Results() const { return _results; }          // temporaries left at the end
+    uint32_t                      InlineCaches() const { return _caches; }
+    uint32_t                      Pops() const { return _pops; }                // values removed from the VM stack
+
+    string Disassemble() const;
+
+private:
+    vector<RegInstruction> _code = {};
+    vector<double>         _numbers = {};
+    uint16_t               _registers = 0;
+    uint16_t               _temps = 0;
+    uint16_t               _variables = 0;
+    uint16_t               _results = 0;
+    uint32_t               _caches = 0;
+    uint32_t               _pops = 0;
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,134 @@
+#include "exe/compilecache.hh"
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "compiler/bytecodeview.hh"
+#include "vm/zstring.hh"
+
+CompileCache::CompileCache(unsigned opt_level)
+    : _opt_level(opt_level)
+{
+    // find cache directory
+    if(getenv("ZOE_CACHE_DIR")) {
+        _dir = getenv("ZOE_CACHE_DIR");
+    } else if(getenv("XDG_CACHE_HOME")) {
+        _dir = string(getenv("XDG_CACHE_HOME")) + "/zoe";
+    } else if(getenv("HOME")) {
+        _dir = string(getenv("HOME")) + "/.cache/zoe";
+    } else {
+        return;
+    }
+
+    // create it, if it doesn't exist
+    for(size_t i = 1; i <= _dir.size(); ++i) {
+        if(i == _dir.size() || _dir[i] == '/') {
+            mkdir(_dir.substr(0, i).c_str(), 0755);
+        }
+    }
+    struct stat st;
+    if(stat(_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        _dir = "";   // no cache
+    }
+}
+
+
+unique_ptr<MappedFile> CompileCache::Lookup(string const& path, time_t mtime, string const& source) const
+{
+    if(!Enabled()) {
+        return nullptr;
+    }
+    string entry = EntryPath(path, mtime, source);
+    if(access(entry.c_str(), R_OK) != 0) {
+        return nullptr;
+    }
+    unique_ptr<MappedFile> f;
+    try {
+        f.reset(new MappedFile(entry));
+    } catch(runtime_error const&) {
+        return nullptr;
+    }
+
+    // a corrupted entry is removed, so that the script is compiled (and stored) again
+    try {
+        BytecodeView(f->Data(), f->Size());
+    } catch(exception const&) {
+        unlink(entry.c_str());
+        return nullptr;
+    }
+    return f;
+}
+
+
+void CompileCache::Store(string const& path, time_t mtime, string const& source, vector<uint8_t> const& zb) const
+{
+    if(!Enabled()) {
+        return;
+    }
+
+    // remove older entries for the same script
+    string prefix = EntryPrefix(path);
+    DIR* dir = opendir(_dir.c_str());
+    if(dir) {
+        while(struct dirent* ent = readdir(dir)) {
+            if(strncmp(ent->d_name, prefix.c_str(), prefix.size()) == 0) {
+                unlink((_dir + "/" + ent->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    // write the new entry atomically, so that a concurrent zoe never sees a partial file
+    string entry = EntryPath(path, mtime, source);
+    string tmp = entry + ".tmp" + to_string(getpid());
+    {
+        ofstream f(tmp, ios::binary);
+        f.write(reinterpret_cast<char const*>(zb.data()), static_cast<streamsize>(zb.size()));
+        if(!f) {
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+    if(rename(tmp.c_str(), entry.c_str()) != 0) {
+        unlink(tmp.c_str());
+    }
+}
+
+
+uint64_t CompileCache::Hash(void const* data, size_t sz)
+{
+    return ZString::HashOf(static_cast<char const*>(data), sz);      // stable across builds
+}
+
+
+string CompileCache::EntryPrefix(string const& path) const
+{
+    char abs[PATH_MAX];
+    string p = realpath(path.c_str(), abs) ? abs : path;
+
+    stringstream ss;
+    ss << hex << setfill('0') << setw(16) << Hash(p.data(), p.size()) << "-";
+    return ss.str();
+}
+
+
+string CompileCache::EntryPath(string const& path, time_t mtime, string const& source) const
+{
+    stringstream ss;
+    ss << _dir << "/" << EntryPrefix(path) << hex << mtime << "-" << setfill('0') << setw(16) << Hash(source.data(), source.size());
+    ss << "-O" << dec << _opt_level;
+    ss << "-" << VERSION << ".zb";   // images from other versions are not reused
+    return ss.str();
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,41 @@
+#ifndef EXE_COMPILECACHE_HH_
+#define EXE_COMPILECACHE_HH_
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "exe/mappedfile.hh"
+
+// The compile cache keeps the ZB images of scripts that were already
+// compiled, so that unchanged scripts don't need to be parsed again. 
+//
+// Entries are kept in $ZOE_CACHE_DIR (or $XDG_CACHE_HOME/zoe, or 
+// ~/.cache/zoe), and are keyed on the script absolute path, its modification
+// time, a hash of its contents and the optimization level. Lookup only
+// returns valid ZB images: a corrupted entry is a cache miss.
+class CompileCache {
+public:
+    explicit CompileCache(unsigned opt_level=0);
+
+    bool Enabled() const { return !_dir.empty(); }
+
+    unique_ptr<MappedFile> Lookup(string const& path, time_t mtime, string const& source) const;
+    void                   Store(string const& path, time_t mtime, string const& source, vector<uint8_t> const& zb) const;
+
+    static uint64_t Hash(void const* data, size_t sz);
+
+private:
+    string   _dir = "";
+    unsigned _opt_level;
+
+    string EntryPrefix(string const& path) const;
+    string EntryPath(string const& path, time_t mtime, string const& source) const;
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -7,12 +7,21 @@
 #include <readline/history.h>
 
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 
+#include "exe/compilecache.hh"
+#include "exe/mappedfile.hh"
 #include "exe/options.hh"
 #include "compiler/bytecode.hh"
+#include "compiler/bytecodeview.hh"
+#include "compiler/ccode.hh"
+#include "compiler/compiledchunk.hh"
 #include "vm/zoevm.hh"
+#include "vm/zprofile.hh"
+#include "vm/ztracebuffer.hh"
+#include "vm/zvmpool.hh"
 
 // ANSI colors for console output
 #define DIMMAGENTA "\033[2;34m"
@@ -22,6 +31,59 @@
 #define NORMAL     "\033[0m"
 
 
+/* Disassembly of the code before and after the optimizer, diff-style. The
+ * optimizer only removes instructions and changes addresses, so the
+ * instructions are matched greedily. */
+static string disassembly_diff(Bytecode const& before, Bytecode const& after)
+{
+    auto next = [](Bytecode const& b, size_t pos) { return pos + Bytecode::OpcodeSize(static_cast<Opcode>(b.Code()[pos])); };
+    auto line = [](char mark, size_t pos, string const& ins) {
+        stringstream ss;
+        ss << mark << " " << setfill('0') << hex << uppercase << setw(8) << pos << ":   " << ins << "\n";
+        return ss.str();
+    };
+
+    string diff;
+    size_t i = 0, j = 0;
+    while(i < before.Code().size()) {
+        string a = before.DisassembleOpcode(i);
+        string b = (j < after.Code().size()) ? after.DisassembleOpcode(j) : "";
+        bool address = (b != "") && before.Code()[i] == after.Code()[j] &&
+            (after.Code()[j] == JMP || after.Code()[j] == BT || after.Code()[j] == PNUM);
+        if(a == b) {
+            diff += line(' ', j, b);
+            j = next(after, j);
+        } else if(address) {    // same instruction, address changed
+            diff += line('-', i, a) + line('+', j, b);
+            j = next(after, j);
+        } else {
+            diff += line('-', i, a);
+        }
+        i = next(before, i);
+    }
+    for(; j < after.Code().size(); j = next(after, j)) {
+        diff += line('+', j, after.DisassembleOpcode(j));
+    }
+    return diff;
+}
+
+
+static vector<uint8_t> generate_zb(Bytecode& b, class Options const& opt)
+{
+    if(!opt.disassemble) {
+        b.Optimize(opt.optimize);
+        return b.GenerateZB();
+    }
+
+    Bytecode original = b;
+    original.GenerateZB();
+    b.Optimize(opt.optimize);
+    vector<uint8_t> zb = b.GenerateZB();
+    cout << GRAY << disassembly_diff(original, b) << NORMAL;
+    return zb;
+}
+
+
 void execute_repl(class Options const& opt) 
 {{{
     (void) opt;
@@ -34,6 +96,14 @@ void execute_repl(class Options const& opt)
     if(opt.trace) {
         Z.Tracer = true;
     }
+    Z.RegisterBackend = opt.registers;
+    ZProfile profile;
+    if(opt.profile) {
+        Z.Profiler = &profile;
+    }
+    if(opt.jit && !Z.EnableJit(ZJit::DEFAULT_THRESHOLD, true)) {
+        cerr << "zoe: the JIT is not supported in this platform.\n";
+    }
     
     // read input
     while((buf = readline("(zoe) ")) != NULL) {
@@ -54,19 +124,14 @@ void execute_repl(class Options const& opt)
             Bytecode b(buf); free(buf);   // text is printed here if debug-bison is active
             cout << NORMAL << flush;
 
-            // generate bytecode
-            auto bytecode = b.GenerateZB();
-
-            // disassemble bytecode
-            if(opt.disassemble) {
-                cout << GRAY << b.Disassemble() << NORMAL;
-            }
+            // generate (and disassemble) bytecode
+            auto bytecode = generate_zb(b, opt);
 
             // execute bytecode
             Z.ExecuteBytecode(bytecode);
 
             // display result
-            cout << GREEN << Z.GetPtr()->Inspect() << NORMAL << "\n";
+            cout << GREEN << Z.Get().Inspect() << NORMAL << "\n";
 
         // catch errors
         } catch(exception const& e) {
@@ -75,6 +140,10 @@ void execute_repl(class Options const& opt)
         }
     }
 
+    if(opt.profile) {
+        cerr << profile.Report();
+    }
+
     // free history list (for a "almost" clear valgrind output)
     if(where_history() > 0) {
         HIST_ENTRY* const* h = history_list();
@@ -87,33 +156,193 @@ void execute_repl(class Options const& opt)
 }}}
 
 
+static bool is_zb(MappedFile const& f)
+{
+    return f.Size() >= 16 && Bytecode::ValidMagic(f.Data());
+}
+
+
+static void execute_zb(ZoeVM& Z, uint8_t const* data, size_t sz, class Options const& opt)
+{
+    BytecodeView view(data, sz);
+    if(opt.disassemble) {
+        cout << GRAY << Bytecode(view).Disassemble() << NORMAL;
+    }
+    Z.ExecuteBytecode(view);
+}
+
+
+// the ZB image of a script: the file itself, the one in the compile cache, or compiled now
+static vector<uint8_t> load_zb(string const& file, CompileCache& cache, class Options const& opt)
+{
+    MappedFile f(file);
+    if(is_zb(f)) {
+        return vector<uint8_t>(f.Data(), f.Data() + f.Size());
+    }
+    string source(reinterpret_cast<char const*>(f.Data()), f.Size());
+    if(opt.cache) {
+        auto cached = cache.Lookup(file, f.ModificationTime(), source);
+        if(cached) {
+            return vector<uint8_t>(cached->Data(), cached->Data() + cached->Size());
+        }
+    }
+    Bytecode b(source);
+    vector<uint8_t> zb = generate_zb(b, opt);
+    if(opt.cache) {
+        cache.Store(file, f.ModificationTime(), source, zb);
+    }
+    return zb;
+}
+
+
+/* With --jobs, the scripts are loaded (and compiled) here, and then run
+ * in parallel, each in a VM of its own. The errors are reported in the
+ * order of the scripts. */
+static void execute_files_parallel(vector<string> const& files, class Options const& opt)
+{
+    CompileCache cache(opt.optimize);
+
+    bool failed = false;
+    {
+        ZVMPool pool(opt.jobs, [&opt](ZoeVM& Z) {
+            Z.RegisterBackend = opt.registers;
+            if(opt.jit) {
+                Z.EnableJit();
+            }
+        });
+        vector<future<string>> results;
+        for(auto const& file: files) {
+            try {
+                results.push_back(pool.Submit(CompiledChunk::Create(load_zb(file, cache, opt))));
+            } catch(exception const& e) {
+                cerr << RED << "error: " << e.what() << NORMAL << "\n";
+                failed = true;
+                break;
+            }
+        }
+        for(size_t i = 0; i < results.size(); ++i) {
+            try {
+                results[i].get();
+            } catch(exception const& e) {
+                cerr << RED << "error: " << files[i] << ": " << e.what() << NORMAL << "\n";
+                failed = true;
+            }
+        }
+    }
+    if(failed) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
 void execute_files(vector<string> const& files, class Options const& opt)
 {{{
+    if(opt.jobs) {
+        execute_files_parallel(files, opt);
+        return;
+    }
+
     ZoeVM Z;
     if(opt.trace) {
         Z.Tracer = true;
     }
+    Z.RegisterBackend = opt.registers;
+    ZProfile profile;
+    if(opt.profile) {
+        Z.Profiler = &profile;
+    }
+    if(opt.jit && !Z.EnableJit(ZJit::DEFAULT_THRESHOLD, true)) {
+        cerr << "zoe: the JIT is not supported in this platform.\n";
+    }
+    ZTraceBuffer trace;
+    if(!opt.trace_file.empty()) {
+        Z.TraceBuffer = &trace;
+    }
+
+    CompileCache cache(opt.optimize);
 
     for(auto const& file: files) {
+        trace.Clear();      // only the script that fails is traced
+        try {
+            // load file
+            MappedFile f(file);
+
+            // precompiled files are executed in place
+            if(is_zb(f)) {
+                execute_zb(Z, f.Data(), f.Size(), opt);
+                continue;
+            }
 
-        // load file
-        ifstream f(file);
-        if(f.fail()) {
-            cerr << RED << "Error opening file '" << file << "': " << strerror(errno) << "\n" << NORMAL;
+            // look for the file in the compile cache
+            string source(reinterpret_cast<char const*>(f.Data()), f.Size());
+            if(opt.cache) {
+                auto cached = cache.Lookup(file, f.ModificationTime(), source);
+                if(cached) {
+                    execute_zb(Z, cached->Data(), cached->Size(), opt);
+                    continue;
+                }
+            }
+
+            // parse code
+            Bytecode b(source);
+            vector<uint8_t> zb = generate_zb(b, opt);
+            if(opt.cache) {
+                cache.Store(file, f.ModificationTime(), source, zb);
+            }
+
+            // run code
+            Z.ExecuteBytecode(zb);
+        } catch(exception const& e) {
+            cerr << RED << "error: " << e.what() << NORMAL << "\n";
+            if(Z.TraceBuffer) {
+                vector<uint8_t> dump = trace.Dump();
+                ofstream out(opt.trace_file, ios::binary);
+                out.write(reinterpret_cast<char const*>(dump.data()), static_cast<streamsize>(dump.size()));
+                cerr << "zoe: trace of '" << file << "' written to '" << opt.trace_file << "'.\n";
+            }
             exit(EXIT_FAILURE);
         }
-        stringstream buffer;
-        buffer << f.rdbuf();
+    }
+
+    if(opt.profile) {
+        cerr << profile.Report();
+    }
+}}}
+
+
+void compile_files(vector<string> const& files, class Options const& opt)
+{{{
+    for(auto const& file: files) {
+        // output filename: script.zoe -> script.zb (or script.cc, with --emit-c)
+        string output = file;
+        if(output.size() > 4 && output.compare(output.size() - 4, 4, ".zoe") == 0) {
+            output.resize(output.size() - 4);
+        } else if(opt.emit_c && output.size() > 3 && output.compare(output.size() - 3, 3, ".zb") == 0) {
+            output.resize(output.size() - 3);
+        }
+        output += opt.emit_c ? ".cc" : ".zb";
 
         try {
-            // parse code
-            Bytecode b(buffer.str());
-            if(opt.disassemble) {
-                cout << GRAY << b.Disassemble() << NORMAL;
+            MappedFile f(file);
+            vector<uint8_t> zb;
+            if(!is_zb(f)) {
+                Bytecode b(string(reinterpret_cast<char const*>(f.Data()), f.Size()));
+                zb = generate_zb(b, opt);
+            } else if(opt.emit_c) {
+                zb.assign(f.Data(), f.Data() + f.Size());
+            } else {
+                throw runtime_error("'" + file + "' is already compiled.");
             }
 
-            // run code
-            Z.ExecuteBytecode(b.GenerateZB());
+            ofstream out(output, ios::binary);
+            if(opt.emit_c) {
+                out << GenerateCpp(zb.data(), zb.size(), file);
+            } else {
+                out.write(reinterpret_cast<char const*>(zb.data()), static_cast<streamsize>(zb.size()));
+            }
+            if(!out) {
+                throw runtime_error("Error writing file '" + output + "': " + strerror(errno));
+            }
         } catch(exception const& e) {
             cerr << RED << "error: " << e.what() << NORMAL << "\n";
             exit(EXIT_FAILURE);
@@ -122,4 +351,18 @@ void execute_files(vector<string> const& files, class Options const& opt)
 }}}
 
 
+void decode_trace(string const& file, class Options const& opt)
+{{{
+    try {
+        CompileCache cache(opt.optimize);
+        vector<uint8_t> zb = load_zb(file, cache, opt);
+        MappedFile trace(opt.trace_file);
+        cout << ZTraceBuffer::Decode(trace.Data(), trace.Size(), BytecodeView(zb));
+    } catch(exception const& e) {
+        cerr << RED << "error: " << e.what() << NORMAL << "\n";
+        exit(EXIT_FAILURE);
+    }
+}}}
+
+
 // vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
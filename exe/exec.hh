@@ -7,6 +7,8 @@ using namespace std;
 
 void execute_repl(class Options const& opt);
 void execute_files(vector<string> const& files, class Options const& opt);
+void compile_files(vector<string> const& files, class Options const& opt);
+void decode_trace(string const& file, class Options const& opt);
 
 #endif
 
@@ -14,6 +14,12 @@ int main(int argc, char* argv[])
         case Options::NONINTERACTIVE:
             execute_files(opt.scripts_filename, opt);
             break;
+        case Options::COMPILE:
+            compile_files(opt.scripts_filename, opt);
+            break;
+        case Options::DECODE_TRACE:
+            decode_trace(opt.scripts_filename[0], opt);
+            break;
         default:
             abort();
     }
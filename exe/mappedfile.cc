@@ -0,0 +1,47 @@
+#include "exe/mappedfile.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(string const& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw runtime_error("Error opening file '" + path + "': " + strerror(errno));
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        throw runtime_error("Error opening file '" + path + "': " + strerror(err));
+    }
+    _size = static_cast<size_t>(st.st_size);
+    _mtime = st.st_mtime;
+
+    if(_size > 0) {
+        void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            throw runtime_error("Error mapping file '" + path + "': " + strerror(err));
+        }
+        _data = static_cast<uint8_t const*>(data);
+    }
+    close(fd);  // the mapping stays valid after the file is closed
+}
+
+
+MappedFile::~MappedFile()
+{
+    if(_data) {
+        munmap(const_cast<uint8_t*>(_data), _size);
+    }
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
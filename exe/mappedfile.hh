@@ -0,0 +1,31 @@
+#ifndef EXE_MAPPEDFILE_HH_
+#define EXE_MAPPEDFILE_HH_
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+using namespace std;
+
+// A read-only file mapped in memory with mmap(2). The mapping is released
+// when the object is destroyed.
+class MappedFile {
+public:
+    explicit MappedFile(string const& path);
+    ~MappedFile();
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    uint8_t const* Data() const { return _data; }
+    size_t         Size() const { return _size; }
+    time_t         ModificationTime() const { return _mtime; }
+
+private:
+    uint8_t const* _data = nullptr;
+    size_t         _size = 0;
+    time_t         _mtime = 0;
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -21,13 +21,23 @@ Options::Options(int argc, char* argv[])
             { "debug-bison",    no_argument, nullptr, 'B' },
 #endif
             { "disassemble",    no_argument, nullptr, 'D' },
+            { "compile",        no_argument, nullptr, 'c' },
+            { "emit-c",         no_argument, nullptr, 'E' },
+            { "no-cache",       no_argument, nullptr, 'n' },
+            { "registers",      no_argument, nullptr, 'R' },
+            { "optimize",       required_argument, nullptr, 'O' },
+            { "profile",        no_argument, nullptr, 'P' },
+            { "jit",            no_argument, nullptr, 'J' },
+            { "jobs",           required_argument, nullptr, 'j' },
+            { "trace-buffer",   required_argument, nullptr, 'b' },
+            { "decode-trace",   required_argument, nullptr, 'd' },
             { "help",           no_argument, nullptr, 'h' },
             { "version",        no_argument, nullptr, 'v' },
             { nullptr, 0, nullptr, 0 },
         };
 
         int opt_idx = 0;
-        static const char* opts = "hvTD"
+        static const char* opts = "hvTDcERPJO:j:"
 #ifdef DEBUG
         "B"
 #endif
@@ -45,6 +55,49 @@ Options::Options(int argc, char* argv[])
             case 'D':
                 disassemble = true;
                 break;
+            case 'c':
+                mode = OperationMode::COMPILE;
+                break;
+            case 'E':
+                mode = OperationMode::COMPILE;
+                emit_c = true;
+                break;
+            case 'n':
+                cache = false;
+                break;
+            case 'R':
+                registers = true;
+                break;
+            case 'P':
+                profile = true;
+                break;
+            case 'J':
+                jit = true;
+                break;
+            case 'O':
+                if(optarg[0] < '0' || optarg[0] > '2' || optarg[1] != '\0') {
+                    cerr << "zoe: invalid optimization level '" << optarg << "'.\n";
+                    PrintHelp(cerr, EXIT_FAILURE);
+                }
+                optimize = static_cast<unsigned>(optarg[0] - '0');
+                break;
+            case 'j': {
+                    char* end;
+                    long n = strtol(optarg, &end, 10);
+                    if(*end != '\0' || n < 1 || n > 1024) {
+                        cerr << "zoe: invalid number of jobs '" << optarg << "'.\n";
+                        PrintHelp(cerr, EXIT_FAILURE);
+                    }
+                    jobs = static_cast<unsigned>(n);
+                }
+                break;
+            case 'b':
+                trace_file = optarg;
+                break;
+            case 'd':
+                mode = OperationMode::DECODE_TRACE;
+                trace_file = optarg;
+                break;
             case 'v':
                 cout << "zoe " VERSION " - a programming language.\n";
                 cout << "Avaliable under the LGPLv3 license. See COPYING file.\n";
@@ -66,8 +119,22 @@ Options::Options(int argc, char* argv[])
         }
     }
 done:
+    if(jobs && (trace || profile || !trace_file.empty())) {
+        cerr << "zoe: --trace, --trace-buffer and --profile can't be used with --jobs.\n";
+        PrintHelp(cerr, EXIT_FAILURE);
+    }
+    if(mode == OperationMode::DECODE_TRACE && argc - optind != 1) {
+        cerr << "zoe: --decode-trace needs the SCRIPT that was traced.\n";
+        PrintHelp(cerr, EXIT_FAILURE);
+    }
+    if(mode == OperationMode::COMPILE && optind == argc) {
+        cerr << "zoe: no scripts to compile.\n";
+        PrintHelp(cerr, EXIT_FAILURE);
+    }
     if(optind < argc) {
-        mode = OperationMode::NONINTERACTIVE;
+        if(mode == OperationMode::REPL) {
+            mode = OperationMode::NONINTERACTIVE;
+        }
         while(optind < argc) {
             scripts_filename.push_back(argv[optind++]);
         }
@@ -78,12 +145,25 @@ done:
 void Options::PrintHelp(ostream& ss, int status) const
 {
     ss << "Usage: zoe [OPTION]... [SCRIPT [ARGS]...]\n";
+    ss << "       zoe --compile SCRIPT...\n";
+    ss << "       zoe --emit-c SCRIPT...\n";
+    ss << "       zoe --decode-trace=FILE SCRIPT\n";
     ss << "Avaliable options are:\n";
 #ifdef DEBUG
     ss << "   -B, --debug-bison     activate BISON debugger\n";
 #endif
+    ss << "   -c, --compile         compile each SCRIPT into a precompiled .zb file\n";
+    ss << "   -E, --emit-c          compile each SCRIPT (or .zb file) into C++ code\n";
     ss << "   -D, --disassemble     disassemble when using REPL\n";
+    ss << "       --decode-trace=FILE  print the trace in FILE (see --trace-buffer) of SCRIPT\n";
+    ss << "       --no-cache        don't use the compile cache\n";
+    ss << "   -J, --jit             compile hot functions to machine code (Linux x86-64 only)\n";
+    ss << "   -j, --jobs=N          run each SCRIPT in a VM of its own, N at a time\n";
+    ss << "   -O, --optimize=LEVEL  optimization level: 0, 1 (default) or 2\n";
+    ss << "   -P, --profile         print the most executed opcodes and opcode sequences\n";
+    ss << "   -R, --registers       execute using the register-based VM\n";
     ss << "   -T, --trace           trace assembly code execution\n";
+    ss << "       --trace-buffer=FILE  record the last instructions executed, and write them to FILE on error\n";
     ss << "   -h, --help            display this help and exit\n";
     ss << "   -v, --version         show version and exit\n";
     exit(status);
@@ -10,12 +10,20 @@ class Options {
 public:
     Options(int argc, char* argv[]);
 
-    enum OperationMode { REPL, NONINTERACTIVE };
+    enum OperationMode { REPL, NONINTERACTIVE, COMPILE, DECODE_TRACE };
     OperationMode mode = OperationMode::REPL;
 
     bool disassemble = false;
     bool trace = false;
     bool debug_bison = false;
+    bool cache = true;
+    bool registers = false;
+    bool profile = false;
+    bool jit = false;
+    bool emit_c = false;
+    unsigned optimize = 1;
+    unsigned jobs = 0;          // run each script in its own VM, on this number of threads
+    string trace_file = {};     // binary trace: written on error (--trace-buffer), or decoded (--decode-trace)
 
     vector<string> scripts_filename = {};
 
@@ -1,4 +1,9 @@
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <unistd.h>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -6,14 +11,27 @@
 using namespace std;
 
 #include "compiler/bytecode.hh"
+#include "compiler/bytecodeview.hh"
+#include "compiler/ccode.hh"
+#include "compiler/compiledchunk.hh"
 #include "compiler/literals.hh"
+#include "compiler/registercode.hh"
+#include "exe/compilecache.hh"
+#include "exe/mappedfile.hh"
 #include "vm/zoevm.hh"
-#include "vm/znil.hh"
-#include "vm/zbool.hh"
-#include "vm/znumber.hh"
+#include "vm/zbox.hh"
+#include "vm/zheap.hh"
 #include "vm/zstring.hh"
 #include "vm/zarray.hh"
+#include "vm/zfunction.hh"
 #include "vm/ztable.hh"
+#include "vm/zinlinecache.hh"
+#include "vm/zinstructions.hh"
+#include "vm/zjit.hh"
+#include "vm/zprofile.hh"
+#include "vm/zsnapshot.hh"
+#include "vm/ztracebuffer.hh"
+#include "vm/zvmpool.hh"
 
 // {{{ TEST INFRASTRUCTURE
 
@@ -190,7 +208,7 @@ static void zinspect(const char* code, const char* expected)
             cout << "not ok " << tests_run << " - " << code << " (stack size = " << Z.StackSize() << ")\n";
             return;
         }
-        _mequals<string>(string(code), [&]() { return Z.GetPtr(-1)->Inspect(); }, expected);
+        _mequals<string>(string(code), [&]() { return Z.Get(-1).Inspect(); }, expected);
     } catch(exception const& e) {
         ++tests_run;
         cout << "not ok " << tests_run << " - " << code << " (exception thrown: " << e.what() << ")\n";
@@ -254,8 +272,9 @@ static void bytecode_generation()
         b.Add(PNIL);
 
         vector<uint8_t> expected = {
-            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-            0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+            0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
             PNIL,
         };
         mequals(b.GenerateZB(), expected);
@@ -266,8 +285,9 @@ static void bytecode_generation()
         b.Add(PN8, 0x24_u8);
 
         vector<uint8_t> expected = {
-            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-            0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+            0x1A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x1A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
             PN8,  0x24,
         };
         mequals(b.GenerateZB(), expected);
@@ -278,8 +298,9 @@ static void bytecode_generation()
         b.Add(PARY, 0x1224_u16);
 
         vector<uint8_t> expected = {
-            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-            0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+            0x1B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x1B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
             PARY, 0x24, 0x12,
         };
         mequals(b.GenerateZB(), expected);
@@ -290,8 +311,9 @@ static void bytecode_generation()
         b.Add(SVAR, 0x12345678_u32);
 
         vector<uint8_t> expected = {
-            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-            0x15, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+            0x1D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x1D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
             SVAR, 0x78, 0x56, 0x34, 0x12,
         };
         mequals(b.GenerateZB(), expected);
@@ -303,8 +325,9 @@ static void bytecode_generation()
 
         // number generated from <http://www.binaryconvert.com/convert_double.html>
         vector<uint8_t> expected = {
-            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-            0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+            0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+            0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
             PNUM, 0xA7, 0xE8, 0x48, 0x2E, 0xFF, 0x21, 0x09, 0x40,
         };
         mequals(b.GenerateZB(), expected);
@@ -321,13 +344,15 @@ static void bytecode_strings()
 {
     Bytecode b;
     b.Add(PSTR, "hello");
-    uint64_t h = hash<string>()("hello");
+    uint64_t h = ZString::HashOf("hello", 5), fnv_a = 0xAF63DC4C8601EC8C;
+    mequals(ZString::HashOf("a", 1), fnv_a, "FNV-1a, the same in every build");
 
 #pragma GCC diagnostic ignored "-Wnarrowing"
 #pragma GCC diagnostic push
     vector<uint8_t> expected = {
-        0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-        0x15, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+        0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+        0x1D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+        0x1D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
         PSTR, 0x00, 0x00, 0x00, 0x00,
         'h',  'e',  'l',  'l',  'o', 0,                   // string
         h & 0xFF, (h >> 8) & 0xFF, (h >> 16) & 0xFF, (h >> 24) & 0xFF, // hash
@@ -337,6 +362,141 @@ static void bytecode_strings()
     mequals(b.GenerateZB(), expected);
 }
 
+static void bytecode_superinstructions()
+{
+    Bytecode b("let a = 3; let t = &{ x: a }; t.x");
+    b.Optimize(1);
+    vector<uint8_t> code = b.Code();
+    mequals(code[1] == CVN8 && code[2] == 3, true, "PN8 + CVAR");
+    mequals(code[code.size() - 9] == GETF, true, "GVAR + PSTR + GET");
+    mequals(b.DisassembleOpcode(code.size() - 9), "getf    1, 'x'");
+
+    Bytecode c("let f = fn() { 4 }; f()");
+    c.Optimize(1);
+    mequals(c.Code()[c.Code().size() - 7] == CALLV, true, "GVAR + CALL");
+
+    // results are the same, with fewer instructions
+    vector<string> programs = {
+        "let a = 3; let t = &{ x: a }; t.x",
+        "let a = &{ x: 1 }; let b = &[a]{}; [b.x, a.x]",
+        "let f = fn() { let a = 4; a }; f()",
+        "let a = 2; { let b = a; { let c = 4; [a, b, c] } }",
+    };
+    for(string const& program: programs) {
+        Bytecode plain(program), fused(program);
+        fused.Optimize(1);
+        ZProfile p1, p2;
+        ZoeVM Z1, Z2;
+        Z1.Profiler = &p1;
+        Z2.Profiler = &p2;
+        Z1.ExecuteBytecode(plain.GenerateZB());
+        Z2.ExecuteBytecode(fused.GenerateZB());
+        mequals(Z2.Get().Inspect(), Z1.Get().Inspect(), program);
+        mequals(p2.Instructions() < p1.Instructions(), true, program + " (fewer instructions)");
+    }
+}
+
+static void bytecode_constants()
+{
+    // constant arrays and tables are folded into a single constant
+    Bytecode b1("[1, 'a', [true, nil], %{ pub x: 3.5 }]");
+    vector<uint8_t> expected = { POP, PCON, 0, 0, 0, 0 };
+    mequals(b1.Code(), expected, "constant pushed by PCON");
+    mequals(b1.Constants().size(), 1, "nested constants are inlined");
+
+    Bytecode b2("let x = 1; [x, 2]");
+    mequals(b2.Code()[b2.Code().size() - 3] == PARY, true, "array with variables is not folded");
+    Bytecode b3("let p = &{}; &[p]{ a: 1 }");
+    mequals(b3.Code()[b3.Code().size() - 3] == PTBX, true, "table with prototype is not folded");
+    mequals(b3.Constants().size(), 1);
+
+    // the constant pool is kept in the ZB image
+    vector<uint8_t> zb = b1.GenerateZB();
+    Bytecode b4(zb);
+    mequals(b4.Constants() == b1.Constants(), true, "constants read back");
+    mequals(b4.GenerateZB(), zb, "image regenerated");
+
+    vector<uint8_t> invalid = zb;
+    invalid[24 + 6 + 4] = GVAR;     // first instruction of the constant (after the code and the size)
+    mthrows(BytecodeView view(invalid), "invalid constants are rejected");
+
+    // execution
+    zequals("%{ pub a: [1, 2], pub b: %{ pub c: 'd' } }.b.c", "d");
+    zequals("let mut a = &{ x: 1 }; a.x = 2; a.x", 2);
+    zequals("let f = fn() { &{ x: 1 } }; let mut a = f(); a.x = 2; f().x", 1);
+
+    ZoeVM Z;
+    Z.ExecuteBytecode(Bytecode("[1, 'a', [true, nil]]").GenerateZB());
+    mequals(Z.Get().Inspect(), "[1, 'a', [true, nil]]");
+
+    ZoeVM Y;
+    Y.ExecuteBytecode(Bytecode("&{ name: 'zoe', list: [1, 2, 3], sub: &{ a: true } }").GenerateZB());
+    mequals(Y.GetPtr<ZTable>()->Size(), 3);
+    mequals(Y.Collect(), 0, "constants are reachable from the result");
+}
+
+static void bytecode_optimizer()
+{
+    // dead pushes
+    Bytecode b1("4; 5");
+    b1.Optimize(1);
+    vector<uint8_t> expected = { POP, PN8, 0x05 };
+    mequals(b1.Code(), expected, "push followed by pop");
+
+    // empty scopes (only in level 2)
+    Bytecode b2("{ 4 }"), b3("{ 4 }");
+    b2.Optimize(1);
+    b3.Optimize(2);
+    expected = { POP, PSHS, PN8, 0x04, POPS };
+    mequals(b2.Code(), expected, "scope kept in level 1");
+    expected = { POP, PN8, 0x04 };
+    mequals(b3.Code(), expected, "empty scope removed in level 2");
+
+    Bytecode b4("{ let a = 4; a }");
+    b4.Optimize(2);
+    mequals(b4.Code().front() == POP && b4.Code()[1] == PSHS, true, "scope with variables is kept");
+
+    // jumps to jumps
+    Bytecode b5;
+    Label l1 = b5.CreateLabel(), l2 = b5.CreateLabel();
+    b5.Add(JMP, b5.AddLabel(l1));
+    b5.Add(PNIL);
+    b5.SetLabel(l1);
+    b5.Add(JMP, b5.AddLabel(l2));
+    b5.Add(PNIL);
+    b5.SetLabel(l2);
+    b5.Add(PBT);
+    b5.Optimize(1);
+    b5.GenerateZB();
+    mequals(b5.GetCode<uint64_t>(1), 20, "jump threaded");
+
+    Bytecode b6;
+    Label l3 = b6.CreateLabel();
+    b6.Add(JMP, b6.AddLabel(l3));
+    b6.SetLabel(l3);
+    b6.Add(PBT);
+    b6.Optimize(2);
+    expected = { PBT };
+    mequals(b6.Code(), expected, "jump to the next instruction");
+
+    // functions keep working when the code moves
+    for(unsigned level = 0; level <= 2; ++level) {
+        Bytecode b("{ 3; 4 }; fn() { { 5 }; 6 }()");
+        size_t size = b.Code().size();
+        b.Optimize(level);
+        mequals(b.Code().size() <= size, true, "code is not larger");
+        ZoeVM Z; Z.ExecuteBytecode(b.GenerateZB());
+        mequals(Z.CopyCppValue<double>(), 6, "function result");
+    }
+
+    // code that was already generated is not changed
+    Bytecode b7("4; 5");
+    Bytecode b8(b7.GenerateZB());
+    b8.Optimize(2);
+    expected = b7.Code();
+    mequals(b8.Code(), expected, "generated code is not optimized");
+}
+
 
 static void bytecode_readback()
 {
@@ -351,6 +511,51 @@ static void bytecode_readback()
 }
 
 
+static void bytecode_view()
+{
+    Bytecode b;
+    b.Add(PSTR, "hello");
+    b.Add(PN8, 3_u8);
+    b.Add(PSTR, "world");
+    vector<uint8_t> data = b.GenerateZB();
+
+    BytecodeView view(data);
+    mequals(view.CodeSize(), 12);
+    mequals(view.Code() == &data[24], true, "code is not copied");
+    mequals(view.StringCount(), 2);
+    mequals(string(view.GetString(1).str), "world");
+    mequals(view.GetString(1).hash, ZString::HashOf("world", 5));
+    mequals(view.DisassembleOpcode(0), "pstr    'hello'");
+
+    ZoeVM Z;
+    Z.ExecuteBytecode(view);
+    Z.ExecuteBytecode(view);
+    mequals(Z.StackSize(), 7, "view can be executed more than once");
+    mequals(Z.GetPtr<ZString>()->Value(), "world");
+
+    vector<uint8_t> truncated(data.begin(), data.end() - 3);
+    mthrows(BytecodeView v(truncated), "truncated string table");
+    vector<uint8_t> bad_string = data;
+    bad_string[17] = 9;
+    mthrows(BytecodeView v(bad_string), "invalid string index");
+    vector<uint8_t> bad_hash = data;
+    bad_hash.back() ^= 1;
+    mthrows(BytecodeView v(bad_hash), "string hash from another hash function");
+
+    // jumps must land on an instruction, or at the end of the code
+    Bytecode far;
+    far.Add(JMP, 100000_u64);
+    mthrows(BytecodeView v(far.GenerateZB()), "jump out of the code");
+    Bytecode middle;
+    middle.Add(PBT);
+    middle.Add(BT, 2_u64);
+    mthrows(BytecodeView v(middle.GenerateZB()), "jump to the middle of an instruction");
+    Bytecode to_end;
+    to_end.Add(PBT);
+    to_end.Add(BT, 10_u64);
+    mnothrow(BytecodeView v(to_end.GenerateZB()), "jump to the end of the code");
+}
+
 static void bytecode_labels()
 {
     Bytecode bc;
@@ -380,8 +585,9 @@ static void bytecode_parse()
     Bytecode b("3");
 
     vector<uint8_t> expected = {
-        0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x01, 0x00,   // magic + version
-        0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+        0x20, 0xE2, 0x0E, 0xFF, 0x01, 0x00, 0x02, 0x00,   // magic + version
+        0x1B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // string position
+        0x1B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   // constant pool position
         POP,  PN8,  0x03,
     };
     mequals(b.GenerateZB(), expected);
@@ -391,15 +597,34 @@ static void bytecode_parse()
 
 // {{{ VIRTUAL MACHINE
 
+static void vm_zbox()
+{
+    mequals(sizeof(ZBox), 8);
+    mequals(ZBox().Type(), NIL);
+    mequals(ZBox(true).Type(), BOOL);
+    mequals(ZBox(false).Bool(), false);
+    mequals(ZBox(-2.5).Number(), -2.5);
+    mequals(ZBox(0.0 / 0.0).Type(), NUMBER, "NaN is a number");
+    mequals(ZBox(1.0 / 0.0).Type(), NUMBER, "infinity is a number");
+    mthrows(ZBox(true).Number());
+    mthrows(ZBox(2.0).Bool());
+
+    ZHeap heap;
+    ZBox s = heap.Make<ZString>("hello");
+    mequals(s.Type(), STRING);
+    mequals(s.Ptr<ZString>()->Value(), "hello");
+    mequals(s.OpEq(heap.Make<ZString>("hello")), true);
+}
+
 static void vm_stack()
 {
     ZoeVM Z;
     
     mequals(Z.StackSize(), 1);
-    Z.Push(make_shared<ZNumber>(10));
+    Z.Push(ZBox(10.0));
     mequals(Z.StackSize(), 2);
-    mequals(Z.GetPtr<ZNumber>()->Value(), 10);
-    mequals(Z.GetCopy<ZNumber>()->Value(), 10);
+    mequals(Z.Get().Number(), 10);
+    mequals(Z.CopyCppValue<double>(), 10);
 
     Z.Pop();
     mequals(Z.StackSize(), 1);
@@ -408,13 +633,40 @@ static void vm_stack()
     mthrows(Z.Pop());
 }
 
+static void vm_stack_overflow()
+{
+    ZoeVM Z(4);
+    Z.Push(ZBox(1.0));
+    Z.Push(ZBox(2.0));
+    Z.Push(ZBox(3.0));
+    mequals(Z.StackSize(), 4);
+    mthrows(Z.Push(ZBox(4.0)));
+    mequals(Z.StackSize(), 4);
+    Z.Remove(1);
+    mequals(Z.Get(1).Number(), 2, "values are shifted when removing");
+    mequals(Z.StackSize(), 3);
+
+    Bytecode b;
+    for(int i = 0; i < 10; ++i) {
+        b.Add(PNIL);
+    }
+    ZoeVM Z2(8);
+    try {
+        Z2.ExecuteBytecode(b.GenerateZB());
+        mequals(true, false, "stack overflow raises an exception");
+    } catch(zoe_runtime_error const& e) {
+        mequals(string(e.what()), "Stack overflow (maximum of 8 values).");
+    }
+}
+
 static void vm_stack_type()
 {
     ZoeVM Z;
 
     mequals(Z.StackSize(), 1);
     mequals(Z.GetType(), NIL);
-    mthrows(Z.GetPtr<ZNumber>());
+    mthrows(Z.Get().Number());
+    mthrows(Z.GetPtr<ZString>());
 }
 
 static void vm_stack_pnil()
@@ -438,9 +690,9 @@ static void vm_stack_bool()
 
     mequals(Z.StackSize(), 3);
     mequals(Z.GetType(), BOOL);
-    auto v = Z.Pop<ZBool>();
-    mequals(v->Value(), false);
-    mequals(Z.GetPtr<ZBool>()->Value(), true);
+    ZBox v = Z.Pop();
+    mequals(v.Bool(), false);
+    mequals(Z.Get().Bool(), true);
 }
 
 static void vm_stack_number()
@@ -450,9 +702,9 @@ static void vm_stack_number()
     b.Add(PNUM, 3.1416);
 
     ZoeVM Z; Z.ExecuteBytecode(b.GenerateZB());
-    auto v = Z.Pop<ZNumber>();
-    mequals(v->Value(), 3.1416);
-    mequals(Z.GetPtr<ZNumber>()->Value(), 120);
+    ZBox v = Z.Pop();
+    mequals(v.Number(), 3.1416);
+    mequals(Z.Get().Number(), 120);
 }
 
 static void vm_stack_string()
@@ -464,6 +716,34 @@ static void vm_stack_string()
     mequals(Z.GetPtr<ZString>()->Value(), "hello");
 }
 
+static void vm_string_interning()
+{
+    Bytecode b;
+    b.Add(PSTR, "hello");
+    b.Add(PSTR, "world");
+    b.Add(PSTR, "hello");
+
+    ZoeVM Z; Z.ExecuteBytecode(b.GenerateZB());
+    mequals(Z.Get(-1).Bits() == Z.Get(-3).Bits(), true, "equal literals share the same string");
+    mequals(Z.Get(-1).Bits() == Z.Get(-2).Bits(), false);
+    mequals(Z.GetPtr<ZString>()->Interned(), true);
+    mequals(Z.Get(-1).OpEq(Z.Get(-2)), false);
+    mequals(Z.Get(-1).OpEq(Z.Heap().Make<ZString>("hello")), true, "interned and non-interned strings");
+
+    Z.ExecuteBytecode(b.GenerateZB());
+    mequals(Z.Get(-1).Bits() == Z.Get(-4).Bits(), true, "strings are shared between executions");
+    mequals(Z.Intern("world").Bits() == Z.Get(-2).Bits(), true);
+
+    ZHeap heap;
+    ZStringTable st(heap);
+    for(int i = 0; i < 1000; ++i) {
+        st.Intern(to_string(i));
+    }
+    mequals(st.Size(), 1000);
+    mequals(st.Intern("500").Ptr<ZString>()->Value(), "500");
+    mequals(st.Size(), 1000, "no new string after lookup");
+}
+
 static void vm_stack_array()
 {
     Bytecode b;
@@ -475,9 +755,9 @@ static void vm_stack_array()
 
     auto const& items = Z.GetPtr<ZArray>()->Value();
     mequals(items.size(), 2);
-    mequals(items.at(0)->Type(), NUMBER);
-    mequals(dynamic_pointer_cast<ZNumber>(items.at(0))->Value(), 3.1416);
-    mequals(items.at(1)->Type(), STRING);
+    mequals(items.at(0).Type(), NUMBER);
+    mequals(items.at(0).Number(), 3.1416);
+    mequals(items.at(1).Type(), STRING);
 }
 
 static void vm_stack_table()
@@ -495,13 +775,244 @@ static void vm_stack_table()
 
     ZoeVM Z; Z.ExecuteBytecode(b.GenerateZB());
 
-    auto const& items = Z.GetPtr<ZTable>()->Value();
-    mequals(dynamic_pointer_cast<ZString>(items.at(make_shared<ZString>("hello")).value)->Value(), "world");
-    mequals(dynamic_pointer_cast<ZString>(items.at(make_shared<ZNumber>(42)).value)->Value(), "answer");
-    mequals(dynamic_pointer_cast<ZNumber>(items.at(make_shared<ZString>("answer")).value)->Value(), 42);
-    mthrows(items.at(make_shared<ZString>("nothing")));
+    ZTable const* tbl = Z.GetPtr<ZTable>();
+    mequals(tbl->Find(Z.Heap().Make<ZString>("hello"))->Ptr<ZString>()->Value(), "world");
+    mequals(tbl->Find(ZBox(42.0))->Ptr<ZString>()->Value(), "answer");
+    mequals(tbl->Find(Z.Heap().Make<ZString>("answer"))->Number(), 42);
+    mequals(tbl->Find(Z.Heap().Make<ZString>("nothing")) == nullptr, true);
 }
 
+
+static void vm_table_map()
+{
+    ZHeap heap;
+    ZTableMap m;
+    TableConfig pm = static_cast<TableConfig>(PUB|MUT);
+
+    // hash part, with rehashing
+    for(int i = 0; i < 1000; ++i) {
+        m.Set(heap.Make<ZString>("k" + to_string(i)), ZTableValue(ZBox(static_cast<double>(i)), pm));
+    }
+    mequals(m.Size(), 1000);
+    mequals(m.Find(heap.Make<ZString>("k0"))->value.Number(), 0);
+    mequals(m.Find(heap.Make<ZString>("k999"))->value.Number(), 999);
+    mequals(m.Find(heap.Make<ZString>("k1000")) == nullptr, true);
+
+    // overwrite and erase
+    m.Set(heap.Make<ZString>("k5"), ZTableValue(ZBox(true), pm));
+    mequals(m.Size(), 1000, "overwrite keeps the size");
+    mequals(m.Find(heap.Make<ZString>("k5"))->value.Bool(), true);
+    for(int i = 0; i < 1000; i += 2) {
+        m.Erase(heap.Make<ZString>("k" + to_string(i)));
+    }
+    mequals(m.Size(), 500);
+    mequals(m.Find(heap.Make<ZString>("k4")) == nullptr, true);
+    mequals(m.Find(heap.Make<ZString>("k7"))->value.Number(), 7);
+    mequals(m.Erase(heap.Make<ZString>("k4")), false);
+
+    // array part
+    ZTableMap a;
+    for(int i = 0; i < 100; ++i) {
+        a.Set(ZBox(static_cast<double>(i)), ZTableValue(ZBox(static_cast<double>(i * 2)), pm));
+    }
+    mequals(a.Size(), 100);
+    mequals(a.ArraySize() >= 100, true, "integer keys are kept in the array part");
+    mequals(a.Find(ZBox(50.0))->value.Number(), 100);
+    a.Set(ZBox(2.5), ZTableValue(ZBox(true), pm));
+    a.Set(ZBox(-1.0), ZTableValue(ZBox(false), pm));
+    a.Set(ZBox(1e9), ZTableValue(ZBox(), pm));
+    mequals(a.Size(), 103, "fractional, negative and sparse keys go to the hash part");
+    mequals(a.Find(ZBox(2.5))->value.Bool(), true);
+    mequals(a.Find(ZBox(-1.0))->value.Bool(), false);
+    mequals(a.Find(ZBox(1e9))->value.IsNil(), true);
+    mequals(a.Erase(ZBox(50.0)), true);
+    mequals(a.Find(ZBox(50.0)) == nullptr, true);
+
+    // keys stored in the hash part migrate when the array grows
+    ZTableMap b;
+    b.Set(ZBox(20.0), ZTableValue(ZBox(20.0), pm));
+    mequals(b.ArraySize(), 0);
+    for(int i = 0; i < 20; ++i) {
+        b.Set(ZBox(static_cast<double>(i)), ZTableValue(ZBox(static_cast<double>(i)), pm));
+    }
+    mequals(b.Size(), 21);
+    mequals(b.Find(ZBox(20.0))->value.Number(), 20);
+    size_t n = 0;
+    b.ForEach([&](ZBox const&, ZTableValue const&) { ++n; });
+    mequals(n, 21, "ForEach visits every key once");
+}
+
+static void vm_table_shapes()
+{
+    ZHeap heap;
+    unique_ptr<ZShape> root_shape = ZShape::NewRoot();
+    ZShape* root = root_shape.get();
+    TableConfig pm = static_cast<TableConfig>(PUB|MUT);
+
+    // { [proto], a: 1, b: 2 }
+    vector<ZBox> items = { nullptr, heap.Make<ZString>("a"), ZBox(1.0), heap.Make<ZString>("b"), ZBox(2.0) };
+    ZBox t1 = heap.Make<ZTable>(begin(items), end(items), true, root);
+    ZBox t2 = heap.Make<ZTable>(begin(items), end(items), true, root);
+    ZTable* p1 = t1.Ptr<ZTable>();
+    ZTable* p2 = t2.Ptr<ZTable>();
+    mequals(p1->Shape() != nullptr, true, "tables start in shape mode");
+    mequals(p1->Shape() == p2->Shape(), true, "tables with the same keys share the shape");
+    mequals(p1->Shape()->Count(), 2);
+    mequals(p1->Slot(1).Number(), 2);
+    mequals(t1.OpGet(heap.Make<ZString>("b")).Number(), 2);
+
+    // transitions
+    t1.OpSet(heap.Make<ZString>("c"), ZBox(3.0), pm);
+    t2.OpSet(heap.Make<ZString>("c"), ZBox(4.0), pm);
+    mequals(p1->Shape() == p2->Shape(), true, "same transition, same shape");
+    mequals(t2.OpGet(heap.Make<ZString>("c")).Number(), 4);
+    t1.OpSet(heap.Make<ZString>("a"), ZBox(5.0), pm);
+    mequals(p1->Shape() == p2->Shape(), true, "overwriting keeps the shape");
+    mequals(t1.OpGet(heap.Make<ZString>("a")).Number(), 5);
+    mequals(t2.OpGet(heap.Make<ZString>("a")).Number(), 1);
+
+    // fallback to dictionary
+    t2.OpSet(ZBox(1.0), ZBox(true), pm);
+    mequals(p2->Shape() == nullptr, true, "non-string key: dictionary mode");
+    mequals(p2->Size(), 4);
+    mequals(t2.OpGet(heap.Make<ZString>("c")).Number(), 4);
+    mequals(t2.OpGet(ZBox(1.0)).Bool(), true);
+    t1.OpSet(heap.Make<ZString>("b"), ZBox(6.0), PUB);
+    mequals(p1->Shape() == nullptr, true, "configuration change: dictionary mode");
+    mthrows(t1.OpSet(heap.Make<ZString>("b"), ZBox(7.0), pm));
+    mequals(t1.OpGet(heap.Make<ZString>("b")).Number(), 6);
+
+    ZBox t3 = heap.Make<ZTable>(true, root);
+    for(size_t i = 0; i <= ZShape::MAX_KEYS; ++i) {
+        t3.OpSet(heap.Make<ZString>("k" + to_string(i)), ZBox(static_cast<double>(i)), pm);
+    }
+    mequals(t3.Ptr<ZTable>()->Shape() == nullptr, true, "too many keys: dictionary mode");
+    mequals(t3.OpGet(heap.Make<ZString>("k0")).Number(), 0);
+}
+
+
+static void vm_inline_cache()
+{
+    // the same GET instruction is executed 3 times
+    ZoeVM Z;
+    Z.ExecuteBytecode(Bytecode("let t = &{a: 42}; let f = fn() { t.a }; f(); f(); f()").GenerateZB());
+    mequals(Z.CopyCppValue<double>(), 42);
+    mequals(Z.ICStats().misses, 1);
+    mequals(Z.ICStats().hits, 2);
+
+    // a key built at run time is collected, and its address is reused by another key
+    string code = "let t = &{ab: 1, cd: 2}; let f = fn(k) { t[k] }; f('a'+'b'); ";
+    for(int i = 0; i < 1500; ++i) {
+        code += "[t]; ";
+    }
+    ZoeVM Zr;
+    Zr.ExecuteBytecode(Bytecode(code + "f('c'+'d')").GenerateZB());
+    mequals(Zr.CopyCppValue<double>(), 2, "keys that are not interned are not cached");
+
+    // polymorphic, and prototypes
+    ZHeap heap;
+    unique_ptr<ZShape> root_shape = ZShape::NewRoot();
+    ZShape* root = root_shape.get();
+    ZStringTable strings(heap);
+    ZBox a = strings.Intern("a"), b = strings.Intern("b");
+    vector<ZBox> i1 = { nullptr, a, ZBox(1.0) },
+                 i2 = { nullptr, b, ZBox(0.0), a, ZBox(2.0) };
+    ZBox t1 = heap.Make<ZTable>(begin(i1), end(i1), true, root),
+         t2 = heap.Make<ZTable>(begin(i2), end(i2), true, root);
+    vector<ZBox> i3 = { t2 };
+    ZBox t3 = heap.Make<ZTable>(begin(i3), end(i3), true, root);
+
+    ZInlineCache ic;
+    mequals(ic.Get(t1, a) == nullptr, true);
+    ic.LearnGet(t1, heap.Make<ZString>("a"));
+    mequals(ic.Entries(), 0, "keys that are not interned are not learned");
+    ic.LearnGet(t1, a);
+    ic.LearnGet(t2, a);
+    ic.LearnGet(t3, a);
+    mequals(ic.Entries(), 3);
+    mequals(ic.Get(t1, a)->Number(), 1);
+    mequals(ic.Get(t2, a)->Number(), 2);
+    mequals(ic.Get(t3, a)->Number(), 2, "key found in the prototype");
+    mequals(ic.Get(t1, b) == nullptr, true, "other key");
+    t2.OpSet(heap.Make<ZString>("c"), ZBox(3.0), static_cast<TableConfig>(PUB|MUT));
+    mequals(ic.Get(t3, a) == nullptr, true, "prototype shape changed");
+
+    ZInlineCache ic2;
+    ic2.LearnSet(t1, a, static_cast<TableConfig>(PUB|MUT));
+    mequals(ic2.Set(t1, a, ZBox(5.0), static_cast<TableConfig>(PUB|MUT)), true);
+    mequals(t1.OpGet(a).Number(), 5);
+    mequals(ic2.Set(t1, a, ZBox(6.0), PUB), false, "different configuration");
+
+    vector<ZBox> i4 = { nullptr, a, ZBox(static_cast<double>(PUB)), ZBox(1.0) };
+    ZBox t4 = heap.Make<ZTable>(begin(i4), end(i4), false, root);
+    ic.LearnGet(t4, a);
+    mequals(ic.Set(t4, a, ZBox(2.0), static_cast<TableConfig>(PUB|MUT)), false, "immutable fields are never written");
+}
+
+
+static void vm_gc()
+{
+    // cycles are collected
+    ZHeap heap;
+    TableConfig pm = static_cast<TableConfig>(PUB|MUT);
+    ZBox t1 = heap.Make<ZTable>(true), t2 = heap.Make<ZTable>(true);
+    t1.OpSet(heap.Make<ZString>("other"), t2, pm);
+    t2.OpSet(heap.Make<ZString>("other"), t1, pm);
+    t1.OpSet(heap.Make<ZString>("self"), t1, pm);
+    mequals(heap.Count(), 5);
+    heap.Mark(t2);
+    mequals(heap.Collect(), 0, "everything is reachable from t2");
+    mequals(heap.Collect(), 5, "nothing is reachable");
+    mequals(heap.Count(), 0);
+
+    // the VM roots are the stack, variables, interned strings and shapes
+    ZoeVM Z;
+    Z.ExecuteBytecode(Bytecode("let mut a = &{x: [1, 2]}; a.self = a; &{y: 2}; [3]; a.x").GenerateZB());
+    size_t before = Z.Heap().Count();
+    mequals(Z.Collect(), 2, "temporary table and array are freed");
+    mequals(Z.Heap().Count(), before - 2);
+    mequals(Z.Collect(), 0);
+    mequals(Z.Get(-1).Inspect(), "[1, 2]");
+
+    // collections happen automatically while allocating
+    Bytecode b;
+    for(int i = 0; i < 5000; ++i) {
+        b.Add(PNIL);
+        b.Add(PTBX, 0_u16);
+        b.Add(POP);
+    }
+    ZoeVM Z2;
+    Z2.ExecuteBytecode(b.GenerateZB());
+    mequals(Z2.Heap().Count() < 2048, true, "memory is bounded");
+    mequals(Z2.LastAllocations().objects, 5000);
+    mequals(Z2.LastAllocations().bytes, 5000 * sizeof(ZTable));
+}
+
+
+static void vm_heap_slabs()
+{
+    ZHeap heap;
+    vector<ZValue const*> ptrs;
+    for(int i = 0; i < 1000; ++i) {
+        ptrs.push_back(heap.Make<ZString>("s" + to_string(i)).Ptr());
+    }
+    mequals(heap.Allocated().objects, 1000);
+    mequals(heap.Allocated().bytes, 1000 * sizeof(ZString));
+    heap.Mark(ZBox(ptrs[0]));
+    heap.Collect();
+
+    // freed blocks are reused
+    ZBox s = heap.Make<ZString>("reused");
+    mequals(find(begin(ptrs), end(ptrs), s.Ptr()) != end(ptrs), true);
+    mequals(ZBox(ptrs[0]).Ptr<ZString>()->Value(), "s0", "live values are kept");
+
+    // a value whose constructor throws is not kept
+    vector<ZBox> items = { ZBox(1.0) };     // invalid prototype
+    mthrows(heap.Make<ZTable>(begin(items), end(items), true));
+    mequals(heap.Count(), 2);
+}
+
+
 static void vm_stack_pop()
 {
     Bytecode b;
@@ -512,6 +1023,621 @@ static void vm_stack_pop()
     mequals(Z.StackSize(), 0);
 }
 
+static void vm_dispatch()
+{
+    Bytecode b;
+    b.Add(NOP);
+    b.Add(PN8, 1_u8);
+    b.Add(NOP);
+    vector<uint8_t> zb = b.GenerateZB();
+
+    ZoeVM Z; Z.ExecuteBytecode(zb);
+    mequals(Z.StackSize(), 2);
+
+    vector<uint8_t> invalid = zb;
+    invalid.back() = 0xF0;
+    mthrows(Z.ExecuteBytecode(invalid), "invalid opcode");
+
+    vector<uint8_t> incomplete = zb;
+    incomplete.pop_back();
+    incomplete.pop_back();
+    incomplete[8] = static_cast<uint8_t>(incomplete[8] - 2);    // string position
+    incomplete[16] = static_cast<uint8_t>(incomplete[16] - 2);  // constant pool position
+    mthrows(Z.ExecuteBytecode(incomplete), "incomplete instruction");
+    mequals(Z.StackSize(), 2, "invalid code is not executed");
+}
+
+
+static void vm_profile()
+{
+    ZProfile profile;
+    ZoeVM Z;
+    Z.Profiler = &profile;
+    Z.ExecuteBytecode(Bytecode("let a = &{ x: 1 }; a.x; a.x").GenerateZB());
+
+    mequals(profile.Count({ GET }), 2);
+    mequals(profile.Count({ GVAR, PSTR, GET }), 2, "sequence of three opcodes");
+    mequals(profile.Count({ POP, GVAR }), 2, "sequence of two opcodes");
+    mequals(profile.Count({ GET, GVAR }), 0, "sequences are only counted when contiguous in the code");
+    vector<ZProfile::Sequence> top = profile.Top(3, 2);
+    mequals(top.size(), 2);
+    mequals(top[0].count, 2, "most common triples");
+    mequals(top[0].opcodes == vector<Opcode>({ GVAR, PSTR, GET }) || top[1].opcodes == vector<Opcode>({ GVAR, PSTR, GET }), true, "most common triples");
+    uint64_t instructions = profile.Instructions();
+
+    // jumps start new sequences
+    Z.ExecuteBytecode(Bytecode("fn() { 4 }()").GenerateZB());
+    mequals(profile.Count({ JMP, PFUN }), 0, "a jump breaks the sequence");
+    mequals(profile.Count({ PFUN, CALL }), 1);
+    mequals(profile.Instructions() > instructions, true, "profile is shared by executions");
+    mequals(profile.Report().find("gvar pstr get") != string::npos, true, "report");
+}
+
+static void vm_trace_buffer()
+{
+    ZTraceBuffer trace(5);
+    mequals(trace.Capacity(), 8, "capacity is a power of two");
+
+    ZoeVM Z;
+    Z.TraceBuffer = &trace;
+    vector<uint8_t> zb = Bytecode("let f = fn(x) { x + 1 }; f(1); f(2); f(nil)").GenerateZB();
+    mthrows(Z.ExecuteBytecode(zb), "error");
+    mequals(trace.Recorded() > 8, true);
+    vector<ZTraceBuffer::Entry> entries = trace.Entries();
+    mequals(entries.size(), 8, "only the last instructions are kept");
+    mequals(entries.back().opcode == ADD_NN, true, "the instruction that failed, as executed");
+    mequals(entries.back().depth, 2);
+    mequals(entries.front().time <= entries.back().time, true, "timestamps");
+
+    // decoded offline, with the code that was running
+    vector<uint8_t> dump = trace.Dump();
+    string text = ZTraceBuffer::Decode(dump.data(), dump.size(), BytecodeView(zb));
+    mequals(text.find("instructions before these were not kept") != string::npos, true);
+    mequals(text.find("* 0000001D:   add_nn              < ? >") != string::npos, true, "format of the trace");
+    mequals(text.find("pn8     1           < 2 values >") != string::npos, true, "stack size after each instruction");
+    vector<uint8_t> other = Bytecode("1").GenerateZB();
+    mthrows(ZTraceBuffer::Decode(dump.data(), dump.size(), BytecodeView(other)), "trace of another code");
+    mthrows(ZTraceBuffer::Decode(dump.data(), dump.size() - 1, BytecodeView(zb)), "truncated trace");
+    vector<uint8_t> huge = dump;
+    fill(begin(huge) + 16, begin(huge) + 20, 0xFF);     // number of entries
+    mthrows(ZTraceBuffer::Decode(huge.data(), huge.size(), BytecodeView(zb)), "number of entries larger than the trace");
+
+    trace.Clear();
+    mequals(trace.Entries().size(), 0);
+}
+
+static void vm_jit()
+{
+    if(!ZJit::Supported()) {
+        ZoeVM Z;
+        mequals(Z.EnableJit(), false, "JIT not supported in this platform");
+        return;
+    }
+
+    // the compiled functions give the same results as the interpreter
+    vector<string> programs = {
+        "let f = fn() { [1, 2, 'abc'] }; [f(), f(), f(), f(), f()]",
+        "let t = &{a: 42}; let f = fn() { let x = t.a; [x, &{ b: x }] }; [f(), f(), f(), f()]",
+        "let mut t = &{a: 1}; let f = fn() { t.a = [t.a] }; f(); f(); f(); f(); t",
+    };
+    for(string const& program: programs) {
+        vector<uint8_t> zb = Bytecode(program).GenerateZB();
+        ZoeVM I, J;
+        mequals(J.EnableJit(2), true);
+        I.ExecuteBytecode(zb);
+        J.ExecuteBytecode(zb);
+        string expected = I.Get().Inspect();
+        mequals(J.Get().Inspect(), expected, program);
+        mequals(J.Jit()->Compiled(), 1, "function compiled");
+    }
+
+    // functions are only compiled after they get hot
+    ZoeVM Z;
+    Z.EnableJit(3);
+    Z.ExecuteBytecode(Bytecode("let f = fn() { 4 }; f(); f()").GenerateZB());
+    mequals(Z.Jit()->Compiled(), 0, "function not hot");
+    Z.ExecuteBytecode(Bytecode("let f = fn() { 4 }; f(); f(); f()").GenerateZB());
+    mequals(Z.Jit()->Compiled(), 1, "function hot");
+
+    // ...and kept while the VM executes the same chunk (but not a copy of it)
+    ZoeVM K;
+    K.EnableJit(3);
+    vector<uint8_t> twice = Bytecode("let f = fn() { 4 }; f(); f()").GenerateZB();
+    auto chunk = CompiledChunk::Create(twice);
+    K.ExecuteChunk(chunk);
+    K.ExecuteChunk(chunk);
+    mequals(K.Jit()->Compiled(), 1, "calls counted across executions");
+    K.ExecuteChunk(chunk);
+    mequals(K.Get().Number(), 4);
+    K.ExecuteChunk(CompiledChunk::Create(twice));
+    mequals(K.Jit()->Compiled(), 0, "the same image in another chunk is another code");
+    K.ExecuteChunk(chunk);
+    K.ExecuteChunk(chunk);
+    mequals(K.Jit()->Compiled(), 1);
+    K.ExecuteBytecode(Bytecode("1").GenerateZB());
+    mequals(K.Jit()->Compiled(), 0, "discarded when another code is executed");
+
+    // the trace buffer doesn't turn the JIT off
+    ZTraceBuffer buffer;
+    ZoeVM T;
+    T.EnableJit(3);
+    T.TraceBuffer = &buffer;
+    T.ExecuteBytecode(Bytecode("let f = fn() { 4 }; f(); f(); f()").GenerateZB());
+    mequals(T.Jit()->Compiled(), 1, "functions compiled while recording");
+    mequals(buffer.Recorded() > 0, true);
+
+    // errors in compiled code
+    ZoeVM E;
+    E.EnableJit(3);
+    mthrows(E.ExecuteBytecode(Bytecode("let mut t = &{ a: [1, 2] }; let f = fn() { let [x, y] = t.a; x }; f(); f(); t.a = [1]; f()").GenerateZB()), "runtime error in JIT code");
+    mequals(E.Jit()->Compiled(), 1);
+
+    // perf map
+    ZoeVM P;
+    P.EnableJit(1, true);
+    remove(P.Jit()->PerfMapFilename().c_str());
+    P.ExecuteBytecode(Bytecode("fn() { 4 }()").GenerateZB());
+    ifstream map(P.Jit()->PerfMapFilename());
+    string line;
+    getline(map, line);
+    mequals(line.find(" zoe_fn_") != string::npos, true, "perf map");
+    remove(P.Jit()->PerfMapFilename().c_str());
+}
+
+static void native_code(ZoeVM::Native& z)
+{
+    z.VM().Pop();
+    z.Step<PSTR>(z.Code() + 1);
+    z.VM().Push(ZBox(42.0));
+}
+
+static void ccode()
+{
+    // the native interface
+    vector<uint8_t> zb = Bytecode("'abc'").GenerateZB();     // pop, pstr 0
+    ZoeVM Z;
+    Z.ExecuteNative(BytecodeView(zb), native_code);
+    mequals(Z.Get(-2).Inspect(), "'abc'", "native code");
+    mequals(Z.CopyCppValue<double>(), 42);
+
+    // generated code
+    Bytecode b("let f = fn() { let a = 4.5; [a, 'x'] }; f(); f()");
+    b.Optimize(1);
+    zb = b.GenerateZB();
+    string cpp = GenerateCpp(zb.data(), zb.size(), "test.zoe");
+    mequals(cpp.find("vm.Push(ZBox(4.5));") != string::npos, true, "numbers are pushed directly");
+    mequals(cpp.find("z.Step<PSTR>(code + ") != string::npos, true, "other instructions call the VM");
+    mequals(cpp.find("goto L_") != string::npos, true, "jumps become gotos");
+    mequals(cpp.find("z.CallVariable(") != string::npos, true, "calls");
+    mequals(cpp.find("addr = z.Return(); goto dispatch;") != string::npos, true, "returns");
+    mequals(cpp.find("CompiledMain(argc, argv, image, sizeof image, run)") != string::npos, true, "main");
+    mequals(GenerateCpp(zb.data(), zb.size(), "x").find("case 0x") != string::npos, true, "dispatch");
+
+    Bytecode inf;
+    inf.Add(PNUM, 1.0 / 0.0);
+    zb = inf.GenerateZB();
+    mequals(GenerateCpp(zb.data(), zb.size(), "x").find("z.Step<PNUM>(code + ") != string::npos, true, "no literal for infinity");
+}
+
+static void vm_quickening()
+{
+    // operators are quickened for the types they find
+    ZProfile profile;
+    ZoeVM Z;
+    Z.Profiler = &profile;
+    vector<uint8_t> zb = Bytecode("let t = &{ a: 1 }; let f = fn() { t.a + 2 < 4 }; [f(), f(), f()]").GenerateZB();
+    vector<uint8_t> original = zb;
+    Z.ExecuteBytecode(zb);
+    mequals(Z.Get().Inspect(), "[true, true, true]");
+    mequals(profile.Count({ ADD }), 1);
+    mequals(profile.Count({ ADD_NN }), 2, "quickened after the first execution");
+    mequals(profile.Count({ LT_NN }), 2);
+    mequals(profile.Count({ GET_STR }), 2);
+    mequals(zb == original, true, "the bytecode is not changed");
+
+    // ...and de-quickened when the types change
+    ZProfile p2;
+    ZoeVM Y;
+    Y.Profiler = &p2;
+    Y.ExecuteBytecode(Bytecode("let mut a = 1; let f = fn() { a + a }; let x = f(); a = 's'; [x, f(), f()]").GenerateZB());
+    mequals(Y.Get().Inspect(), "[2, 'ss', 'ss']");
+    mequals(p2.Count({ ADD_NN }), 1, "de-quickened");
+    mequals(p2.Count({ ADD }), 2, "not quickened again");
+
+    // quickened opcodes are not accepted in the bytecode
+    vector<uint8_t> q = Bytecode("1 + 2").GenerateZB();
+    replace(begin(q) + 24, end(q), static_cast<uint8_t>(ADD), static_cast<uint8_t>(ADD_NN));
+    mthrows(BytecodeView{q}, "quickened opcode in bytecode");
+}
+
+static void vm_frames()
+{
+    // locals are addressed relative to the frame, calls in tail position reuse it
+    Bytecode b("let g = fn(x) { x }; let f = fn(x) { let y = x; g(y) }; f(1)");
+    string dis = b.Disassemble();
+    mequals(dis.find("gloc    1") != string::npos, true, "local variable");
+    mequals(dis.find("gvar    0") != string::npos, true, "global variable");
+    mequals(dis.find("tailcall 1") != string::npos, true, "tail call");
+    mequals(dis.find("call    1") != string::npos, true, "the call at the top level is not a tail call");
+
+    // a recursion deeper than the call stack (the table chooses when to stop, as there are no conditionals yet)
+    string head = "let next = &{}; let done = fn(n) { n }; let mut count = nil; count = fn(n) { next[n < 1](n - 1)",
+           end = " }; next[true] = done; next[false] = count; count(5000)";
+    string tail = head + end, nontail = head + " + 0" + end;
+
+    ZoeVM Z(1024);
+    Z.ExecuteBytecode(Bytecode(tail).GenerateZB());
+    mequals(Z.CopyCppValue<double>(), -1, "tail calls run in constant stack");
+
+    ZoeVM N(1024);
+    mthrows(N.ExecuteBytecode(Bytecode(nontail).GenerateZB()), "call stack overflow");
+    N.ExecuteBytecode(Bytecode("fn(x) { x + 1 }(2)").GenerateZB());
+    mequals(N.CopyCppValue<double>(), 3, "frames are discarded after an error");
+
+    // the globals are kept between executions, but the functions can only be called by the code that created them
+    ZoeVM F;
+    F.ExecuteBytecode(Bytecode("let f = fn() { 4 }; f()").GenerateZB());
+    mthrows(F.ExecuteBytecode(Bytecode("let g = nil; g()").GenerateZB()), "function of a previous execution");
+}
+
+static void vm_closures()
+{
+    // only the functions that capture variables are closures, and only the scopes of captured variables close them
+    Bytecode b("let f = fn(x) { { let a = 1; a } }; let g = fn(x) { let h = { let a = x; fn() { a } }; h() }");
+    string dis = b.Disassemble();
+    mequals(dis.find("pfun    1") != string::npos, true, "function without upvalues");
+    mequals(dis.find("pclo    0, 1") != string::npos, true, "closure");
+    mequals(dis.find("capl    1") != string::npos, true, "captured local");
+    mequals(dis.find("close   1") != string::npos, true, "upvalues closed at the end of the scope");
+    mequals(count(begin(b.Code()), end(b.Code()), static_cast<uint8_t>(CLOSE)) >= 1, true);
+
+    // closed upvalues are kept by the closures during garbage collection
+    ZoeVM Z;
+    Z.ExecuteBytecode(Bytecode(
+        "let next = &{}; let done = fn(n) { n };"
+        "let keep = fn() { let mut x = 'kept'; fn() { x } }();"
+        "let mut loop = nil; loop = fn(n) { let t = &{ a: [n] }; next[n < 1](n - 1) };"
+        "next[true] = done; next[false] = loop; loop(3000); keep()").GenerateZB());
+    mequals(Z.Get().Inspect(), "'kept'");
+    mequals(Z.Heap().Allocated().objects > 3000, true, "the collector ran");
+}
+
+static void vm_coroutines()
+{
+    Bytecode b("let g = coroutine fn() { yield 1 }; resume g");
+    string dis = b.Disassemble();
+    mequals(dis.find("pcor") != string::npos, true, "coroutine created");
+    mequals(dis.find("yield") != string::npos, true);
+    mequals(dis.find("resume") != string::npos, true);
+
+    // a pipeline (producer -> filter -> consumer) runs in constant memory
+    string pipeline =
+        "let step = &{}; let pass = &{}; let sink = &{}; let mut sum = 0;"
+        "let mut produce = nil; produce = fn(i) { yield i; step[i < 100000](i + 1) };"
+        "step[true] = produce; step[false] = fn(i) { nil };"
+        "let source = coroutine fn() { produce(1) };"
+        "let mut double = nil; double = fn() { let v = resume source; pass[v == nil](v) };"
+        "pass[false] = fn(v) { yield v * 2; double() }; pass[true] = fn(v) { nil };"
+        "let doubled = coroutine fn() { double() };"
+        "let mut consume = nil; consume = fn() { let v = resume doubled; sink[v == nil](v) };"
+        "sink[false] = fn(v) { sum = sum + v; consume() }; sink[true] = fn(v) { sum };"
+        "consume()";
+    ZoeVM Z;
+    Z.ExecuteBytecode(Bytecode(pipeline).GenerateZB());
+    mequals(Z.CopyCppValue<double>(), 10000100000.0, "pipeline");
+    mequals(Z.LastAllocations().objects < 100, true, "no allocations for each element");
+    mequals(Z.StackSize(), 1, "nothing left in the stack");
+
+    // a suspended coroutine keeps its values during garbage collection
+    ZoeVM Y;
+    Y.ExecuteBytecode(Bytecode(
+        "let next = &{}; let done = fn(n) { n };"
+        "let g = coroutine fn() { let t = &{ a: 'kept' }; yield nil; t.a };"
+        "resume g;"
+        "let mut loop = nil; loop = fn(n) { let t = &{ a: [n] }; next[n < 1](n - 1) };"
+        "next[true] = done; next[false] = loop; loop(3000); resume g").GenerateZB());
+    mequals(Y.Get().Inspect(), "'kept'");
+    mequals(Y.Heap().Allocated().objects > 3000, true, "the collector ran");
+
+    // after an error in a coroutine, the VM is back in the main context
+    ZoeVM X;
+    mthrows(X.ExecuteBytecode(Bytecode("resume coroutine fn() { fn() { 1 + nil }() }").GenerateZB()), "error in a coroutine");
+    X.ExecuteBytecode(Bytecode("fn(x) { x + 1 }(2)").GenerateZB());
+    mequals(X.CopyCppValue<double>(), 3);
+
+    // coroutines resumed by coroutines, without end
+    ZoeVM R;
+    mthrows(R.ExecuteBytecode(Bytecode("let mut f = nil; f = fn() { let c = coroutine fn() { f() }; resume c }; f()").GenerateZB()),
+            "coroutine overflow");
+    R.ExecuteBytecode(Bytecode("fn(x) { x + 1 }(2)").GenerateZB());
+    mequals(R.CopyCppValue<double>(), 3);
+
+    // compiled ahead of time
+    vector<uint8_t> zb = b.GenerateZB();
+    string cpp = GenerateCpp(zb.data(), zb.size(), "test.zoe");
+    mequals(cpp.find("addr = z.Resume(") != string::npos, true, "resume");
+    mequals(cpp.find("addr = z.Yield(") != string::npos, true, "yield");
+}
+
+static void vm_chunk()
+{
+    auto chunk = CompiledChunk::Create(Bytecode(
+        "let t = &{ a: 1 }; let f = fn(x) { x + t.a }; let g = fn() { t.a = 2 }; g(); [f(1), f(2.5)]").GenerateZB());
+    mequals(chunk->InlineCaches(), 2, "one inline cache for each GET/SET/GETF");
+    mequals(chunk->Functions().size(), 2, "function entry table");
+    mequals(chunk->IsFunction(chunk->Functions()[0]), true);
+    mequals(chunk->IsFunction(chunk->Functions()[0] + 1), false);
+
+    // the same chunk runs in many VMs, that quicken their own copy of the code
+    BytecodeView const& view = chunk->View();
+    vector<uint8_t> code(view.Code(), view.Code() + view.CodeSize());
+    ZoeVM Z1, Z2;
+    Z1.ExecuteChunk(chunk);
+    Z2.ExecuteChunk(chunk);
+    mequals(Z1.Get().Inspect(), "[3, 4.5]");
+    mequals(Z2.Get().Inspect(), "[3, 4.5]");
+    mequals(vector<uint8_t>(view.Code(), view.Code() + view.CodeSize()), code, "the chunk is not written to");
+
+    // only the functions in the table can be called
+    Bytecode b;
+    b.Add(PNIL);
+    b.Add(PNUM, 2.0);       // in the middle of an instruction
+    b.Add(PFUN, 0_u8);
+    ZoeVM Z3;
+    mthrows(Z3.ExecuteChunk(CompiledChunk::Create(b.GenerateZB())), "invalid function address");
+}
+
+static void vm_pool()
+{
+    ZVMPool pool(4);
+    mequals(pool.Threads(), 4);
+
+    // each script runs in a VM of its own, and the images are shared
+    auto sum = CompiledChunk::Create(Bytecode("let a = 'x'; let t = &{ a: a }; [t.a, 1 + 2]").GenerateZB());
+    vector<future<string>> results;
+    for(int i = 0; i < 200; ++i) {
+        results.push_back(pool.Submit(sum));
+    }
+    size_t ok = 0;
+    for(auto& r: results) {
+        ok += (r.get() == "['x', 3]");
+    }
+    mequals(ok, 200, "scripts run in parallel");
+
+    // errors are passed to the host
+    future<string> error = pool.Submit(CompiledChunk::Create(Bytecode("1 + nil").GenerateZB()));
+    mthrows(error.get(), "error in a script");
+
+    // idle workers steal from the others
+    ZVMPool two(2);
+    auto slow = CompiledChunk::Create(Bytecode(
+        "let next = &{}; let done = fn(n) { n };"
+        "let mut loop = nil; loop = fn(n) { let t = &{ a: [n] }; next[n < 1](n - 1) };"
+        "next[true] = done; next[false] = loop; loop(30000)").GenerateZB());
+    auto fast = CompiledChunk::Create(Bytecode("1").GenerateZB());
+    two.Submit(slow);
+    for(int i = 0; i < 99; ++i) {
+        two.Submit(fast);
+    }
+    two.Wait();
+    mequals(two.Stolen() > 0, true, "work stealing");
+
+    // Wait returns once every script submitted has run
+    ZVMPool many(4);
+    size_t ready = 0;
+    for(int round = 0; round < 50; ++round) {
+        vector<future<string>> batch;
+        for(int i = 0; i < 10; ++i) {
+            batch.push_back(many.Submit(fast));
+        }
+        many.Wait();
+        for(auto& r: batch) {
+            ready += (r.wait_for(chrono::seconds(0)) == future_status::ready);
+        }
+    }
+    mequals(ready, 500, "waiting for the scripts");
+
+    // the VMs can be set up by the host
+    ZVMPool reg(1, [](ZoeVM& Z) { Z.RegisterBackend = true; });
+    mequals(reg.Submit(sum).get(), "['x', 3]", "VM setup");
+}
+
+static void vm_snapshot()
+{
+    ZoeVM warm;
+    warm.ExecuteBytecode(Bytecode(
+        "let base = &{ kind: 'base' };"
+        "let obj = &[base]{ name: 'obj', tags: ['a', 'b', 1.5], flags: %{ pub ok: true } };"
+        "let cyc = &{}; cyc.self = cyc;"
+        "let counter = fn() { let mut x = 41; fn() { x + 1 } }();"
+        "[obj, cyc, counter]").GenerateZB());
+    vector<uint8_t> image = ZSnapshot::Save(warm);
+
+    ZoeVM Z;
+    ZSnapshot::Restore(Z, image.data(), image.size());
+    mequals(Z.StackSize(), warm.StackSize());
+    vector<ZBox> const& items = Z.GetPtr<ZArray>()->Value();
+    mequals(items[0].Inspect(), warm.GetPtr<ZArray>()->Value()[0].Inspect(), "values restored");
+    ZTable const* obj = items[0].Ptr<ZTable>();
+    mequals(obj->Shape() != nullptr, true, "tables get the shapes of the new VM");
+    mequals(obj->Find(Z.Intern("name")) != nullptr, true, "keys are interned in the new VM");
+    mequals(obj->OpGet(Z.Intern("kind")).Inspect(), "'base'", "prototype");
+    TableConfig config;
+    obj->Find(Z.Intern("flags"))->Ptr<ZTable>()->Find(Z.Intern("ok"), &config);
+    mequals(config, PUB, "configuration of the fields");
+    mequals(items[1].Ptr<ZTable>()->Find(Z.Intern("self"))->Ptr() == items[1].Ptr(), true, "cycles");
+    mequals(items[2].Ptr<ZClosure>()->Upvalue(0)->Value().Number(), 41, "closed upvalues");
+    mequals(Z.Collect(), 0, "every value restored is reachable");
+    Z.ExecuteBytecode(Bytecode("1 + 2").GenerateZB());
+    mequals(Z.CopyCppValue<double>(), 3, "the VM runs code after restored");
+    mthrows(Z.ExecuteBytecode(Bytecode("let a = nil; let b = nil; let c = nil; let d = nil; d()").GenerateZB()),
+            "restored functions can't be called by other code");
+
+    // errors
+    ZoeVM C;
+    C.ExecuteBytecode(Bytecode("coroutine fn() { 1 }").GenerateZB());
+    mthrows(ZSnapshot::Save(C), "coroutines can't be saved");
+    ZoeVM Y;
+    mthrows(ZSnapshot::Restore(Y, image.data(), image.size() - 1), "truncated image");
+    vector<uint8_t> huge = image;
+    fill(begin(huge) + 8, begin(huge) + 12, 0xFF);     // number of values
+    mthrows(ZSnapshot::Restore(Y, huge.data(), huge.size()), "number of values larger than the image");
+    image[12] = 0xFF;
+    mthrows(ZSnapshot::Restore(Y, image.data(), image.size()), "corrupted image");
+}
+
+static void vm_register_backend()
+{
+    // the same code must give the same results in both backends
+    vector<string> programs = {
+        "nil", "true", "3.14", "'hello'",
+        "[1, 2, ['a', 'b']]",
+        "let a = 4; let b = a; [b, a]",
+        "let mut a = 4; a = 5; a",
+        "let mut a = 4; let b = a; a = 5; [a, b]",
+        "let [a, b, c] = [3, 4, 5]; [c, b, a]",
+        "{ let a = 3; { let b = a; b } }",
+        "let mut a = &{ hello: 'world' }; a.hello = 42; a.test = a.hello; a",
+        "let mut a = &{}; a.b = 42; a.b",
+        "let x = &{a: 42}; let b = &[x]{}; x.a = 12; b.a",
+        "let k = 'a'; let t = &{a: 1}; t[k]",
+        "let mut a = &{ x: 1 }; let b = a.x = 2; [a.x, b]",
+    };
+    for(string const& program: programs) {
+        vector<uint8_t> zb = Bytecode(program).GenerateZB();
+        ZoeVM S, R;
+        R.RegisterBackend = true;
+        S.ExecuteBytecode(zb);
+        R.ExecuteBytecode(zb);
+        mequals(R.StackSize(), S.StackSize(), program + " (stack size)");
+        mequals(R.Get(-1).Inspect(), S.Get(-1).Inspect(), program);
+    }
+
+    // runtime errors are also raised
+    ZoeVM R; R.RegisterBackend = true;
+    mthrows(R.ExecuteBytecode(Bytecode("let [a, b] = [2, 4, 5]").GenerateZB()), "runtime errors in the register backend");
+
+    // variables and constant strings are used directly by the instructions
+    vector<uint8_t> zb = Bytecode("let mut a = &{ x: 1 }; a.x = a.x").GenerateZB();
+    BytecodeView view(zb);
+    RegisterCode rc;
+    string reason;
+    mequals(rc.Translate(view, &reason), true);
+    size_t stack_instructions = 0;
+    for(size_t pos = 0; pos < view.CodeSize(); pos += opcode_size(view.Code()[pos])) {
+        ++stack_instructions;
+    }
+    mequals(rc.Code().size() < stack_instructions, true, "register code is shorter");
+
+    // functions are not supported: the stack VM is used
+    vector<uint8_t> fn = Bytecode("fn() { 4 }()").GenerateZB();
+    mequals(rc.Translate(BytecodeView(fn), &reason), false);
+    ZoeVM F; F.RegisterBackend = true;
+    F.ExecuteBytecode(fn);
+    mequals(F.CopyCppValue<double>(), 4);
+}
+
+// }}}
+
+// {{{ EXECUTABLE
+
+// a directory of its own for each test, removed at the end
+class TempDir {
+public:
+    TempDir() {
+        char tmpl[] = "/tmp/zoe-test-XXXXXX";
+        path = mkdtemp(tmpl);
+    }
+    ~TempDir() {
+        if(DIR* dir = opendir(path.c_str())) {
+            while(struct dirent* ent = readdir(dir)) {
+                unlink((path + "/" + ent->d_name).c_str());
+            }
+            closedir(dir);
+        }
+        rmdir(path.c_str());
+    }
+    TempDir(TempDir const&) = delete;
+    TempDir& operator=(TempDir const&) = delete;
+
+    string Write(string const& name, vector<uint8_t> const& data) const {
+        ofstream f(path + "/" + name, ios::binary);
+        f.write(reinterpret_cast<char const*>(data.data()), static_cast<streamsize>(data.size()));
+        return path + "/" + name;
+    }
+    vector<string> Files() const {
+        vector<string> files;
+        DIR* dir = opendir(path.c_str());
+        while(struct dirent* ent = readdir(dir)) {
+            if(ent->d_name[0] != '.') {
+                files.push_back(path + "/" + ent->d_name);
+            }
+        }
+        closedir(dir);
+        return files;
+    }
+
+    string path = "";
+};
+
+static void exe_mapped_file()
+{
+    TempDir tmp;
+    string file = tmp.Write("data", { 1, 2, 3 });
+    MappedFile f(file);
+    mequals(vector<uint8_t>(f.Data(), f.Data() + f.Size()), vector<uint8_t>({ 1, 2, 3 }), "contents");
+    mequals(f.ModificationTime() > 0, true, "modification time");
+
+    MappedFile empty(tmp.Write("empty", {}));
+    mequals(empty.Size(), 0, "empty file");
+    mthrows(MappedFile m(tmp.path + "/missing"), "missing file");
+}
+
+static void exe_compile_cache()
+{
+    TempDir tmp;
+    setenv("ZOE_CACHE_DIR", tmp.path.c_str(), 1);
+    string source = "[1, 2]";
+    vector<uint8_t> zb = Bytecode(source).GenerateZB();
+
+    CompileCache cache;
+    mequals(cache.Enabled(), true);
+    mequals(cache.Lookup("script.zoe", 10, source) == nullptr, true, "empty cache");
+    cache.Store("script.zoe", 10, source, zb);
+    auto hit = cache.Lookup("script.zoe", 10, source);
+    mequals(hit != nullptr, true, "cache hit");
+    mequals(vector<uint8_t>(hit->Data(), hit->Data() + hit->Size()), zb, "image in the cache");
+
+    // invalidation
+    mequals(cache.Lookup("script.zoe", 11, source) == nullptr, true, "modification time changed");
+    mequals(cache.Lookup("script.zoe", 10, "[1, 3]") == nullptr, true, "contents changed");
+    mequals(cache.Lookup("other.zoe", 10, source) == nullptr, true, "other script");
+    mequals(CompileCache(1).Lookup("script.zoe", 10, source) == nullptr, true, "other optimization level");
+    cache.Store("script.zoe", 11, source, zb);
+    mequals(tmp.Files().size(), 1, "older entries are removed");
+
+    // a corrupted entry (with a valid header) is a miss, and is removed
+    vector<uint8_t> corrupted = zb;
+    corrupted.resize(corrupted.size() - 1);
+    tmp.Write(tmp.Files()[0].substr(tmp.path.size() + 1), corrupted);
+    mequals(cache.Lookup("script.zoe", 11, source) == nullptr, true, "corrupted entry");
+    mequals(tmp.Files().size(), 0, "corrupted entry removed");
+    cache.Store("script.zoe", 11, source, zb);
+    mequals(cache.Lookup("script.zoe", 11, source) != nullptr, true, "stored again");
+
+    unsetenv("ZOE_CACHE_DIR");
+}
+
+static void exe_zb_file()
+{
+    // a compiled script (as written by --compile) is executed in place
+    TempDir tmp;
+    MappedFile f(tmp.Write("script.zb", Bytecode("let f = fn(x) { x * 2 }; [f(21), 'ok']").GenerateZB()));
+    ZoeVM Z;
+    Z.ExecuteBytecode(BytecodeView(f.Data(), f.Size()));
+    mequals(Z.Get().Inspect(), "[42, 'ok']", "round trip");
+}
+
 // }}}
 
 // {{{ ZOE BASIC EXECUTION
@@ -559,6 +1685,7 @@ static void zoe_inspection()
     zinspect("3.14", "3.14");
     zinspect("true", "true");
     zinspect("'hello'", "'hello'");
+    zinspect("nil", "nil");
 }
 
 // }}}
@@ -729,6 +1856,108 @@ static void zoe_table_proto()
 static void zoe_functions()
 {
     zequals("fn() { 4 }()", 4);
+
+    // arguments
+    zequals("let sum = fn(a, b) { a + b }; sum(2, 3)", 5);
+    zequals("let f = fn(x) { x }; f(1) + f(2) * 10", 21);
+    zequals("fn(a, b) { a - b }(5, 3)", 2);
+    zthrows("let f = fn(a) { a }; f()");
+    zthrows("fn() { 1 }(2)");
+    zthrows("fn(a, a) { a }");
+
+    // locals are in the frame, globals are shared
+    zequals("let f = fn(a) { let b = a * 2; b + 1 }; f(4)", 9);
+    zequals("let f = fn(x) { let y = x; y }; let a = 1; let b = 2; f(7)", 7);
+    zequals("let k = 10; let f = fn(a) { let k = 1; a + k }; f(1) + k", 12);
+    zequals("let mut g = 1; let f = fn() { g = 5 }; f(); g", 5);
+    zequals("let sq = fn(x) { x * x }; let f = fn(a, b) { let c = sq(a); c + sq(b) }; f(3, 4)", 25);
+    zthrows("fn(a) { a = 2 }");
+
+    // tail calls
+    zequals("let f = fn(x) { x + 1 }; let g = fn(x) { f(x * 2) }; g(5)", 11);
+    zequals("let f = fn(x) { x + 1 }; let g = fn(x) { { let y = x; f(y) } }; g(5) + g(1)", 8);
+}
+
+static void zoe_closures()
+{
+    zequals("let make = fn(x) { fn() { x } }; make(4)()", 4);
+    zequals("let counter = fn() { let mut n = 0; fn() { n = n + 1 } }; let c = counter(); c(); c(); c()", 3);
+    zequals("let counter = fn() { let mut n = 0; fn() { n = n + 1 } }; let a = counter(); let b = counter(); a(); a(); b()", 1);
+    zequals("let f = fn(x) { fn() { fn() { x } } }; f(7)()()", 7);
+    zequals("let f = fn(a, b) { fn() { fn(c) { a - b + c } } }; f(10, 2)()(5)", 13);
+
+    // while the variable exists, the closure sees it (and the other way around)
+    zequals("let f = fn() { let mut a = 1; let g = fn() { a }; a = 5; g() }; f()", 5);
+    zequals("let f = fn() { let mut a = 1; let g = fn() { a = 5 }; g(); a }; f()", 5);
+    zequals("let pair = fn() { let mut n = 0; let inc = fn() { n = n + 1 }; let get = fn() { n }; &{ inc: inc, get: get } };"
+            "let p = pair(); p.inc(); p.inc(); p.get()", 2);
+
+    // variables of blocks
+    zequals("let mut g = nil; { let a = 3; g = fn() { a } }; let b = 4; g()", 3);
+    zequals("let f = fn() { let mut g = nil; { let a = 3; g = fn() { a } }; { let b = 4; g() } }; f()", 3);
+    zthrows("fn(a) { fn() { a = 2 } }");
+}
+
+static void zoe_coroutines()
+{
+    zequals("let g = coroutine fn() { yield 1; yield 2; 3 }; resume g * 100 + resume g * 10 + resume g", 123);
+    zequals("let g = coroutine fn() { let a = 4; yield a; a + 1 }; resume g + resume g", 9);
+    zequals("let g = coroutine fn() { yield nil }; resume g; resume g", nullptr);
+
+    // coroutines are stackful: functions called by them can yield
+    zequals("let g = coroutine fn() { let f = fn(x) { yield x * 2 }; f(1); f(2); 0 }; resume g + resume g", 6);
+
+    // globals and upvalues
+    zequals("let a = 10; let g = coroutine fn() { yield a + 1 }; resume g", 11);
+    zequals("let mut a = 1; let g = coroutine fn() { a = 5; yield 0 }; resume g; a", 5);
+    zequals("let f = fn() { let x = 4; let g = coroutine fn() { yield x }; resume g }; f()", 4);
+    zequals("let g = coroutine fn() { let mut n = 1; yield fn() { n }; n = 7; yield 0 }; let f = resume g; resume g; f()", 7);
+
+    // coroutines resumed by coroutines
+    zequals("let inner = coroutine fn() { yield 1; yield 2 }; let outer = coroutine fn() { yield resume inner + resume inner }; resume outer", 3);
+
+    zthrows("yield 1");
+    zthrows("fn() { yield 1 }()");
+    zthrows("resume 1");
+    zthrows("coroutine 1");
+    zthrows("resume coroutine fn(x) { x }");
+    zthrows("let g = coroutine fn() { 1 }; resume g; resume g");
+    zthrows("let mut g = nil; g = coroutine fn() { resume g }; resume g");
+}
+
+static void zoe_operators()
+{
+    zequals("1 + 2 * 3", 7);
+    zequals("(1 + 2) * 3", 9);
+    zequals("10 - 4 - 3", 3);
+    zequals("7 / 2", 3.5);
+    zequals("7 %/ 2", 3);
+    zequals("7 % 2", 1);
+    zequals("2 ** 3 ** 2", 512);
+    zequals("-2 + 5", 3);
+    zequals("6 & 3", 2);
+    zequals("6 | 3", 7);
+    zequals("6 ^ 3", 5);
+    zequals("~5", -6);
+    zequals("1 << 4", 16);
+    zequals("256 >> 4", 16);
+    zequals("(2 ** 1000) & 3", 3);
+    zequals("(-(2 ** 1000)) | 0", -9223372036854775808.0);
+    zequals("(1 / 0) & 1", 1);
+    zequals("~(0 / 0)", -1);
+    zequals("2 < 3", true);
+    zequals("3 <= 3", true);
+    zequals("3 < 3", false);
+    zequals("1 + 1 == 2", true);
+    zequals("1 != 2", true);
+    zequals("!true", false);
+    zequals("'ab' + 'cd'", "abcd");
+    zequals("'ab' < 'b'", true);
+    zequals("'ab' == 'ab'", true);
+    zequals("nil == nil", true);
+    zthrows("1 + 'a'");
+    zthrows("'a' - 'b'");
+    zthrows("!1");
 }
 
 // }}}
@@ -742,19 +1971,49 @@ static void prepare_tests()
     run_test(bytecode_generation);
     run_test(bytecode_strings);
     run_test(bytecode_readback);
+    run_test(bytecode_view);
     run_test(bytecode_labels);
     run_test(bytecode_parse);
+    run_test(bytecode_optimizer);
+    run_test(bytecode_constants);
+    run_test(bytecode_superinstructions);
 
     // VM
+    run_test(vm_zbox);
     run_test(vm_stack);
+    run_test(vm_stack_overflow);
     run_test(vm_stack_type);
     run_test(vm_stack_pnil);
     run_test(vm_stack_bool);
     run_test(vm_stack_number);
     run_test(vm_stack_string);
+    run_test(vm_string_interning);
     run_test(vm_stack_array);
     run_test(vm_stack_table);
+    run_test(vm_table_map);
+    run_test(vm_table_shapes);
+    run_test(vm_inline_cache);
+    run_test(vm_gc);
+    run_test(vm_heap_slabs);
     run_test(vm_stack_pop);
+    run_test(vm_dispatch);
+    run_test(vm_register_backend);
+    run_test(vm_profile);
+    run_test(vm_trace_buffer);
+    run_test(vm_jit);
+    run_test(ccode);
+    run_test(vm_quickening);
+    run_test(vm_frames);
+    run_test(vm_closures);
+    run_test(vm_coroutines);
+    run_test(vm_chunk);
+    run_test(vm_pool);
+    run_test(vm_snapshot);
+
+    // executable
+    run_test(exe_mapped_file);
+    run_test(exe_compile_cache);
+    run_test(exe_zb_file);
 
     // execution
     run_test(zoe_invalid);
@@ -780,6 +2039,11 @@ static void prepare_tests()
 
     // functions
     run_test(zoe_functions);
+    run_test(zoe_closures);
+    run_test(zoe_coroutines);
+
+    // operators
+    run_test(zoe_operators);
 }
 
 // vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
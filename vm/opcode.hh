@@ -14,7 +14,7 @@ using namespace std;
     X(NOP, 0),                                                                      \
     /* stack management */                                                          \
     X(PNIL, 0), X(PBF, 0), X(PBT, 0), X(PN8, 1), X(PNUM, d), X(PSTR, s), X(PARY, 2),\
-    X(PTBL, 2), X(PTBX, 2), X(PFUN, 1),                                             \
+    X(PTBL, 2), X(PTBX, 2), X(PFUN, 1), X(PCON, 4),                                 \
     X(POP, 0),                                                                      \
     /* variables */                                                                 \
     X(CVAR, 0), X(CMVAR, 2), X(SVAR, 4), X(GVAR, 4),                                \
@@ -26,7 +26,18 @@ using namespace std;
     X(UNM, 0), X(ADD, 0), X(SUB, 0),  X(MUL, 0),  X(DIV, 0), X(IDIV, 0), X(MOD, 0), \
     X(POW, 0), X(SHL, 0), X(SHR, 0),  X(BNOT, 0), X(AND, 0), X(OR, 0),   X(XOR, 0), \
     X(NOT, 0), X(EQ, 0),  X(PART, 0), X(LT, 0),   X(LTE, 0), X(LEN, 0),  X(GET, 0), \
-    X(SET, 1), X(DEL, 0), X(INSP, 0), X(PTR, 0),  X(ISNIL, 0)
+    X(SET, 1), X(DEL, 0), X(INSP, 0), X(PTR, 0),  X(ISNIL, 0),                     \
+    /* superinstructions (see Bytecode::Optimize) */                                \
+    X(GETF, f), X(CVN8, 1), X(CALLV, c),                                           \
+    /* functions: variables relative to the frame, calls in tail position */       \
+    X(GLOC, 4), X(SLOC, 4), X(TAILCALL, p),                                         \
+    /* closures: upvalues, captured before creating the closure (PCLO) */          \
+    X(GUPV, 4), X(SUPV, 4), X(CAPL, 4), X(CAPU, 4), X(PCLO, p), X(CLOSE, 4),        \
+    /* coroutines: created from a function (PCOR), with their own stacks */       \
+    X(PCOR, 0), X(RESUME, 0), X(YIELD, 0),                                          \
+    /* quickened by the VM at run time (never in the bytecode, see zoevm.cc) */     \
+    X(ADD_NN, 0), X(SUB_NN, 0), X(MUL_NN, 0), X(DIV_NN, 0), X(LT_NN, 0),           \
+    X(LTE_NN, 0), X(GET_STR, 0)
 
 #define X(a, b) a
 enum Opcode : uint8_t {
@@ -41,11 +52,33 @@ const vector<string> opcode_names = {
 #undef X
 
 #define X(a, b) ((#b)[0])
-const char opcode_pars[] = {
+constexpr char opcode_pars[] = {
     OPCODE_TABLE
 };
 #undef X
 
+constexpr size_t opcode_count = sizeof opcode_pars;
+
+// opcodes that only exist in the code being executed by the VM
+constexpr bool opcode_quickened(uint8_t op) { return op >= ADD_NN && op < opcode_count; }
+
+// size of the instruction (opcode + parameters), in bytes
+constexpr size_t opcode_size(uint8_t op) {
+    switch(opcode_pars[op]) {
+        case '0': return 1;
+        case '1': return 2;
+        case '2': return 3;
+        case '4': return 5;
+        case '8': return 9;
+        case 'd': return 9;
+        case 's': return 5;
+        case 'p': return 3;
+        case 'f': return 9;     // variable (4 bytes) + string (4 bytes)
+        case 'c': return 7;     // variable (4 bytes) + parameters (2 bytes)
+        default:  return 0;
+    }
+}
+
 enum TableConfig : uint8_t { PUB = 0b01, MUT = 0b10 };
 
 #endif
@@ -1,7 +1,9 @@
 #include "vm/zarray.hh"
 
+#include "vm/zheap.hh"
 
-bool ZArray::OpEq(shared_ptr<ZValue> other) const 
+
+bool ZArray::OpEq(ZBox const& other) const 
 {
     (void) other;
     return false;  // TODO
@@ -15,11 +17,19 @@ string ZArray::Inspect() const
         if(i != 0) {
             s.append(", ");
         }
-        s.append(_items[i]->Inspect());
+        s.append(_items[i].Inspect());
     }
     s.append("]");
     return s;
 }
 
+
+void ZArray::Trace(ZHeap& heap) const
+{
+    for(ZBox const& item: _items) {
+        heap.Mark(item);
+    }
+}
+
     
 // vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
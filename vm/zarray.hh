@@ -4,25 +4,26 @@
 #include <vector>
 using namespace std;
 
-#include "vm/zvalue.hh"
+#include "vm/zbox.hh"
 
 class ZArray : public ZValue {
 public:
     template<typename It>
     ZArray(It const& _begin, It const& _end) : ZValue(StaticType()), _items(_begin, _end) {}
 
-    vector<shared_ptr<ZValue>> const& Value() const { return _items; }
+    vector<ZBox> const& Value() const { return _items; }
 
-    bool OpEq(shared_ptr<ZValue> other) const override;
+    bool OpEq(ZBox const& other) const override;
     string Inspect() const override;
+    void   Trace(ZHeap& heap) const override;
     
     static ZType StaticType() { return ARRAY; }
 
 private:
-    vector<shared_ptr<ZValue>> _items;
+    vector<ZBox> _items;
 };
 
-template<> struct cpp_type<vector<shared_ptr<ZValue>>> { typedef ZArray type; };
+template<> struct cpp_type<vector<ZBox>> { typedef ZArray type; };
 
 #endif
 
@@ -0,0 +1,90 @@
+#include "vm/zbox.hh"
+
+#include <cmath>
+#include <functional>
+#include <limits>
+
+constexpr uint64_t ZBox::SIGN, ZBox::QNAN, ZBox::NAN_MASK, ZBox::MANTISSA, ZBox::CANONICAL_NAN,
+                   ZBox::HEAP_BITS, ZBox::PTR_MASK, ZBox::NIL_BITS, ZBox::FALSE_BITS, ZBox::TRUE_BITS;
+
+ZType ZBox::Type() const
+{
+    if(IsNumber()) {
+        return NUMBER;
+    } else if(IsHeap()) {
+        return Ptr()->Type();
+    } else if(IsNil()) {
+        return NIL;
+    } else {
+        return BOOL;
+    }
+}
+
+
+void ZBox::InvalidType(ZType expected) const
+{
+    throw zoe_runtime_error("Invalid type: expected " + Typename(expected) + ", found " + Typename(Type()));
+}
+
+
+uint64_t ZBox::Hash() const
+{
+    if(IsNumber()) {
+        return hash<double>()(Number());
+    } else if(IsHeap()) {
+        return Ptr()->Hash();
+    } else if(IsNil()) {
+        return 0;
+    } else {
+        return Bool() ? 1 : 2;
+    }
+}
+
+
+bool ZBox::OpEq(ZBox const& other) const
+{
+    if(IsHeap()) {
+        return Ptr()->OpEq(other);
+    } else if(IsNumber()) {
+        return other.IsNumber() && abs(Number() - other.Number()) < numeric_limits<double>::epsilon();
+    } else {
+        return _v == other._v;
+    }
+}
+
+
+string ZBox::Inspect() const
+{
+    if(IsNumber()) {
+        string s = to_string(Number());
+        s.erase(s.find_last_not_of("0")+1);
+        s.erase(s.find_last_not_of(".")+1);
+        return s;
+    } else if(IsHeap()) {
+        return Ptr()->Inspect();
+    } else if(IsNil()) {
+        return "nil";
+    } else {
+        return Bool() ? "true" : "false";
+    }
+}
+
+
+void ZBox::OpSet(ZBox const& key, ZBox const& value, TableConfig tc) const
+{
+    if(!IsHeap()) {
+        throw zoe_runtime_error(Typename(Type()) + "s can't be set.");
+    }
+    Ptr()->OpSet(key, value, tc);
+}
+
+
+ZBox ZBox::OpGet(ZBox const& key) const
+{
+    if(!IsHeap()) {
+        throw zoe_runtime_error(Typename(Type()) + "s can't be get.");
+    }
+    return Ptr()->OpGet(key);
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,99 @@
+#ifndef VM_ZBOX_H_
+#define VM_ZBOX_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+using namespace std;
+
+#include "vm/zvalue.hh"
+
+static_assert(sizeof(void*) == 8 && sizeof(double) == 8, "ZBox requires 64-bit pointers and doubles");
+
+// A ZBox is a Zoe value packed in 64 bits (NaN-boxing). Numbers are stored as
+// plain doubles, while the other types are stored in the payload of a quiet
+// NaN, that never is produced by arithmetic (NaNs are canonicalized):
+//
+//   number    any double
+//   nil       0x7FFC 0000 0000 0001
+//   false     0x7FFC 0000 0000 0002
+//   true      0x7FFC 0000 0000 0003
+//   heap      0xFFFC xxxx xxxx xxxx     (48-bit pointer to a ZValue)
+//
+// Scalars don't allocate anything. Heap values are owned by the heap of the VM
+// (see vm/zheap.hh), so a ZBox is a plain handle, and copying it is free.
+class ZBox {
+public:
+    ZBox() : _v(NIL_BITS) {}
+    ZBox(nullptr_t) : ZBox() {}                                  // NOLINT - implicit on purpose
+    explicit ZBox(bool b) : _v(b ? TRUE_BITS : FALSE_BITS) {}
+    explicit ZBox(double d) : _v(DoubleBits(d)) {}
+    explicit ZBox(ZValue const* value) : _v(HEAP_BITS | reinterpret_cast<uint64_t>(value)) {}
+
+    // type information
+    ZType Type() const;
+    bool  IsNil() const    { return _v == NIL_BITS; }
+    bool  IsBool() const   { return _v == TRUE_BITS || _v == FALSE_BITS; }
+    bool  IsNumber() const { return (_v & QNAN) != QNAN; }
+    bool  IsHeap() const   { return (_v & HEAP_BITS) == HEAP_BITS; }
+
+    // value access (throws zoe_runtime_error on type mismatch)
+    bool   Bool() const   { if(!IsBool()) { InvalidType(BOOL); } return _v == TRUE_BITS; }
+    double Number() const { if(!IsNumber()) { InvalidType(NUMBER); } double d; memcpy(&d, &_v, 8); return d; }
+
+    // heap access (unchecked - verify Type() first)
+    ZValue* Ptr() const { return reinterpret_cast<ZValue*>(_v & PTR_MASK); }
+    template<typename T> T* Ptr() const { return static_cast<T*>(Ptr()); }
+
+    // {{{ T Value<T>() - copy scalar values to C++
+    template<typename T> typename enable_if<is_same<T, bool>::value, T>::type Value() const {
+        return Bool();
+    }
+    template<typename T> typename enable_if<is_arithmetic<T>::value && !is_same<T, bool>::value, T>::type Value() const {
+        return static_cast<T>(Number());
+    }
+    // }}}
+
+    // operations
+    uint64_t Hash() const;
+    bool     OpEq(ZBox const& other) const;
+    string   Inspect() const;
+    void     OpSet(ZBox const& key, ZBox const& value, TableConfig tc) const;
+    ZBox     OpGet(ZBox const& key) const;
+
+    uint64_t Bits() const { return _v; }
+
+private:
+    uint64_t _v;
+
+    static uint64_t DoubleBits(double d) {
+        uint64_t v;
+        memcpy(&v, &d, 8);
+        return ((v & NAN_MASK) == NAN_MASK && (v & MANTISSA)) ? CANONICAL_NAN : v;
+    }
+
+    [[noreturn]] void InvalidType(ZType expected) const;
+
+    static constexpr uint64_t SIGN          = 0x8000000000000000;
+    static constexpr uint64_t QNAN          = 0x7FFC000000000000;
+    static constexpr uint64_t NAN_MASK      = 0x7FF0000000000000;
+    static constexpr uint64_t MANTISSA      = 0x000FFFFFFFFFFFFF;
+    static constexpr uint64_t CANONICAL_NAN = 0x7FF8000000000000;
+    static constexpr uint64_t HEAP_BITS     = SIGN | QNAN;
+    static constexpr uint64_t PTR_MASK      = ~HEAP_BITS;
+    static constexpr uint64_t NIL_BITS      = QNAN | 1;
+    static constexpr uint64_t FALSE_BITS    = QNAN | 2;
+    static constexpr uint64_t TRUE_BITS     = QNAN | 3;
+};
+
+static_assert(sizeof(ZBox) == 8, "ZBox must be 64 bits wide");
+static_assert(is_trivially_copyable<ZBox>::value, "ZBox must be trivially copyable");
+
+inline ZBox ZValue::OpGet(ZBox const& /* key */) const {
+    throw zoe_runtime_error(Typename(Type()) + "s can't be get.");
+}
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,49 @@
+#include "vm/zcoroutine.hh"
+
+#include "vm/zfunction.hh"
+#include "vm/zheap.hh"
+
+ZCoroutine::ZCoroutine(ZBox const& func, size_t stack_size, uint64_t execution)
+    : ZValue(StaticType()), _func(func), _execution(execution),
+      _ctx { vector<ZBox>(stack_size), 0, {}, { 0 }, {}, 0, nullptr, {} }
+{
+}
+
+
+bool ZCoroutine::OpEq(ZBox const& other) const
+{
+    return other.IsHeap() && other.Ptr() == this;
+}
+
+
+string ZCoroutine::Inspect() const
+{
+    switch(_state) {
+        case SUSPENDED: return "coroutine: suspended";
+        case RUNNING:   return "coroutine: running";
+        case DEAD:      return "coroutine: dead";
+    }
+    return "coroutine";
+}
+
+
+void ZCoroutine::Trace(ZHeap& heap) const
+{
+    heap.Mark(_func);
+    for(size_t i = 0; i < _ctx.sp; ++i) {
+        heap.Mark(_ctx.stack[i]);
+    }
+    for(ZBox const& value: _ctx.vars) {
+        heap.Mark(value);
+    }
+    for(ZUpvalue const* upvalue: _ctx.open_upvalues) {
+        heap.Mark(upvalue);
+    }
+    for(ZoeVM::Frame const& frame: _ctx.call_stack) {
+        if(frame.closure) {
+            heap.Mark(frame.closure);
+        }
+    }
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,43 @@
+#ifndef VM_ZCOROUTINE_H_
+#define VM_ZCOROUTINE_H_
+
+#include <string>
+using namespace std;
+
+#include "vm/zbox.hh"
+#include "vm/zoevm.hh"
+
+// A coroutine runs a function in a context of its own: a stack of values,
+// the variables and the call stack (see ZoeVM::Context). RESUME switches the
+// VM to the context of the coroutine, and YIELD (or the return of the
+// function) switches it back. Switching swaps the contexts, so the stacks are
+// never copied: while the coroutine runs, its context holds the one of the
+// code that resumed it.
+class ZCoroutine : public ZValue {
+public:
+    enum State { SUSPENDED, RUNNING, DEAD };
+
+    ZCoroutine(ZBox const& func, size_t stack_size, uint64_t execution);
+
+    State  GetState() const { return _state; }
+
+    bool   OpEq(ZBox const& other) const override;
+    string Inspect() const override;
+    void   Trace(ZHeap& heap) const override;
+
+    static ZType StaticType() { return COROUTINE; }
+
+private:
+    friend class ZoeVM;
+    ZBox           _func;
+    uint64_t       _execution;          // the execution that created the coroutine
+    State          _state = SUSPENDED;
+    bool           _started = false;
+    uint64_t       _ip = 0;             // where the coroutine continues, when suspended
+    uint64_t       _ret = 0;            // where the code that resumed it continues
+    ZoeVM::Context _ctx;
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -3,24 +3,34 @@
 #include <sstream>
 using namespace std;
 
+#include "vm/zbox.hh"
+#include "vm/zcoroutine.hh"
+#include "vm/zheap.hh"
+
 uint64_t ZFunctionPointer::Value() const
 {
     return _ptr;
 }
 
 
+uint8_t ZFunctionPointer::NArgs() const
+{
+    return _nargs;
+}
+
+
 uint64_t ZFunctionPointer::Hash() const
 {
     return hash<uint64_t>()(_ptr);
 }
 
 
-bool ZFunctionPointer::OpEq(shared_ptr<ZValue> other) const
+bool ZFunctionPointer::OpEq(ZBox const& other) const
 {
-    if(Type() != other->Type()) {
+    if(other.Type() != FUNCTION) {
         return false;
     }
-    return _ptr == static_pointer_cast<ZFunctionPointer>(other)->_ptr;
+    return _ptr == other.Ptr<ZFunctionPointer>()->_ptr;
 }
 
 
@@ -31,4 +41,43 @@ string ZFunctionPointer::Inspect() const
     return ss.str();
 }
 
+// {{{ CLOSURES
+
+bool ZUpvalue::OpEq(ZBox const& other) const
+{
+    return other.IsHeap() && other.Ptr() == this;
+}
+
+
+string ZUpvalue::Inspect() const
+{
+    return _open ? "upvalue: variable " + to_string(_var) : "upvalue: " + _value.Inspect();
+}
+
+
+void ZUpvalue::Trace(ZHeap& heap) const
+{
+    heap.Mark(_value);      // while open, the variable is marked by the VM...
+    if(_owner) {
+        heap.Mark(_owner);  // ...or by the coroutine that owns it
+    }
+}
+
+
+// two closures are only equal if they are the same (they might have captured different variables)
+bool ZClosure::OpEq(ZBox const& other) const
+{
+    return other.IsHeap() && other.Ptr() == this;
+}
+
+
+void ZClosure::Trace(ZHeap& heap) const
+{
+    for(ZUpvalue const* upvalue: _upvalues) {
+        heap.Mark(upvalue);
+    }
+}
+
+// }}}
+
 // vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -1,9 +1,12 @@
 #ifndef VM_ZFUNCTION_H_
 #define VM_ZFUNCTION_H_
 
-#include "vm/zvalue.hh"
+#include <vector>
+using namespace std;
 
-enum ZFunctionType { POINTER };
+#include "vm/zbox.hh"
+
+enum ZFunctionType { POINTER, CLOSURE };
 
 class ZFunction : public ZValue {
 public:
@@ -20,12 +23,13 @@ public:
     ZFunctionPointer(uint64_t ptr, uint8_t n_args) : 
         ZFunction(), _ptr(ptr), _nargs(n_args) {}
 
-    ZFunctionType FunctionType() const { return POINTER; }
+    ZFunctionType FunctionType() const override { return POINTER; }
 
     uint64_t Value() const;
+    uint8_t  NArgs() const;
     uint64_t Hash() const override;
 
-    bool     OpEq(shared_ptr<ZValue> other) const override;
+    bool     OpEq(ZBox const& other) const override;
     string   Inspect() const override;
 
 private:
@@ -33,6 +37,60 @@ private:
     uint8_t _nargs;
 };
 
+
+// A variable captured by a closure. While the variable exists (open), the
+// upvalue points to it, so that the function and the closures see the same
+// value; when it goes out of scope, its value is moved to the upvalue
+// (closed). Only the variables actually captured get an upvalue.
+//
+// The variable belongs to the context where the upvalue was created: the
+// main one (no owner) or the one of a coroutine (see vm/zcoroutine.hh).
+class ZUpvalue : public ZValue {
+public:
+    ZUpvalue(size_t var, class ZCoroutine* owner) : ZValue(StaticType()), _var(var), _owner(owner) {}
+
+    ZUpvalue(ZUpvalue const&) = delete;
+    ZUpvalue& operator=(ZUpvalue const&) = delete;
+
+    bool   IsOpen() const { return _open; }
+    size_t Var() const { return _var; }            // index of the variable, while open
+    class ZCoroutine* Owner() const { return _owner; }
+    ZBox&  Value() { return _value; }              // when closed
+    ZBox const& Value() const { return _value; }
+    void   Close(ZBox const& value) { _value = value; _open = false; _owner = nullptr; }
+
+    bool   OpEq(ZBox const& other) const override;
+    string Inspect() const override;
+    void   Trace(ZHeap& heap) const override;
+
+    static ZType StaticType() { return UPVALUE; }
+
+private:
+    size_t _var;
+    class ZCoroutine* _owner;
+    bool   _open = true;
+    ZBox   _value = {};
+};
+
+
+// A function with the upvalues it captured when it was created.
+class ZClosure : public ZFunctionPointer {
+public:
+    ZClosure(uint64_t ptr, uint8_t n_args, vector<ZUpvalue*> const& upvalues) :
+        ZFunctionPointer(ptr, n_args), _upvalues(upvalues) {}
+
+    ZFunctionType FunctionType() const override { return CLOSURE; }
+
+    ZUpvalue* Upvalue(uint32_t n) const { return _upvalues[n]; }
+    vector<ZUpvalue*> const& Upvalues() const { return _upvalues; }
+
+    bool     OpEq(ZBox const& other) const override;
+    void     Trace(ZHeap& heap) const override;
+
+private:
+    vector<ZUpvalue*> _upvalues;
+};
+
 #endif
 
 // vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,96 @@
+#include "vm/zheap.hh"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr size_t  ZHeap::GRANULARITY, ZHeap::SIZE_CLASSES, ZHeap::SLAB_SIZE;
+constexpr uint8_t ZHeap::LARGE;
+
+ZHeap::~ZHeap()
+{
+    while(_values) {
+        ZValue* next = _values->_gc_next;
+        Destroy(_values);
+        _values = next;
+    }
+}
+
+// {{{ ALLOCATION
+
+void* ZHeap::Allocate(uint8_t sc, size_t size)
+{
+    if(sc == LARGE) {
+        return ::operator new(size);
+    }
+
+    if(!_free[sc]) {
+        // carve a new slab into blocks of this size class
+        size_t block = (sc + 1U) * GRANULARITY;
+        _slabs.emplace_back(new char[SLAB_SIZE]);
+        char* slab = _slabs.back().get();
+        for(size_t pos = 0; pos + block <= SLAB_SIZE; pos += block) {
+            Free(slab + pos, sc);
+        }
+    }
+
+    void* mem = _free[sc];
+    memcpy(&_free[sc], mem, sizeof(void*));
+    return mem;
+}
+
+
+void ZHeap::Free(void* mem, uint8_t sc)
+{
+    if(sc == LARGE) {
+        ::operator delete(mem);
+    } else {
+        memcpy(mem, &_free[sc], sizeof(void*));
+        _free[sc] = mem;
+    }
+}
+
+
+void ZHeap::Destroy(ZValue* value)
+{
+    uint8_t sc = value->_gc_size_class;
+    value->~ZValue();
+    Free(value, sc);
+}
+
+// }}}
+
+// {{{ GARBAGE COLLECTION
+
+size_t ZHeap::Collect()
+{
+    // mark
+    while(!_gray.empty()) {
+        ZValue const* value = _gray.back();
+        _gray.pop_back();
+        value->Trace(*this);
+    }
+
+    // sweep
+    size_t freed = 0;
+    ZValue** link = &_values;
+    while(*link) {
+        ZValue* value = *link;
+        if(value->_gc_marked) {
+            value->_gc_marked = false;
+            link = &value->_gc_next;
+        } else {
+            *link = value->_gc_next;
+            Destroy(value);
+            ++freed;
+        }
+    }
+    _count -= freed;
+
+    // next collection happens when the heap doubles
+    _threshold = max(_count * 2, static_cast<size_t>(1024));
+    return freed;
+}
+
+// }}}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
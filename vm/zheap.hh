@@ -0,0 +1,102 @@
+#ifndef VM_ZHEAP_H_
+#define VM_ZHEAP_H_
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include "vm/zbox.hh"
+
+// The ZHeap owns every heap value (ZValue) of a VM, and frees them with a
+// precise mark-sweep collector. ZBoxes are plain 64-bit handles: copying them
+// costs nothing, and cycles (such as a table that refers to itself) are
+// collected like any other garbage.
+//
+// Collecting is done in two steps, driven by the owner of the roots:
+//
+//     heap.Mark(root);      // for every root
+//     heap.Collect();       // traces the marked values and frees the others
+//
+// Collections must only happen at safe points, when every live value is
+// reachable from the roots (and not only from a C++ local variable).
+//
+// Memory for the values comes from slabs owned by the heap, one free list per
+// size class (multiples of 16 bytes), so that allocating and freeing a value
+// is usually just a pointer swap. As a VM (and its heap) is used by a single
+// thread, the slabs don't need any locking. Values larger than the largest
+// size class use the global allocator.
+class ZHeap {
+public:
+    ZHeap() = default;
+    ~ZHeap();
+
+    ZHeap(ZHeap const&) = delete;
+    ZHeap& operator=(ZHeap const&) = delete;
+
+    // create a new heap value
+    template<typename T, typename... Args> ZBox Make(Args&&... args) {
+        static_assert(is_base_of<ZValue, T>::value, "Only ZValues can be allocated in the heap");
+        uint8_t sc = SizeClass(sizeof(T));
+        void* mem = Allocate(sc, sizeof(T));
+        T* value;
+        try {
+            value = new(mem) T(forward<Args>(args)...);
+        } catch(...) {
+            Free(mem, sc);
+            throw;
+        }
+        value->_gc_size_class = sc;
+        value->_gc_next = _values;
+        _values = value;
+        ++_count;
+        ++_allocated.objects;
+        _allocated.bytes += sizeof(T);
+        return ZBox(value);
+    }
+
+    // garbage collection
+    void   Mark(ZBox const& value) { if(value.IsHeap()) { Mark(value.Ptr()); } }
+    void   Mark(ZValue const* value) { if(!value->_gc_marked) { value->_gc_marked = true; _gray.push_back(value); } }
+    size_t Collect();                               // returns the number of values freed
+    bool   NeedsCollection() const { return _count >= _threshold; }
+
+    size_t Count() const { return _count; }
+
+    // allocation counters (since the heap was created)
+    struct Counters {
+        uint64_t objects = 0;
+        uint64_t bytes = 0;
+    };
+    Counters const& Allocated() const { return _allocated; }
+
+private:
+    static constexpr size_t  GRANULARITY = 16;
+    static constexpr size_t  SIZE_CLASSES = 16;         // up to 256 bytes
+    static constexpr size_t  SLAB_SIZE = 32 * 1024;
+    static constexpr uint8_t LARGE = 0xFF;
+
+    static uint8_t SizeClass(size_t size) {
+        size_t sc = (size + GRANULARITY - 1) / GRANULARITY - 1;
+        return (sc < SIZE_CLASSES) ? static_cast<uint8_t>(sc) : LARGE;
+    }
+    void* Allocate(uint8_t sc, size_t size);
+    void  Free(void* mem, uint8_t sc);
+    void  Destroy(ZValue* value);
+
+    ZValue*               _values = nullptr;       // linked list of all values
+    size_t                _count = 0;
+    size_t                _threshold = 1024;        // number of values that trigger a new collection
+    vector<ZValue const*> _gray = {};               // marked, but children not marked yet
+
+    void*                     _free[SIZE_CLASSES] = {};   // free lists, linked through the free blocks
+    vector<unique_ptr<char[]>> _slabs = {};
+    Counters                  _allocated = {};
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,63 @@
+#include "vm/zinlinecache.hh"
+
+#include "vm/zstring.hh"
+
+constexpr size_t ZInlineCache::MAX_ENTRIES;
+
+void ZInlineCache::LearnGet(ZBox const& obj, ZBox const& key)
+{
+    ZTable const* t = ShapedTable(obj);
+    if(!t || !Cacheable(key)) {
+        return;
+    }
+
+    // the key is in the table itself
+    ptrdiff_t i = t->Shape()->Find(key);
+    if(i >= 0) {
+        if(t->Shape()->Config(static_cast<size_t>(i)) & PUB) {
+            Add({ t->Shape(), key.Bits(), nullptr, nullptr, static_cast<uint32_t>(i) });
+        }
+        return;
+    }
+
+    // the key is in the prototype
+    ZTable const* proto = ShapedTable(t->Prototype());
+    if(proto) {
+        ptrdiff_t j = proto->Shape()->Find(key);
+        if(j >= 0 && (proto->Shape()->Config(static_cast<size_t>(j)) & PUB)) {
+            Add({ t->Shape(), key.Bits(), proto, proto->Shape(), static_cast<uint32_t>(j) });
+        }
+    }
+}
+
+
+void ZInlineCache::LearnSet(ZBox const& obj, ZBox const& key, TableConfig tc)
+{
+    ZTable const* t = ShapedTable(obj);
+    if(!t || !Cacheable(key)) {
+        return;
+    }
+    ptrdiff_t i = t->Shape()->Find(key);
+    if(i >= 0 && tc == (PUB|MUT) && t->Shape()->Config(static_cast<size_t>(i)) == tc) {
+        Add({ t->Shape(), key.Bits(), nullptr, nullptr, static_cast<uint32_t>(i) });
+    }
+}
+
+
+bool ZInlineCache::Cacheable(ZBox const& key)
+{
+    if(!key.IsHeap()) {
+        return true;
+    }
+    return key.Ptr()->Type() == STRING && key.Ptr<ZString>()->Interned();
+}
+
+
+void ZInlineCache::Add(Entry const& e)
+{
+    if(_count < MAX_ENTRIES) {      // when full, the instruction is megamorphic
+        _entries[_count++] = e;
+    }
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
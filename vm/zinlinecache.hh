@@ -0,0 +1,106 @@
+#ifndef VM_ZINLINECACHE_H_
+#define VM_ZINLINECACHE_H_
+
+#include <cstdint>
+using namespace std;
+
+#include "vm/zbox.hh"
+#include "vm/ztable.hh"
+
+// A ZInlineCache remembers, for a single GET or SET instruction, where the
+// key was found in the last tables it was used with. The tables are
+// identified by their shape, so a hit skips hashing and the prototype walk
+// and reads (or writes) the value slot directly.
+//
+// The cache starts empty, becomes monomorphic after the first lookup and
+// polymorphic up to MAX_ENTRIES shapes. After that, new shapes are not
+// cached anymore (megamorphic), and the instruction uses the slow path.
+//
+// A GET entry might also point to a slot in the (direct) prototype of the
+// table. In this case, the entry also checks the identity and the shape of
+// the prototype.
+//
+// Keys are compared by their bits, so only the keys that are unique for
+// their value are learned: numbers, booleans and interned strings (that
+// live as long as the VM). The address of any other key (a string built at
+// run time) might be reused by another one once it is collected.
+class ZInlineCache {
+public:
+    // fast paths: return nullptr/false on a cache miss
+    inline ZBox const* Get(ZBox const& obj, ZBox const& key) const;
+    inline bool        Set(ZBox const& obj, ZBox const& key, ZBox const& value, TableConfig tc) const;
+
+    // record the result of a slow path lookup (that succeeded)
+    void LearnGet(ZBox const& obj, ZBox const& key);
+    void LearnSet(ZBox const& obj, ZBox const& key, TableConfig tc);
+
+    size_t Entries() const { return _count; }
+
+    static constexpr size_t MAX_ENTRIES = 4;
+
+private:
+    struct Entry {
+        ZShape const* shape;
+        uint64_t      key;          // bits of the key (interned strings are unique)
+        ZTable const* proto;        // nullptr if the value is in the table itself
+        ZShape const* proto_shape;
+        uint32_t      slot;
+    };
+
+    static ZTable* ShapedTable(ZBox const& obj) {
+        if(!obj.IsHeap() || obj.Ptr()->Type() != TABLE) {
+            return nullptr;
+        }
+        ZTable* t = obj.Ptr<ZTable>();
+        return t->Shape() ? t : nullptr;
+    }
+
+    static bool Cacheable(ZBox const& key);
+    void Add(Entry const& e);
+
+    Entry   _entries[MAX_ENTRIES] = {};
+    uint8_t _count = 0;
+};
+
+
+ZBox const* ZInlineCache::Get(ZBox const& obj, ZBox const& key) const
+{
+    ZTable const* t = ShapedTable(obj);
+    if(!t) {
+        return nullptr;
+    }
+    for(uint8_t i = 0; i < _count; ++i) {
+        Entry const& e = _entries[i];
+        if(e.shape == t->Shape() && e.key == key.Bits()) {
+            if(!e.proto) {
+                return &t->Slot(e.slot);
+            }
+            ZBox const& proto = t->Prototype();
+            if(proto.IsHeap() && proto.Ptr<ZTable>() == e.proto && e.proto->Shape() == e.proto_shape) {
+                return &e.proto->Slot(e.slot);
+            }
+        }
+    }
+    return nullptr;
+}
+
+
+bool ZInlineCache::Set(ZBox const& obj, ZBox const& key, ZBox const& value, TableConfig tc) const
+{
+    ZTable* t = ShapedTable(obj);
+    if(!t || tc != (PUB|MUT)) {     // other configurations are checked by the slow path
+        return false;
+    }
+    for(uint8_t i = 0; i < _count; ++i) {
+        Entry const& e = _entries[i];
+        if(e.shape == t->Shape() && e.key == key.Bits() && !e.proto && t->Shape()->Config(e.slot) == tc) {
+            t->SetSlot(e.slot, value);
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,534 @@
+#ifndef VM_ZINSTRUCTIONS_H_
+#define VM_ZINSTRUCTIONS_H_
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <vector>
+using namespace std;
+
+#include "compiler/bytecodeview.hh"
+#include "compiler/compiledchunk.hh"
+#include "vm/exceptions.hh"
+#include "vm/zarray.hh"
+#include "vm/zcoroutine.hh"
+#include "vm/zfunction.hh"
+#include "vm/zinlinecache.hh"
+#include "vm/zoevm.hh"
+#include "vm/zstring.hh"
+#include "vm/ztable.hh"
+
+// The bodies of the instructions that don't change the flow of the code
+// (SHARED_OPCODES). They are in a header so that they can be inlined both in
+// the interpreter loop (vm/zoevm.cc) and in the code compiled ahead of time
+// by `zoe --emit-c` (see compiler/ccode.hh), where the C++ compiler can
+// optimize across instructions. Only the VM and the generated code include it.
+
+// The garbage collector only runs at safe points (GC_SAFEPOINT), placed after
+// the instructions that allocate, when every live value is in the stack or in
+// the variables.
+
+#define OPERAND(T)    Operand<T>(ip+1)
+#define GC_SAFEPOINT() if(_heap.NeedsCollection()) { Collect(); }
+
+template<typename T> inline T Operand(uint8_t const* ptr)
+{
+    T t;
+    memcpy(&t, ptr, sizeof(T));
+    return t;
+}
+
+/* The instructions that don't change the flow of the code (SHARED_OPCODES)
+ * are implemented once, below, and used by the interpreter loop, by the JIT
+ * (see vm/zjit.hh) and by the code compiled ahead of time (ZoeVM::Native).
+ * They get the state of the execution and the position of the instruction.
+ *
+ * The chunk (see compiler/compiledchunk.hh) is shared, and never written to:
+ * the code is executed from a private copy, so that instructions can be
+ * rewritten in place with versions specialized for the types of their
+ * operands (see Quicken), and the inline caches are kept here, in the slots
+ * given by the chunk. */
+
+struct ZoeVM::ExecState {
+    ZoeVM*               vm;
+    shared_ptr<CompiledChunk const> const chunk;    // kept alive while the state is
+    BytecodeView const&  b;
+    vector<uint8_t>      copy;          // the code being executed
+    uint8_t const*       code;
+    vector<ZBox>         strings;       // all strings are interned before execution, so PSTR only needs to load them
+    vector<ZInlineCache> caches;        // each GET/SET/GETF instruction gets its own inline cache
+    vector<bool>         unstable;      // instructions that were de-quickened, and won't be quickened again
+    exception_ptr        error;         // exception thrown in JIT code
+
+    ExecState(ZoeVM* vm_, shared_ptr<CompiledChunk const> chunk_)
+        : vm(vm_), chunk(move(chunk_)), b(chunk->View()),
+          copy(b.Code(), b.Code() + b.CodeSize()), code(copy.data()),
+          strings(vm_->InternStrings(b)), caches(chunk->InlineCaches()), unstable(b.CodeSize()), error() {}
+    ExecState(ExecState const&) = delete;
+    ExecState& operator=(ExecState const&) = delete;
+
+    ZInlineCache& Cache(uint8_t const* ip) { return caches[chunk->InlineCache(static_cast<size_t>(ip - code))]; }
+
+    void Quicken(uint8_t const* ip, Opcode op) {
+        size_t pos = static_cast<size_t>(ip - code);
+        if(!unstable[pos]) {
+            copy[pos] = op;
+        }
+    }
+    void Dequicken(uint8_t const* ip, Opcode op) {
+        size_t pos = static_cast<size_t>(ip - code);
+        copy[pos] = op;
+        unstable[pos] = true;
+    }
+};
+
+
+inline ZBox* ZoeVM::StackTop(size_t n)
+{
+    if(_sp < n) {
+        throw underflow_error("Stack underflow");
+    }
+    return _stack.data() + _sp - n;
+}
+
+// {{{ instructions
+
+template<> inline void ZoeVM::Instruction<NOP>(ExecState&, uint8_t const*)
+{
+}
+
+template<> inline void ZoeVM::Instruction<PNIL>(ExecState&, uint8_t const*)
+{
+    Push(nullptr);
+}
+
+template<> inline void ZoeVM::Instruction<PBT>(ExecState&, uint8_t const*)
+{
+    Push(ZBox(true));
+}
+
+template<> inline void ZoeVM::Instruction<PBF>(ExecState&, uint8_t const*)
+{
+    Push(ZBox(false));
+}
+
+template<> inline void ZoeVM::Instruction<PN8>(ExecState&, uint8_t const* ip)
+{
+    Push(ZBox(static_cast<double>(OPERAND(uint8_t))));
+}
+
+template<> inline void ZoeVM::Instruction<PNUM>(ExecState&, uint8_t const* ip)
+{
+    Push(ZBox(OPERAND(double)));
+}
+
+template<> inline void ZoeVM::Instruction<PSTR>(ExecState& st, uint8_t const* ip)
+{
+    Push(st.strings[OPERAND(uint32_t)]);
+}
+
+template<> inline void ZoeVM::Instruction<PCON>(ExecState& st, uint8_t const* ip)
+{
+    Push(Constant(st.b, OPERAND(uint32_t), st.strings));
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<PARY>(ExecState&, uint8_t const* ip)
+{
+    uint16_t n = OPERAND(uint16_t);
+    ZBox* items = StackTop(n);
+    ZBox ary = _heap.Make<ZArray>(items, items + n);
+    Pop(n);
+    Push(ary);
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<PTBL>(ExecState&, uint8_t const* ip)
+{
+    uint16_t n = OPERAND(uint16_t);
+    ZBox* items = StackTop(n*3U+1);
+    ZBox tbl = _heap.Make<ZTable>(items, items + n*3 + 1, false, _shapes.get());
+    Pop(static_cast<uint16_t>(n*3+1));
+    Push(tbl);
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<PTBX>(ExecState&, uint8_t const* ip)
+{
+    uint16_t n = OPERAND(uint16_t);
+    ZBox* items = StackTop(n*2U+1);
+    ZBox tbl = _heap.Make<ZTable>(items, items + n*2 + 1, true, _shapes.get());
+    Pop(static_cast<uint16_t>(n*2+1));
+    Push(tbl);
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<PFUN>(ExecState& st, uint8_t const* ip)
+{
+    uint64_t ptr = static_cast<uint64_t>(Pop().Number());
+    if(!st.chunk->IsFunction(ptr)) {
+        throw zoe_runtime_error("Invalid function address.");
+    }
+    Push(_heap.Make<ZFunctionPointer>(ptr, OPERAND(uint8_t)));
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<POP>(ExecState&, uint8_t const*)
+{
+    Pop();
+}
+
+template<> inline void ZoeVM::Instruction<SET>(ExecState& st, uint8_t const* ip)
+{
+    ZInlineCache& ic = st.Cache(ip);
+    ZBox const& obj = Get(-3);
+    TableConfig tc = OPERAND(TableConfig);
+    if(ic.Set(obj, Get(-2), Get(-1), tc)) {
+        ++_ic_stats.hits;
+    } else {
+        ++_ic_stats.misses;
+        obj.OpSet(Get(-2), Get(-1), tc);
+        ic.LearnSet(obj, Get(-2), tc);
+    }
+    _stack[_sp - 3] = _stack[_sp - 1];    // leave only the value in the stack
+    _sp -= 2;
+}
+
+template<> inline void ZoeVM::Instruction<GET>(ExecState& st, uint8_t const* ip)
+{
+    ZInlineCache& ic = st.Cache(ip);
+    ZBox const* cached = ic.Get(Get(-2), Get(-1));
+    ZBox value;
+    if(cached) {
+        ++_ic_stats.hits;
+        value = *cached;
+    } else {
+        ++_ic_stats.misses;
+        value = Get(-2).OpGet(Get(-1));
+        ic.LearnGet(Get(-2), Get(-1));
+    }
+    if(Get(-2).Type() == TABLE && Get(-1).Type() == STRING) {
+        st.Quicken(ip, GET_STR);
+    }
+    --_sp;
+    _stack[_sp - 1] = value;
+}
+
+template<> inline void ZoeVM::Instruction<GETF>(ExecState& st, uint8_t const* ip)
+{
+    ZBox const& obj = Variable(OPERAND(uint32_t));
+    ZBox const& key = st.strings[Operand<uint32_t>(ip + 5)];
+    ZInlineCache& ic = st.Cache(ip);
+    ZBox const* cached = ic.Get(obj, key);
+    if(cached) {
+        ++_ic_stats.hits;
+        Push(*cached);
+    } else {
+        ++_ic_stats.misses;
+        Push(obj.OpGet(key));
+        ic.LearnGet(obj, key);
+    }
+}
+
+template<> inline void ZoeVM::Instruction<CVAR>(ExecState&, uint8_t const*)
+{
+    _vars.push_back(Get());
+}
+
+template<> inline void ZoeVM::Instruction<CVN8>(ExecState&, uint8_t const* ip)
+{
+    _vars.push_back(Push(ZBox(static_cast<double>(OPERAND(uint8_t)))));
+}
+
+template<> inline void ZoeVM::Instruction<CMVAR>(ExecState&, uint8_t const* ip)
+{
+    CreateVariables(OPERAND(uint16_t));
+}
+
+template<> inline void ZoeVM::Instruction<GVAR>(ExecState&, uint8_t const* ip)
+{
+    Push(Variable(OPERAND(uint32_t)));
+}
+
+template<> inline void ZoeVM::Instruction<SVAR>(ExecState&, uint8_t const* ip)
+{
+    Variable(OPERAND(uint32_t)) = Get();
+}
+
+template<> inline void ZoeVM::Instruction<GLOC>(ExecState&, uint8_t const* ip)
+{
+    Push(Local(OPERAND(uint32_t)));
+}
+
+template<> inline void ZoeVM::Instruction<SLOC>(ExecState&, uint8_t const* ip)
+{
+    Local(OPERAND(uint32_t)) = Get();
+}
+
+template<> inline void ZoeVM::Instruction<GUPV>(ExecState&, uint8_t const* ip)
+{
+    Push(Upvalue(OPERAND(uint32_t)));
+}
+
+template<> inline void ZoeVM::Instruction<SUPV>(ExecState&, uint8_t const* ip)
+{
+    Upvalue(OPERAND(uint32_t)) = Get();
+}
+
+template<> inline void ZoeVM::Instruction<CAPL>(ExecState&, uint8_t const* ip)
+{
+    Push(Capture(_fp + OPERAND(uint32_t)));
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<CAPU>(ExecState&, uint8_t const* ip)
+{
+    if(!_closure) {
+        throw zoe_internal_error("Upvalue outside of a closure.");
+    }
+    Push(ZBox(_closure->Upvalue(OPERAND(uint32_t))));
+}
+
+template<> inline void ZoeVM::Instruction<PCLO>(ExecState& st, uint8_t const* ip)
+{
+    uint8_t nargs = ip[1], n = ip[2];
+    ZBox* items = StackTop(n + 1U);
+    if(!st.chunk->IsFunction(static_cast<uint64_t>(items[0].Number()))) {
+        throw zoe_runtime_error("Invalid function address.");
+    }
+    vector<ZUpvalue*> upvalues;
+    for(uint8_t i = 1; i <= n; ++i) {
+        upvalues.push_back(items[i].Ptr<ZUpvalue>());
+    }
+    ZBox closure = _heap.Make<ZClosure>(static_cast<uint64_t>(items[0].Number()), nargs, upvalues);
+    Pop(static_cast<uint16_t>(n + 1));
+    Push(closure);
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<CLOSE>(ExecState&, uint8_t const* ip)
+{
+    CloseUpvalues(_fp + OPERAND(uint32_t));
+}
+
+template<> inline void ZoeVM::Instruction<PCOR>(ExecState&, uint8_t const*)
+{
+    if(Get().Type() != FUNCTION) {
+        throw zoe_runtime_error("Invalid type: expected function, found " + Typename(Get().Type()));
+    }
+    ZBox co = _heap.Make<ZCoroutine>(Get(), COROUTINE_STACK, _executions);
+    _stack[_sp - 1] = co;
+    GC_SAFEPOINT();
+}
+
+template<> inline void ZoeVM::Instruction<PSHS>(ExecState&, uint8_t const*)
+{
+    _scopes.push_back(static_cast<uint32_t>(_vars.size()));
+}
+
+template<> inline void ZoeVM::Instruction<POPS>(ExecState&, uint8_t const*)
+{
+    uint32_t last = _scopes.back();
+    _scopes.pop_back();
+    assert(!_scopes.empty());
+    _vars.erase(begin(_vars) + last, std::end(_vars));
+}
+
+// }}}
+
+// {{{ operators
+
+/* The generic operators check the types of their operands at every
+ * execution. When the types are the ones of a specialized version (ADD_NN
+ * for two numbers, GET_STR for a table and a string), the instruction is
+ * rewritten in place (quickened), so that the next executions only need to
+ * confirm them. If a quickened instruction finds other types, it goes back to
+ * the generic version (de-quickened), for good. */
+
+template<uint8_t OP> inline ZBox number_op(double a, double b);
+template<> inline ZBox number_op<ADD>(double a, double b)  { return ZBox(a + b); }
+template<> inline ZBox number_op<SUB>(double a, double b)  { return ZBox(a - b); }
+template<> inline ZBox number_op<MUL>(double a, double b)  { return ZBox(a * b); }
+template<> inline ZBox number_op<DIV>(double a, double b)  { return ZBox(a / b); }
+template<> inline ZBox number_op<IDIV>(double a, double b) { return ZBox(floor(a / b)); }
+template<> inline ZBox number_op<MOD>(double a, double b)  { return ZBox(fmod(a, b)); }
+template<> inline ZBox number_op<POW>(double a, double b)  { return ZBox(pow(a, b)); }
+template<> inline ZBox number_op<LT>(double a, double b)   { return ZBox(a < b); }
+template<> inline ZBox number_op<LTE>(double a, double b)  { return ZBox(a <= b); }
+
+// bitwise operators work on the integer part of the numbers: NaN is 0, and
+// the numbers out of the range of int64_t (infinities too) are clamped to it.
+// NaN is found by its bits, as the release build assumes finite math (and
+// removes isnan).
+inline bool is_nan(double a)
+{
+    uint64_t bits;
+    memcpy(&bits, &a, sizeof bits);
+    return (bits & 0x7FF0000000000000) == 0x7FF0000000000000 && (bits & 0x000FFFFFFFFFFFFF) != 0;
+}
+inline uint64_t integer(double a)
+{
+    int64_t i = is_nan(a) ? 0
+              : (a >= 9223372036854775808.0) ? INT64_MAX
+              : (a < -9223372036854775808.0) ? INT64_MIN
+              : static_cast<int64_t>(a);
+    return static_cast<uint64_t>(i);
+}
+inline ZBox     from_integer(uint64_t i) { return ZBox(static_cast<double>(static_cast<int64_t>(i))); }
+template<> inline ZBox number_op<AND>(double a, double b)  { return from_integer(integer(a) & integer(b)); }
+template<> inline ZBox number_op<OR>(double a, double b)   { return from_integer(integer(a) | integer(b)); }
+template<> inline ZBox number_op<XOR>(double a, double b)  { return from_integer(integer(a) ^ integer(b)); }
+template<> inline ZBox number_op<SHL>(double a, double b)  { return from_integer(integer(a) << (integer(b) & 63)); }
+template<> inline ZBox number_op<SHR>(double a, double b)  { return from_integer(integer(a) >> (integer(b) & 63)); }
+
+// operator on two numbers; QUICK is its quickened version (or OP, if there's none)
+template<Opcode OP, Opcode QUICK> inline void ZoeVM::Arithmetic(ExecState& st, uint8_t const* ip)
+{
+    ZBox* v = StackTop(2);
+    if(QUICK != OP && v[0].IsNumber() && v[1].IsNumber()) {
+        st.Quicken(ip, QUICK);
+    }
+    v[0] = number_op<OP>(v[0].Number(), v[1].Number());
+    --_sp;
+}
+
+// quickened version of the operator OP
+template<Opcode OP> inline void ZoeVM::Quickened(ExecState& st, uint8_t const* ip)
+{
+    ZBox* v = StackTop(2);
+    if(v[0].IsNumber() && v[1].IsNumber()) {
+        v[0] = number_op<OP>(v[0].Number(), v[1].Number());
+        --_sp;
+    } else {
+        st.Dequicken(ip, OP);
+        Instruction<OP>(st, ip);
+    }
+}
+
+template<> inline void ZoeVM::Instruction<ADD>(ExecState& st, uint8_t const* ip)
+{
+    ZBox* v = StackTop(2);
+    if(v[0].Type() == STRING && v[1].Type() == STRING) {
+        v[0] = _heap.Make<ZString>(v[0].Ptr<ZString>()->Value() + v[1].Ptr<ZString>()->Value());
+        --_sp;
+        GC_SAFEPOINT();
+    } else {
+        Arithmetic<ADD, ADD_NN>(st, ip);
+    }
+}
+
+template<> inline void ZoeVM::Instruction<LT>(ExecState& st, uint8_t const* ip)
+{
+    ZBox* v = StackTop(2);
+    if(v[0].Type() == STRING && v[1].Type() == STRING) {
+        v[0] = ZBox(v[0].Ptr<ZString>()->Value() < v[1].Ptr<ZString>()->Value());
+        --_sp;
+    } else {
+        Arithmetic<LT, LT_NN>(st, ip);
+    }
+}
+
+template<> inline void ZoeVM::Instruction<LTE>(ExecState& st, uint8_t const* ip)
+{
+    ZBox* v = StackTop(2);
+    if(v[0].Type() == STRING && v[1].Type() == STRING) {
+        v[0] = ZBox(v[0].Ptr<ZString>()->Value() <= v[1].Ptr<ZString>()->Value());
+        --_sp;
+    } else {
+        Arithmetic<LTE, LTE_NN>(st, ip);
+    }
+}
+
+template<> inline void ZoeVM::Instruction<SUB>(ExecState& st, uint8_t const* ip)  { Arithmetic<SUB, SUB_NN>(st, ip); }
+template<> inline void ZoeVM::Instruction<MUL>(ExecState& st, uint8_t const* ip)  { Arithmetic<MUL, MUL_NN>(st, ip); }
+template<> inline void ZoeVM::Instruction<DIV>(ExecState& st, uint8_t const* ip)  { Arithmetic<DIV, DIV_NN>(st, ip); }
+template<> inline void ZoeVM::Instruction<IDIV>(ExecState& st, uint8_t const* ip) { Arithmetic<IDIV, IDIV>(st, ip); }
+template<> inline void ZoeVM::Instruction<MOD>(ExecState& st, uint8_t const* ip)  { Arithmetic<MOD, MOD>(st, ip); }
+template<> inline void ZoeVM::Instruction<POW>(ExecState& st, uint8_t const* ip)  { Arithmetic<POW, POW>(st, ip); }
+template<> inline void ZoeVM::Instruction<AND>(ExecState& st, uint8_t const* ip)  { Arithmetic<AND, AND>(st, ip); }
+template<> inline void ZoeVM::Instruction<OR>(ExecState& st, uint8_t const* ip)   { Arithmetic<OR, OR>(st, ip); }
+template<> inline void ZoeVM::Instruction<XOR>(ExecState& st, uint8_t const* ip)  { Arithmetic<XOR, XOR>(st, ip); }
+template<> inline void ZoeVM::Instruction<SHL>(ExecState& st, uint8_t const* ip)  { Arithmetic<SHL, SHL>(st, ip); }
+template<> inline void ZoeVM::Instruction<SHR>(ExecState& st, uint8_t const* ip)  { Arithmetic<SHR, SHR>(st, ip); }
+
+template<> inline void ZoeVM::Instruction<ADD_NN>(ExecState& st, uint8_t const* ip) { Quickened<ADD>(st, ip); }
+template<> inline void ZoeVM::Instruction<SUB_NN>(ExecState& st, uint8_t const* ip) { Quickened<SUB>(st, ip); }
+template<> inline void ZoeVM::Instruction<MUL_NN>(ExecState& st, uint8_t const* ip) { Quickened<MUL>(st, ip); }
+template<> inline void ZoeVM::Instruction<DIV_NN>(ExecState& st, uint8_t const* ip) { Quickened<DIV>(st, ip); }
+template<> inline void ZoeVM::Instruction<LT_NN>(ExecState& st, uint8_t const* ip)  { Quickened<LT>(st, ip); }
+template<> inline void ZoeVM::Instruction<LTE_NN>(ExecState& st, uint8_t const* ip) { Quickened<LTE>(st, ip); }
+
+template<> inline void ZoeVM::Instruction<UNM>(ExecState&, uint8_t const*)
+{
+    ZBox* v = StackTop(1);
+    v[0] = ZBox(-v[0].Number());
+}
+
+template<> inline void ZoeVM::Instruction<NOT>(ExecState&, uint8_t const*)     // bitwise
+{
+    ZBox* v = StackTop(1);
+    v[0] = from_integer(~integer(v[0].Number()));
+}
+
+template<> inline void ZoeVM::Instruction<BNOT>(ExecState&, uint8_t const*)    // boolean
+{
+    ZBox* v = StackTop(1);
+    v[0] = ZBox(!v[0].Bool());
+}
+
+template<> inline void ZoeVM::Instruction<EQ>(ExecState&, uint8_t const*)
+{
+    ZBox* v = StackTop(2);
+    v[0] = ZBox(v[0].OpEq(v[1]));
+    --_sp;
+}
+
+template<> inline void ZoeVM::Instruction<GET_STR>(ExecState& st, uint8_t const* ip)
+{
+    ZBox const& obj = Get(-2);
+    ZBox const& key = Get(-1);
+    if(obj.Type() != TABLE || key.Type() != STRING) {
+        st.Dequicken(ip, GET);
+        Instruction<GET>(st, ip);
+        return;
+    }
+    ZInlineCache& ic = st.Cache(ip);
+    ZBox const* cached = ic.Get(obj, key);
+    ZBox value;
+    if(cached) {
+        ++_ic_stats.hits;
+        value = *cached;
+    } else {
+        ++_ic_stats.misses;
+        value = obj.Ptr<ZTable>()->OpGet(key);
+        ic.LearnGet(obj, key);
+    }
+    --_sp;
+    _stack[_sp - 1] = value;
+}
+
+// }}}
+
+// {{{ native code
+
+inline uint8_t const* ZoeVM::Native::Code() const
+{
+    return _st.code;
+}
+
+
+template<Opcode OP> inline void ZoeVM::Native::Step(uint8_t const* ip)
+{
+    _vm.Instruction<OP>(_st, ip);
+}
+
+// }}}
+
+#undef OPERAND
+#undef GC_SAFEPOINT
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,214 @@
+#include "vm/zjit.hh"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef ZJIT_SUPPORTED
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+constexpr uint64_t ZJit::FAILED;
+constexpr uint32_t ZJit::DEFAULT_THRESHOLD;
+
+ZJit::ZJit(vector<Helper> const& helpers, uint32_t threshold, bool perf_map)
+    : _helpers(helpers), _threshold(threshold), _perf_map(perf_map)
+{
+    _helpers.resize(256, nullptr);
+}
+
+
+ZJit::~ZJit()
+{
+    Reset(nullptr, 0);
+}
+
+
+bool ZJit::Supported()
+{
+#ifdef ZJIT_SUPPORTED
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+void ZJit::Reset(uint8_t const* code, size_t size)
+{
+#ifdef ZJIT_SUPPORTED
+    for(Region const& r: _regions) {
+        munmap(r.mem, r.size);
+    }
+#endif
+    _regions.clear();
+    _functions.clear();
+    _calls.clear();
+    _code = code;
+    _size = size;
+}
+
+
+ZJit::Function ZJit::Enter(uint64_t addr)
+{
+    auto it = _functions.find(addr);
+    if(it != _functions.end()) {
+        return it->second;
+    }
+    if(++_calls[addr] < _threshold) {
+        return nullptr;
+    }
+    Function f = Compile(addr);
+    _functions[addr] = f;
+    return f;
+}
+
+
+size_t ZJit::Compiled() const
+{
+    size_t n = 0;
+    for(auto const& kv: _functions) {
+        if(kv.second) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+
+string ZJit::PerfMapFilename() const
+{
+#ifdef ZJIT_SUPPORTED
+    return "/tmp/perf-" + to_string(getpid()) + ".map";
+#else
+    return "";
+#endif
+}
+
+// {{{ CODE GENERATION
+
+#ifdef ZJIT_SUPPORTED
+
+/* Templates (x86-64, System V ABI). The context is kept in r12 (callee
+ * saved), and pushing it also aligns the stack for the calls to the helpers.
+ * The zeroed bytes are patched at the offsets given. */
+
+static const uint8_t T_PROLOGUE[] = {
+    0x41, 0x54,                                     // push r12
+    0x49, 0x89, 0xFC,                               // mov r12, rdi
+};
+
+static const uint8_t T_INSTRUCTION[] = {
+    0x4C, 0x89, 0xE7,                               // mov rdi, r12
+    0x48, 0xBE, 0, 0, 0, 0, 0, 0, 0, 0,             // mov rsi, <ip>
+    0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,             // mov rax, <helper>
+    0xFF, 0xD0,                                     // call rax
+    0x84, 0xC0,                                     // test al, al
+    0x0F, 0x84, 0, 0, 0, 0,                         // jz <failed>
+};
+static constexpr size_t T_INSTRUCTION_IP = 5, T_INSTRUCTION_HELPER = 15, T_INSTRUCTION_FAILED = 29;
+
+static const uint8_t T_RETURN[] = {
+    0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,             // mov rax, <value>
+    0x41, 0x5C,                                     // pop r12
+    0xC3,                                           // ret
+};
+static constexpr size_t T_RETURN_VALUE = 2;
+
+ZJit::Function ZJit::Compile(uint64_t addr)
+{
+    vector<uint8_t> mcode;
+    auto emit = [&](uint8_t const* tmpl, size_t size) {
+        size_t pos = mcode.size();
+        mcode.insert(mcode.end(), tmpl, tmpl + size);
+        return pos;
+    };
+    auto patch = [&](size_t pos, void const* data, size_t size) {
+        memcpy(&mcode[pos], data, size);
+    };
+
+    emit(T_PROLOGUE, sizeof T_PROLOGUE);
+
+    vector<size_t> failed_jumps;
+    uint64_t pc = addr;
+    size_t compiled = 0;
+    while(pc < _size && _helpers[_code[pc]]) {
+        uint8_t op = _code[pc];
+        if(op != NOP) {
+            size_t pos = emit(T_INSTRUCTION, sizeof T_INSTRUCTION);
+            uint8_t const* ip = _code + pc;
+            Helper helper = _helpers[op];
+            patch(pos + T_INSTRUCTION_IP, &ip, 8);
+            patch(pos + T_INSTRUCTION_HELPER, &helper, 8);
+            failed_jumps.push_back(pos + T_INSTRUCTION_FAILED);
+        }
+        pc += opcode_size(op);
+        ++compiled;
+    }
+    if(compiled == 0) {
+        return nullptr;     // nothing to gain
+    }
+
+    // resume the interpreter after the last instruction compiled
+    size_t pos = emit(T_RETURN, sizeof T_RETURN);
+    patch(pos + T_RETURN_VALUE, &pc, 8);
+
+    // an instruction failed
+    pos = emit(T_RETURN, sizeof T_RETURN);
+    patch(pos + T_RETURN_VALUE, &FAILED, 8);
+    for(size_t jmp: failed_jumps) {
+        int32_t rel = static_cast<int32_t>(pos - (jmp + 4));
+        patch(jmp, &rel, 4);
+    }
+
+    // copy to executable memory (never writable and executable at the same time)
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t size = (mcode.size() + page - 1) / page * page;
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(mem, mcode.data(), mcode.size());
+    if(mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return nullptr;
+    }
+    _regions.push_back({ mem, size });
+
+    if(_perf_map) {
+        WritePerfMap(mem, mcode.size(), addr);
+    }
+
+    Function f;
+    memcpy(&f, &mem, sizeof f);
+    return f;
+}
+
+
+void ZJit::WritePerfMap(void const* start, size_t size, uint64_t addr) const
+{
+    // format: START SIZE symbolname (in hexadecimal), see tools/perf/Documentation/jit-interface.txt
+    FILE* f = fopen(PerfMapFilename().c_str(), "a");
+    if(f) {
+        fprintf(f, "%lx %zx zoe_fn_%lx\n", reinterpret_cast<uintptr_t>(start), size, addr);
+        fclose(f);
+    }
+}
+
+#else
+
+ZJit::Function ZJit::Compile(uint64_t)
+{
+    return nullptr;
+}
+
+
+void ZJit::WritePerfMap(void const*, size_t, uint64_t) const
+{
+}
+
+#endif
+
+// }}}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
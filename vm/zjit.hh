@@ -0,0 +1,83 @@
+#ifndef VM_ZJIT_H_
+#define VM_ZJIT_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "vm/opcode.hh"
+
+#if defined(__linux__) && defined(__x86_64__)
+#  define ZJIT_SUPPORTED 1
+#endif
+
+// A ZJit is a baseline template JIT: when a function (the address of its
+// code) has been called `threshold` times, its instructions are compiled to
+// machine code, by copying a pre-assembled template for each one of them into
+// executable memory and patching in its operands.
+//
+// The templates don't implement the instructions by themselves: each one
+// calls the helper of its opcode (given by the VM, which shares them with the
+// interpreter loop), so the compiled code only removes the dispatch. The
+// compilation stops at the first instruction without a helper (control flow,
+// such as JMP, CALL or RET): the compiled function returns its address, and
+// the interpreter resumes from there.
+//
+// Helpers return false when the instruction fails (the VM keeps the
+// exception, as exceptions can't unwind through the compiled code). In that
+// case the compiled function returns FAILED.
+//
+// The compiled code refers to the code being executed, so the functions are
+// discarded when the VM starts executing another code (Reset). The VM keeps
+// them while it executes the same code again.
+//
+// Only Linux x86-64 is supported: in other platforms, nothing is compiled.
+class ZJit {
+public:
+    typedef bool     (*Helper)(void* ctx, uint8_t const* ip);
+    typedef uint64_t (*Function)(void* ctx);
+
+    static constexpr uint64_t FAILED = UINT64_MAX;
+    static constexpr uint32_t DEFAULT_THRESHOLD = 100;
+
+    // helpers: indexed by opcode (nullptr for the ones not supported)
+    // perf_map: writes the compiled functions to /tmp/perf-<pid>.map, for `perf`
+    ZJit(vector<Helper> const& helpers, uint32_t threshold, bool perf_map=false);
+    ~ZJit();
+
+    ZJit(ZJit const&) = delete;
+    ZJit& operator=(ZJit const&) = delete;
+
+    static bool Supported();
+
+    void     Reset(uint8_t const* code, size_t size);   // start executing a new code
+    uint8_t const* Code() const { return _code; }       // being executed
+    Function Enter(uint64_t addr);                      // counts a call; returns the compiled function, if any
+
+    size_t   Compiled() const;                          // number of functions compiled since the last Reset
+    string   PerfMapFilename() const;
+
+private:
+    Function Compile(uint64_t addr);
+    void     WritePerfMap(void const* start, size_t size, uint64_t addr) const;
+
+    struct Region {
+        void*  mem;
+        size_t size;
+    };
+
+    vector<Helper>                   _helpers;
+    uint32_t                         _threshold;
+    bool                             _perf_map;
+    uint8_t const*                   _code = nullptr;
+    size_t                           _size = 0;
+    unordered_map<uint64_t, uint32_t> _calls = {};
+    unordered_map<uint64_t, Function> _functions = {};   // nullptr: the function can't be compiled
+    vector<Region>                   _regions = {};     // executable memory
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -1,285 +1,884 @@
 #include "vm/zoevm.hh"
 
-#include <list>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <exception>
 #include <iomanip>
 #include <iostream>   // TODO
 #include <sstream>
 #include <stdexcept>
 
-#include "compiler/bytecode.hh"
-#include "vm/znil.hh"
-#include "vm/zbool.hh"
-#include "vm/znumber.hh"
+#include "compiler/bytecodeview.hh"
+#include "compiler/compiledchunk.hh"
+#include "compiler/registercode.hh"
 #include "vm/zstring.hh"
 #include "vm/zarray.hh"
 #include "vm/ztable.hh"
 #include "vm/zfunction.hh"
+#include "vm/zcoroutine.hh"
+#include "vm/zinlinecache.hh"
+#include "vm/zinstructions.hh"
+#include "vm/zprofile.hh"
+#include "vm/ztracebuffer.hh"
 
-ZoeVM::ZoeVM()
+constexpr size_t ZoeVM::DEFAULT_MAX_STACK;
+constexpr size_t ZoeVM::COROUTINE_STACK;
+
+static constexpr uint64_t COROUTINE_END = UINT64_MAX;     // return address of the function of a coroutine
+
+ZoeVM::ZoeVM(size_t max_stack)
+    : _shapes(ZShape::NewRoot()), _stack(max_stack), _state()
 {
-    _stack.push_back(make_shared<ZNil>());
+    Push(nullptr);
 }
 
 // {{{ STACK MANAGEMENT
 
-ssize_t ZoeVM::StackAbs(ssize_t pos) const
+void ZoeVM::Pop(uint16_t n)
 {
-    ssize_t i = (pos >= 0) ? pos : StackSize() + pos;
-    if(i < 0) {
-        throw zoe_internal_error("Stack underflow");
+    if(_sp < n) {
+        throw underflow_error("Stack underflow");
     }
-    return i;
+    _sp -= n;
 }
 
 
-ssize_t ZoeVM::StackSize() const
+void ZoeVM::Remove(ssize_t pos)
 {
-    return static_cast<ssize_t>(_stack.size());
+    ssize_t i = StackAbs(pos);
+    if(i >= StackSize()) {
+        throw out_of_range("Stack access out of range");
+    }
+    copy(begin(_stack) + i + 1, begin(_stack) + static_cast<ssize_t>(_sp), begin(_stack) + i);
+    --_sp;
+}
+
+ZType ZoeVM::GetType(ssize_t pos) const
+{
+    return Get(pos).Type();
 }
 
 
-ZValue const& ZoeVM::Push(shared_ptr<ZValue> value)
+void ZoeVM::StackOverflow() const
 {
-    _stack.push_back(value);
-    return *_stack.back().get();
+    throw zoe_runtime_error("Stack overflow (maximum of " + to_string(_stack.size()) + " values).");
 }
 
+// }}}
+
+// {{{ MEMORY
 
-shared_ptr<ZValue> ZoeVM::Pop()
+size_t ZoeVM::Collect()
 {
-    if(_stack.empty()) {
-        throw underflow_error("Stack underflow");
+    for(size_t i = 0; i < _sp; ++i) {
+        _heap.Mark(_stack[i]);
+    }
+    for(ZBox const& value: _vars) {
+        _heap.Mark(value);
     }
-    auto last = _stack.back();
-    _stack.pop_back();
-    return last;
+    for(ZBox const& value: _constants) {
+        _heap.Mark(value);
+    }
+    for(ZBox const& value: _frame) {
+        _heap.Mark(value);
+    }
+    for(ZUpvalue const* upvalue: _open_upvalues) {
+        _heap.Mark(upvalue);
+    }
+    for(Frame const& frame: _call_stack) {     // the closures being executed are not in the stack anymore
+        if(frame.closure) {
+            _heap.Mark(frame.closure);
+        }
+    }
+    for(ZCoroutine const* co: _coroutines) {   // they hold the contexts of the code that resumed them
+        _heap.Mark(co);
+    }
+    _strings.Trace(_heap);
+    _shapes->Trace(_heap);
+    return _heap.Collect();
 }
 
+// }}}
 
-void ZoeVM::Pop(uint16_t n)
+// {{{ CODE EXECUTION
+
+void ZoeVM::ExecuteBytecode(vector<uint8_t> const& bytecode)
 {
-    if(_stack.size() < n) {
-        throw underflow_error("Stack underflow");
+    ExecuteBytecode(BytecodeView(bytecode));
+}
+
+
+void ZoeVM::ExecuteBytecode(BytecodeView const& bytecode)
+{
+    ExecuteCode(make_shared<CompiledChunk const>(bytecode), nullptr, false);
+}
+
+
+void ZoeVM::ExecuteChunk(shared_ptr<CompiledChunk const> const& chunk)
+{
+    ExecuteCode(chunk, nullptr, true);
+}
+
+
+void ZoeVM::ExecuteNative(BytecodeView const& bytecode, NativeCode code)
+{
+    ExecuteCode(make_shared<CompiledChunk const>(bytecode), code, false);
+}
+
+
+// keep_state: the chunk can be executed again (otherwise, it was prepared
+// only for this execution, from an image that might not outlive it)
+void ZoeVM::ExecuteCode(shared_ptr<CompiledChunk const> const& chunk, NativeCode native, bool keep_state)
+{
+    BytecodeView const& bytecode = chunk->View();
+    ZHeap::Counters before = _heap.Allocated();
+    auto after_execution = [&]() {
+        _last_allocations.objects = _heap.Allocated().objects - before.objects;
+        _last_allocations.bytes = _heap.Allocated().bytes - before.bytes;
+        _constants.clear();     // they only live while the code runs
+        _chunk = nullptr;
+        if(!keep_state) {
+            _state.reset();
+        }
+    };
+    ++_executions;
+    ExecState& st = State(chunk);
+
+    try {
+        RegisterCode rc;
+        string reason;
+        if(native) {
+            RunNative(st, native);
+        } else if(RegisterBackend && !Tracer && !Profiler && !TraceBuffer && _vars.empty() && rc.Translate(bytecode, &reason)) {
+            ExecuteRegisters(rc, bytecode);
+        } else if(Tracer || Profiler) {
+            Execute<true, false>(st);
+        } else if(TraceBuffer) {
+            Execute<false, true>(st);
+        } else {
+            Execute<false, false>(st);
+        }
+    } catch(...) {
+        UnwindCoroutines();
+        UnwindFrames();
+        after_execution();
+        throw;
     }
-    _stack.resize(_stack.size() - n);
+    after_execution();
 }
 
 
-void ZoeVM::Remove(ssize_t pos)
+/* The interpreter loop is written once, with the help of the macros below, and
+ * compiled in two ways:
+ *
+ *   - when using GCC or clang, the opcode handlers are jumped to directly from
+ *     the end of the previous handler (threaded dispatch), using a table of
+ *     label addresses generated from OPCODE_TABLE ("labels as values");
+ *   - otherwise (or if ZOE_SWITCH_DISPATCH is defined), a portable `switch` is used.
+ *
+ * The loop is also instantiated three times: with tracing (and profiling,
+ * and the trace buffer), with the trace buffer only (cheap enough to keep
+ * the JIT on) and without any of them. The code that is not needed is
+ * removed by the compiler from each version.
+ *
+ * Note that a computed goto doesn't call destructors, so objects with
+ * destructors (such as strings) must go out of scope before NEXT or JUMP.
+ *
+ * The instructions that don't change the flow of the code are implemented in
+ * vm/zinstructions.hh. */
+
+#if defined(__GNUC__) && !defined(ZOE_SWITCH_DISPATCH)
+#  define THREADED_DISPATCH 1
+#endif
+
+#define OPERAND(T)    Operand<T>(ip+1)
+#define TRACE_BEFORE() if(RECORD || (TRACE && recorder)) { recorder->Record(static_cast<uint32_t>(ip - code), *ip, _sp); } \
+                       if(TRACE) { if(Profiler) { Profiler->Record(ip); } \
+                               if(Tracer) { trace = TraceInstruction(b, static_cast<size_t>(ip - code)); } }
+#define TRACE_AFTER()  if(TRACE && Tracer) { TraceStack(trace); }
+#ifdef THREADED_DISPATCH
+#  define OPCODE(op)  op_##op:
+#  define DISPATCH()  { if(ip == end) { goto done; } TRACE_BEFORE(); goto *labels[*ip]; }
+#  define NEXT(op)    { ip += opcode_size(op); TRACE_AFTER(); DISPATCH(); }
+#  define JUMP(addr)  { ip = code + (addr); TRACE_AFTER(); DISPATCH(); }
+#else
+#  define OPCODE(op)  case op:
+#  define NEXT(op)    { ip += opcode_size(op); TRACE_AFTER(); continue; }
+#  define JUMP(addr)  { ip = code + (addr); TRACE_AFTER(); continue; }
+#endif
+
+
+ZoeVM::~ZoeVM()       // here, where ExecState is complete
 {
-    ssize_t i = StackAbs(pos);
-    if(i >= StackSize()) {
-        throw out_of_range("Stack access out of range");
+}
+
+
+/* The state of the last chunk executed is kept, and used again if the same
+ * chunk is executed again. Otherwise it is replaced, and the functions
+ * compiled by the JIT for the previous code are discarded. */
+ZoeVM::ExecState& ZoeVM::State(shared_ptr<CompiledChunk const> const& chunk)
+{
+    if(!_state || _state->chunk != chunk) {
+        _state.reset(new ExecState(this, chunk));
+        if(_jit) {
+            _jit->Reset(_state->code, _state->b.CodeSize());
+        }
     }
-    _stack.erase(begin(_stack) + i);
+    _state->error = nullptr;
+    _chunk = _state->chunk.get();
+    return *_state;
 }
 
-ZValue const* ZoeVM::GetPtr(ssize_t pos) const
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+template<bool TRACE, bool RECORD> void ZoeVM::Execute(ExecState& st)
 {
-    ssize_t i = StackAbs(pos);
-    if(i >= StackSize()) {
-        throw out_of_range("Stack access out of range");
+    BytecodeView const& b = st.b;
+    LoadConstants(b, st.strings);
+
+    uint8_t const* const code = st.code;
+    uint8_t const* const end = code + b.CodeSize();
+    uint8_t const* ip = code;
+    string trace;
+    ZTraceBuffer* const recorder = TraceBuffer;     // loaded once, not for each instruction
+
+    if(_jit && _jit->Code() != code) {     // enabled after the state was created
+        _jit->Reset(code, b.CodeSize());
+    }
+
+#ifdef THREADED_DISPATCH
+#  define X(a, b) &&op_##a
+    static void* const labels[] = { OPCODE_TABLE };
+#  undef X
+    DISPATCH();
+#else
+    while(ip != end) {
+        TRACE_BEFORE();
+        switch(*ip) {
+#endif
+
+#define X(op) OPCODE(op) Instruction<op>(st, ip); NEXT(op);
+    SHARED_OPCODES
+#undef X
+
+    OPCODE(JMP)
+        JUMP(OPERAND(uint64_t));
+
+    OPCODE(CALL) {
+            uint8_t nargs = OPERAND(uint8_t);
+            uint64_t addr = CallFunction(Get(-nargs - 1), nargs, 1, static_cast<uint64_t>(ip - code) + opcode_size(CALL));
+            if(!TRACE && _jit) {
+                addr = EnterJit(st, addr);
+            }
+            JUMP(addr);
+        }
+
+    OPCODE(CALLV) {
+            uint64_t addr = CallFunction(Variable(OPERAND(uint32_t)), ip[5], 0, static_cast<uint64_t>(ip - code) + opcode_size(CALLV));
+            if(!TRACE && _jit) {
+                addr = EnterJit(st, addr);
+            }
+            JUMP(addr);
+        }
+
+    OPCODE(TAILCALL) {
+            uint8_t nargs = OPERAND(uint8_t);
+            uint64_t addr = TailCall(Get(-nargs - 1), nargs);
+            if(!TRACE && _jit) {
+                addr = EnterJit(st, addr);
+            }
+            JUMP(addr);
+        }
+
+    OPCODE(RET)
+        JUMP(Return());
+
+    OPCODE(RESUME)
+        JUMP(Resume(static_cast<uint64_t>(ip - code) + opcode_size(RESUME)));
+
+    OPCODE(YIELD)
+        JUMP(Yield(static_cast<uint64_t>(ip - code) + opcode_size(YIELD)));
+
+    // not implemented yet
+    OPCODE(BT) OPCODE(PART) OPCODE(LEN) OPCODE(DEL) OPCODE(INSP) OPCODE(PTR) OPCODE(ISNIL)
+#ifndef THREADED_DISPATCH
+        default:
+#endif
+        throw domain_error("Invalid opcode " + to_string(*ip));
+
+#ifndef THREADED_DISPATCH
+        }
     }
-    return _stack[static_cast<size_t>(i)].get();
+#else
+done:
+#endif
+    return;
 }
+#pragma GCC diagnostic pop
 
 
-shared_ptr<ZValue> ZoeVM::GetCopy(ssize_t pos) const
+/* Runs the compiled version of the function at `addr`, if the JIT has one.
+ * Returns the address where the interpreter continues. */
+uint64_t ZoeVM::EnterJit(ExecState& st, uint64_t addr)
 {
-    ssize_t i = StackAbs(pos);
-    if(i >= StackSize()) {
-        throw out_of_range("Stack access out of range");
+    ZJit::Function f = _jit->Enter(addr);
+    if(!f) {
+        return addr;
+    }
+    uint64_t next = f(&st);
+    if(next == ZJit::FAILED) {
+        exception_ptr error = st.error;
+        st.error = nullptr;
+        rethrow_exception(error);
     }
-    return _stack[static_cast<size_t>(i)];
+    return next;
 }
 
 
-ZType ZoeVM::GetType(ssize_t pos) const
+template<Opcode OP> bool ZoeVM::JitInstruction(void* ctx, uint8_t const* ip)
 {
-    return GetPtr(pos)->Type();
+    ExecState& st = *static_cast<ExecState*>(ctx);
+    try {
+        st.vm->Instruction<OP>(st, ip);
+        return true;
+    } catch(...) {
+        st.error = current_exception();
+        return false;
+    }
 }
 
-// }}}
 
-// {{{ CODE EXECUTION
+// {{{ native code
 
-void ZoeVM::ExecuteBytecode(vector<uint8_t> const& bytecode)
+void ZoeVM::RunNative(ExecState& st, NativeCode native)
 {
-    Bytecode b(bytecode);
+    LoadConstants(st.b, st.strings);
+    Native z(*this, st);
+    native(z);
+}
 
-#pragma GCC diagnostic ignored "-Wswitch-enum"  // TODO
-#pragma GCC diagnostic push
-    uint64_t p = 0;
-    while(p < b.Code().size()) {
-
-        static stringstream debug;
-        if(Tracer) {
-            debug.str("");
-            string opc = b.DisassembleOpcode(p);
-            debug << setfill('0') << hex << uppercase;
-            debug << "* " << setw(8) << p << ":   " << opc;
-            debug << string(20 - opc.size(), ' ');
-        }
 
-        switch(b.GetCode<Opcode>(p)) {
+uint64_t ZoeVM::Native::Call(uint8_t nargs, uint64_t ret)
+{
+    return _vm.CallFunction(_vm.Get(-nargs - 1), nargs, 1, ret);
+}
 
-            case PNIL:
-                Push(make_shared<ZNil>());
-                break;
 
-            case PBT:
-                Push(make_shared<ZBool>(true));
-                break;
+uint64_t ZoeVM::Native::CallVariable(uint32_t n, uint8_t nargs, uint64_t ret)
+{
+    return _vm.CallFunction(_vm.Variable(n), nargs, 0, ret);
+}
 
-            case PBF:
-                Push(make_shared<ZBool>(false));
-                break;
 
-            case PN8:
-                Push(make_shared<ZNumber>(b.GetCode<uint8_t>(p+1)));
-                break;
+uint64_t ZoeVM::Native::TailCall(uint8_t nargs)
+{
+    return _vm.TailCall(_vm.Get(-nargs - 1), nargs);
+}
 
-            case PNUM: 
-                Push(make_shared<ZNumber>(b.GetCode<double>(p+1)));
-                break;
 
-            case PSTR: {
-                    Bytecode::String s = b.Strings().at(b.GetCode<uint32_t>(p+1));
-                    Push(make_shared<ZString>(s.str, s.hash));
-                }
-                break;
+uint64_t ZoeVM::Native::Return()
+{
+    return _vm.Return();
+}
 
-            case PARY: {
-                    uint16_t n = b.GetCode<uint16_t>(p+1);
-                    auto ary = make_shared<ZArray>(end(_stack)-n, end(_stack));
-                    Pop(n);
-                    Push(ary);
-                }
-                break;
 
-            case PTBL: {
-                    uint16_t n = b.GetCode<uint16_t>(p+1);
-                    auto tbl = make_shared<ZTable>(end(_stack)-(n*3)-1, end(_stack), false);
-                    Pop(static_cast<uint16_t>(n*3+1));
-                    Push(tbl);
-                }
-                break;
+uint64_t ZoeVM::Native::Resume(uint64_t ret)
+{
+    return _vm.Resume(ret);
+}
+
+
+uint64_t ZoeVM::Native::Yield(uint64_t ret)
+{
+    return _vm.Yield(ret);
+}
+
+// }}}
+
+
+bool ZoeVM::EnableJit(uint32_t threshold, bool perf_map)
+{
+    if(!ZJit::Supported()) {
+        return false;
+    }
+    vector<ZJit::Helper> helpers(256, nullptr);
+#define X(op) helpers[op] = &ZoeVM::JitInstruction<op>;
+    SHARED_OPCODES
+#undef X
+    _jit.reset(new ZJit(helpers, threshold, perf_map));
+    return true;
+}
+
+#undef OPERAND
+#undef TRACE_BEFORE
+#undef TRACE_AFTER
+#undef OPCODE
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+
+
+vector<ZBox> ZoeVM::InternStrings(BytecodeView const& b)
+{
+    vector<ZBox> strings;
+    strings.reserve(b.StringCount());
+    for(uint32_t i = 0; i < b.StringCount(); ++i) {
+        BytecodeView::String const& s = b.GetString(i);
+        strings.push_back(_strings.Intern(s.str, s.len, s.hash));
+    }
+    return strings;
+}
+
+
+/* Arrays in the constant pool are built once per execution, as they are
+ * immutable. Tables can be changed, so they are built every time they are
+ * used. */
+void ZoeVM::LoadConstants(BytecodeView const& b, vector<ZBox> const& strings)
+{
+    _constants.assign(b.ConstantCount(), ZBox());
+    for(uint32_t i = 0; i < b.ConstantCount(); ++i) {
+        if(b.GetConstant(i).shared) {
+            _constants[i] = Constant(b, i, strings);
+        }
+    }
+}
+
 
+ZBox ZoeVM::Constant(BytecodeView const& b, uint32_t idx, vector<ZBox> const& strings)
+{
+    if(!_constants[idx].IsNil()) {
+        return _constants[idx];
+    }
+
+    // run the code of the constant (validated by the view) in a stack of its own
+    BytecodeView::Constant const& c = b.GetConstant(idx);
+    vector<ZBox> st;
+    for(uint8_t const* p = c.code; p != c.code + c.size; p += opcode_size(*p)) {
+        switch(*p) {
+            case PNIL: st.emplace_back(); break;
+            case PBF:  st.emplace_back(false); break;
+            case PBT:  st.emplace_back(true); break;
+            case PN8:  st.emplace_back(static_cast<double>(p[1])); break;
+            case PNUM: st.emplace_back(Operand<double>(p + 1)); break;
+            case PSTR: st.push_back(strings[Operand<uint32_t>(p + 1)]); break;
+            case PARY:
+            case PTBL:
             case PTBX: {
-                    uint16_t n = b.GetCode<uint16_t>(p+1);
-                    auto tbl = make_shared<ZTable>(end(_stack)-(n*2)-1, end(_stack), true);
-                    Pop(static_cast<uint16_t>(n*2+1));
-                    Push(tbl);
+                    uint16_t n = Operand<uint16_t>(p + 1);
+                    size_t count = (*p == PARY) ? n : (*p == PTBL) ? n * 3U + 1 : n * 2U + 1;
+                    ZBox* items = st.data() + st.size() - count;
+                    ZBox value = (*p == PARY) ? _heap.Make<ZArray>(items, items + count)
+                                              : _heap.Make<ZTable>(items, items + count, *p == PTBX, _shapes.get());
+                    st.resize(st.size() - count);
+                    st.push_back(value);
                 }
                 break;
+            default:
+                throw zoe_internal_error("Invalid instruction in constant.");
+        }
+    }
+    return st.back();
+}
 
-            case PFUN:
-                Push(make_shared<ZFunctionPointer>(Pop<ZNumber>()->Value(), b.GetCode<uint8_t>(p+1)));
-                break;
 
-            case POP:
-                Pop();
+/* Register backend. The values of the previous code that are discarded are
+ * popped first. The frame is allocated once, so pointers to registers stay
+ * valid during execution. At the end, the variables and the values left
+ * by the code are moved to the variables and the stack, just like the stack
+ * VM would leave them. */
+void ZoeVM::ExecuteRegisters(RegisterCode const& rc, BytecodeView const& b)
+{
+    vector<ZBox> strings = InternStrings(b);
+    LoadConstants(b, strings);
+    Pop(static_cast<uint16_t>(rc.Pops()));
+    _frame.assign(rc.Registers(), ZBox());
+    ZBox* r = _frame.data();
+    vector<ZInlineCache> caches(rc.InlineCaches());
+
+    for(RegInstruction const& i: rc.Code()) {
+        switch(i.op) {
+            case RNIL:
+                r[i.a] = ZBox();
                 break;
-
-            case SET:
-                GetCopy(-3)->OpSet(GetCopy(-2), GetCopy(-1), b.GetCode<TableConfig>(p+1));
-                Remove(-3);
-                Remove(-2);
+            case RBOOL:
+                r[i.a] = ZBox(i.x != 0);
                 break;
-
-            case GET:
-                Push(GetPtr(-2)->OpGet(GetCopy(-1)));
-                Remove(-3);
-                Remove(-2);
+            case RNUM:
+                r[i.a] = ZBox(rc.Numbers()[i.x]);
                 break;
-
-            case CVAR: 
-                _vars.push_back(GetCopy());
+            case RSTR:
+                r[i.a] = strings[i.x];
                 break;
-
-            case CMVAR:
-                CreateVariables(b.GetCode<uint16_t>(p+1));
+            case RMOVE:
+                r[i.a] = r[i.b];
                 break;
-
-            case GVAR: {
-                    uint32_t n = b.GetCode<uint32_t>(p+1);
-                    if(n >= _vars.size()) {
-                        throw zoe_internal_error("Variable stack overflow.");
-                    }
-                    Push(_vars[n]);
+            case RCON:
+                r[i.a] = Constant(b, i.x, strings);
+                if(_heap.NeedsCollection()) {
+                    Collect();
                 }
                 break;
-
-            case SVAR: {
-                    uint32_t n = b.GetCode<uint32_t>(p+1);
-                    if(n >= _vars.size()) {
-                        throw zoe_internal_error("Variable stack overflow.");
-                    }
-                    _vars[n] = GetCopy();
+            case RARY:
+                r[i.a] = _heap.Make<ZArray>(r + i.b, r + i.b + i.x);
+                if(_heap.NeedsCollection()) {
+                    Collect();
                 }
                 break;
-
-            case PSHS:
-                _scopes.push_back(static_cast<uint32_t>(_vars.size()));
+            case RTBL:
+                r[i.a] = _heap.Make<ZTable>(r + i.b, r + i.b + i.x, i.flags != 0, _shapes.get());
+                if(_heap.NeedsCollection()) {
+                    Collect();
+                }
                 break;
-
-            case POPS: {
-                    uint32_t last = _scopes.back();
-                    _scopes.pop_back();
-                    assert(!_scopes.empty());
-                    _vars.erase(begin(_vars) + last, end(_vars));
+            case RGET:
+            case RGETK: {
+                    ZBox const& key = (i.op == RGETK) ? strings[i.x] : r[i.c];
+                    ZBox const* cached = caches[i.ic].Get(r[i.b], key);
+                    if(cached) {
+                        ++_ic_stats.hits;
+                        r[i.a] = *cached;
+                    } else {
+                        ++_ic_stats.misses;
+                        ZBox value = r[i.b].OpGet(key);
+                        caches[i.ic].LearnGet(r[i.b], key);
+                        r[i.a] = value;
+                    }
                 }
                 break;
-
-            case JMP:
-                p = b.GetCode<uint64_t>(p+1);
-                goto skip_advance_pc;
-
-            case CALL: {
-                    _call_stack.push_back(p+3);
-                    auto func = Pop<ZFunction>();
-                    if(func->FunctionType() == POINTER) {
-                        p = static_pointer_cast<ZFunctionPointer>(func)->Value();
+            case RSET:
+            case RSETK: {
+                    ZBox const& key = (i.op == RSETK) ? strings[i.x] : r[i.b];
+                    TableConfig tc = static_cast<TableConfig>(i.flags);
+                    if(caches[i.ic].Set(r[i.a], key, r[i.c], tc)) {
+                        ++_ic_stats.hits;
                     } else {
-                        abort();
+                        ++_ic_stats.misses;
+                        r[i.a].OpSet(key, r[i.c], tc);
+                        caches[i.ic].LearnSet(r[i.a], key, tc);
                     }
                 }
-                goto skip_advance_pc;
-
-            case RET:
-                if(_call_stack.empty()) {
-                    throw zoe_internal_error("Call stack undeflow.");
+                break;
+            case RUNPK: {
+                    if(r[i.b].Type() != ARRAY) {
+                        throw zoe_runtime_error("Invalid type: expected " + Typename(ARRAY) + ", found " + Typename(r[i.b].Type()));
+                    }
+                    vector<ZBox> const& items = r[i.b].Ptr<ZArray>()->Value();
+                    if(items.size() != i.x) {
+                        throw zoe_runtime_error("Number of declared variables (" + to_string(items.size()) +
+                                ") and array elements (" + to_string(i.x) + ")");
+                    }
+                    for(size_t k = 0; k < i.x; ++k) {
+                        r[i.a + k] = items[i.x - k - 1];
+                    }
                 }
-                p = _call_stack.back();
-                _call_stack.pop_back();
-                goto skip_advance_pc;
+                break;
+        }
+    }
 
-            default:
-                throw domain_error("Invalid opcode " + to_string(b.GetCode<uint8_t>(p)));
+    _vars.assign(r, r + rc.Variables());
+    for(uint16_t k = 0; k < rc.Results(); ++k) {
+        Push(r[rc.TempBase() + k]);
+    }
+    _frame.clear();
+}
+
+
+string ZoeVM::TraceInstruction(BytecodeView const& b, size_t pos) const
+{
+    return ZTraceBuffer::FormatInstruction(pos, b.DisassembleOpcode(pos));
+}
+
+
+void ZoeVM::TraceStack(string const& instruction) const
+{
+    stringstream debug;
+    debug << instruction << "< ";
+    for(size_t i=0; i<_sp; ++i) {
+        if(i != 0) {
+            debug << ", ";
         }
+        debug << _stack[i].Inspect();
+    }
+    debug << " >\n";
+    cout << debug.str();
+}
 
-        p += Bytecode::OpcodeSize(b.GetCode<Opcode>(p));
-skip_advance_pc:
+// }}}
 
-        if(Tracer) {
-            debug << "< ";
-            for(size_t i=0; i<_stack.size(); ++i) {
-                if(i != 0) {
-                    debug << ", ";
-                }
-                debug << _stack[i]->Inspect();
-            }
-            debug << " >\n";
-            cout << debug.str();
+// {{{ FUNCTIONS
+
+uint64_t ZoeVM::FunctionAddress(ZBox const& func, uint8_t nargs) const
+{
+    if(func.Type() != FUNCTION) {
+        throw zoe_runtime_error("Invalid type: expected function, found " + Typename(func.Type()));
+    }
+    ZFunctionPointer const* f = func.Ptr<ZFunctionPointer>();
+    if(f->NArgs() != nargs) {
+        throw zoe_runtime_error("Function expects " + to_string(f->NArgs()) + " argument(s), but " + 
+                to_string(nargs) + " were given.");
+    }
+    if(!_chunk || !_chunk->IsFunction(f->Value())) {       // created by another code (a previous execution)
+        throw zoe_runtime_error("Function was created by another code, and can't be called.");
+    }
+    return f->Value();
+}
+
+
+/* Calls `func` with the `nargs` values at the top of the stack, that are moved
+ * to the variables of the new frame. The `below` values under them (the
+ * function itself, for CALL) are also removed. Returns the address of the
+ * function. */
+uint64_t ZoeVM::CallFunction(ZBox const& func, uint8_t nargs, uint8_t below, uint64_t ret)
+{
+    uint64_t addr = FunctionAddress(func, nargs);
+    if(_call_stack.size() == _stack.size()) {
+        throw zoe_runtime_error("Call stack overflow (maximum of " + to_string(_stack.size()) + " calls).");
+    }
+    _closure = (func.Ptr<ZFunction>()->FunctionType() == CLOSURE) ? func.Ptr<ZClosure>() : nullptr;
+    ZBox* args = StackTop(nargs);       // (`func` might be a variable, that is invalidated from now on)
+    size_t vars = _vars.size();
+    _vars.insert(end(_vars), args, args + nargs);
+    _sp -= static_cast<size_t>(nargs + below);
+    _call_stack.push_back({ ret, _sp, vars, _scopes.size(), nargs, _closure });
+    _fp = vars;
+    return addr;
+}
+
+
+/* The frame of the current function is reused by the function called: its
+ * variables, scopes and values in the stack are discarded, and the function
+ * called returns directly to the caller. */
+uint64_t ZoeVM::TailCall(ZBox const& func, uint8_t nargs)
+{
+    if(_call_stack.empty()) {
+        throw zoe_internal_error("Tail call outside of a function.");
+    }
+    uint64_t addr = FunctionAddress(func, nargs);
+    Frame& frame = _call_stack.back();
+    ZBox* args = StackTop(nargs);
+    _closure = frame.closure = (func.Ptr<ZFunction>()->FunctionType() == CLOSURE) ? func.Ptr<ZClosure>() : nullptr;
+    CloseUpvalues(frame.vars);
+    _vars.erase(begin(_vars) + static_cast<ssize_t>(frame.vars), end(_vars));
+    _vars.insert(end(_vars), args, args + nargs);
+    _scopes.resize(frame.scopes);
+    _sp = frame.base;
+    frame.nargs = nargs;
+    return addr;
+}
+
+
+// the value at the top of the stack is the return value
+uint64_t ZoeVM::Return()
+{
+    if(_call_stack.empty()) {
+        throw zoe_internal_error("Call stack undeflow.");
+    }
+    Frame const& frame = _call_stack.back();
+    if(_sp <= frame.base) {
+        throw zoe_internal_error("Function without a return value.");
+    }
+    _stack[frame.base] = _stack[_sp - 1];
+    _sp = frame.base + 1;
+    CloseUpvalues(frame.vars);
+    _vars.erase(begin(_vars) + static_cast<ssize_t>(frame.vars), end(_vars));
+    _scopes.resize(frame.scopes);
+    uint64_t addr = frame.ret;
+    _call_stack.pop_back();
+    _fp = _call_stack.empty() ? 0 : _call_stack.back().vars;
+    _closure = _call_stack.empty() ? nullptr : _call_stack.back().closure;
+    if(addr == COROUTINE_END) {
+        return FinishCoroutine();
+    }
+    return addr;
+}
+
+
+// after an error, the variables of the functions that were running are discarded
+void ZoeVM::UnwindFrames()
+{
+    if(!_call_stack.empty()) {
+        Frame const& frame = _call_stack.front();
+        CloseUpvalues(frame.vars);
+        _vars.erase(begin(_vars) + static_cast<ssize_t>(frame.vars), end(_vars));
+        _scopes.resize(frame.scopes);
+        _call_stack.clear();
+        _fp = 0;
+        _closure = nullptr;
+    }
+}
+
+// }}}
+
+// {{{ CLOSURES
+
+ZBox& ZoeVM::Upvalue(uint32_t n)
+{
+    if(!_closure) {
+        throw zoe_internal_error("Upvalue outside of a closure.");
+    }
+    ZUpvalue* upvalue = _closure->Upvalue(n);
+    if(!upvalue->IsOpen()) {
+        return upvalue->Value();
+    }
+    vector<ZBox>& vars = ContextVars(upvalue->Owner());
+    if(upvalue->Var() >= vars.size()) {
+        throw zoe_internal_error("Variable stack overflow.");
+    }
+    return vars[upvalue->Var()];
+}
+
+
+// the upvalue of a variable: closures that capture the same variable share it
+ZBox ZoeVM::Capture(size_t var)
+{
+    auto it = end(_open_upvalues);
+    while(it != begin(_open_upvalues) && (*(it - 1))->Var() >= var) {
+        --it;
+        if((*it)->Var() == var) {
+            return ZBox(*it);
         }
     }
-#pragma GCC diagnostic pop
+    ZBox upvalue = _heap.Make<ZUpvalue>(var, _coroutines.empty() ? nullptr : _coroutines.back());
+    _open_upvalues.insert(it, upvalue.Ptr<ZUpvalue>());
+    return upvalue;
+}
+
+
+void ZoeVM::CloseUpvalues(size_t from)
+{
+    while(!_open_upvalues.empty() && _open_upvalues.back()->Var() >= from) {
+        ZUpvalue* upvalue = _open_upvalues.back();
+        upvalue->Close(_vars[upvalue->Var()]);
+        _open_upvalues.pop_back();
+    }
+}
+
+// }}}
+
+// {{{ COROUTINES
+
+/* Switches to the context of the coroutine at the top of the stack (where it
+ * stays until it yields). The first time, its function is called; otherwise,
+ * it continues after the YIELD where it stopped, that gets nil as its value. */
+uint64_t ZoeVM::Resume(uint64_t ret)
+{
+    ZBox const& value = Get();
+    if(value.Type() != COROUTINE) {
+        throw zoe_runtime_error("Invalid type: expected coroutine, found " + Typename(value.Type()));
+    }
+    ZCoroutine* co = value.Ptr<ZCoroutine>();
+    if(co->_state != ZCoroutine::SUSPENDED) {
+        throw zoe_runtime_error(string("Cannot resume a ") + ((co->_state == ZCoroutine::RUNNING) ? "running" : "dead") + " coroutine.");
+    }
+    if(co->_execution != _executions) {
+        throw zoe_runtime_error("Cannot resume a coroutine created by another code.");
+    }
+    if(_coroutines.size() >= _stack.size()) {
+        throw zoe_runtime_error("Coroutine overflow (maximum of " + to_string(_stack.size()) + " nested coroutines).");
+    }
+    co->_ret = ret;
+    co->_state = ZCoroutine::RUNNING;
+    EnterCoroutine(co);
+    if(!co->_started) {
+        co->_started = true;
+        return CallFunction(co->_func, 0, 0, COROUTINE_END);
+    }
+    Push(nullptr);
+    return co->_ip;
+}
+
+
+// the value at the top of the stack is passed to the code that resumed the coroutine
+uint64_t ZoeVM::Yield(uint64_t ret)
+{
+    if(_coroutines.empty()) {
+        throw zoe_runtime_error("Yield outside of a coroutine.");
+    }
+    ZBox value = Pop();
+    ZCoroutine* co = LeaveCoroutine();
+    co->_ip = ret;
+    co->_state = ZCoroutine::SUSPENDED;
+    _stack[_sp - 1] = value;       // replaces the coroutine
+    return co->_ret;
+}
+
+
+// the function of the coroutine returned: its value is passed to the code that resumed it
+uint64_t ZoeVM::FinishCoroutine()
+{
+    ZBox value = Pop();
+    ZCoroutine* co = LeaveCoroutine();
+    co->_state = ZCoroutine::DEAD;
+    co->_ctx = Context {};      // the stack is not needed anymore
+    _stack[_sp - 1] = value;       // replaces the coroutine
+    return co->_ret;
+}
+
+
+// the contexts are swapped: only the pointers to the stacks change hands
+void ZoeVM::SwitchContext(Context& ctx)
+{
+    swap(_stack, ctx.stack);
+    swap(_sp, ctx.sp);
+    swap(_vars, ctx.vars);
+    swap(_scopes, ctx.scopes);
+    swap(_call_stack, ctx.call_stack);
+    swap(_fp, ctx.fp);
+    swap(_closure, ctx.closure);
+    swap(_open_upvalues, ctx.open_upvalues);
+}
+
+
+void ZoeVM::EnterCoroutine(ZCoroutine* co)
+{
+    SwitchContext(co->_ctx);
+    _coroutines.push_back(co);
+    _globals = &_coroutines.front()->_ctx.vars;
+}
+
+
+ZCoroutine* ZoeVM::LeaveCoroutine()
+{
+    ZCoroutine* co = _coroutines.back();
+    _coroutines.pop_back();
+    SwitchContext(co->_ctx);
+    _globals = _coroutines.empty() ? &_vars : &_coroutines.front()->_ctx.vars;
+    return co;
+}
+
+
+// after an error, the coroutines that were running are dead
+void ZoeVM::UnwindCoroutines()
+{
+    while(!_coroutines.empty()) {
+        UnwindFrames();
+        ZCoroutine* co = LeaveCoroutine();
+        co->_state = ZCoroutine::DEAD;
+        co->_ctx = Context {};
+    }
+}
+
+
+/* The variables of a context are in the VM while it runs. Otherwise, they
+ * are in the coroutine, when suspended, or in the coroutine it resumed. */
+vector<ZBox>& ZoeVM::ContextVars(ZCoroutine* owner)
+{
+    if(owner == (_coroutines.empty() ? nullptr : _coroutines.back())) {
+        return _vars;
+    } else if(!owner) {
+        return *_globals;
+    }
+    auto it = find(begin(_coroutines), end(_coroutines), owner);
+    return (it == end(_coroutines)) ? owner->_ctx.vars : (*(it + 1))->_ctx.vars;
 }
 
 // }}}
 
 // {{{ VARIABLES
 
+
 void ZoeVM::CreateVariables(uint16_t n)
 {
     ZArray const* ary = GetPtr<ZArray>();
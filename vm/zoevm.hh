@@ -3,48 +3,83 @@
 
 #include <cstdint>
 #include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 using namespace std;
 
-#include "vm/zvalue.hh"
+#include "vm/exceptions.hh"
+#include "vm/opcode.hh"
+#include "vm/zbox.hh"
+#include "vm/zheap.hh"
+#include "vm/zjit.hh"
+#include "vm/zstringtable.hh"
 #include "vm/ztable.hh"
 
+// instructions that don't change the flow of the code (see ZoeVM::Instruction)
+#define SHARED_OPCODES                                                                  \
+    X(NOP) X(PNIL) X(PBT) X(PBF) X(PN8) X(PNUM) X(PSTR) X(PCON) X(PARY) X(PTBL) X(PTBX)  \
+    X(PFUN) X(POP) X(SET) X(GET) X(GETF) X(CVAR) X(CVN8) X(CMVAR) X(GVAR) X(SVAR)       \
+    X(GLOC) X(SLOC) X(GUPV) X(SUPV) X(CAPL) X(CAPU) X(PCLO) X(CLOSE) X(PCOR) X(PSHS) X(POPS) X(UNM) X(ADD) X(SUB) X(MUL) X(DIV) X(IDIV) X(MOD) X(POW) X(SHL)     \
+    X(SHR) X(BNOT) X(AND) X(OR) X(XOR) X(NOT) X(EQ) X(LT) X(LTE)                        \
+    X(ADD_NN) X(SUB_NN) X(MUL_NN) X(DIV_NN) X(LT_NN) X(LTE_NN) X(GET_STR)
+
 class ZoeVM {
 public:
-    ZoeVM();
+    explicit ZoeVM(size_t max_stack=DEFAULT_MAX_STACK);    // max_stack: maximum number of values in the stack (and of nested calls)
+    ~ZoeVM();
+
+    static constexpr size_t DEFAULT_MAX_STACK = 16 * 1024;
+
+    ZoeVM(ZoeVM const&) = delete;
+    ZoeVM& operator=(ZoeVM const&) = delete;
 
     // 
     // stack management
     //
-    ssize_t            StackAbs(ssize_t pos) const;
-    ssize_t            StackSize() const;
-    ZValue const&      Push(shared_ptr<ZValue> value);
-    ZType              GetType(ssize_t pos=-1) const;
-    shared_ptr<ZValue> Pop();
-    void               Pop(uint16_t n);
-    void               Remove(ssize_t pos);
-    ZValue const*      GetPtr(ssize_t pos=-1) const;
-    shared_ptr<ZValue> GetCopy(ssize_t pos=-1) const;
-    // {{{ stack templates: Pop<T>(), GetPtr<T>(), GetCopy<T>(), T CopyCppValue()
-    template<typename T> shared_ptr<T> Pop() {
-        auto ptr = Pop();
-        ValidateType<T>(ptr->Type());
-        return static_pointer_cast<T>(ptr);
+    ssize_t       StackAbs(ssize_t pos) const {
+        ssize_t i = (pos >= 0) ? pos : StackSize() + pos;
+        if(i < 0) {
+            throw zoe_internal_error("Stack underflow");
+        }
+        return i;
     }
-
+    ssize_t       StackSize() const { return static_cast<ssize_t>(_sp); }
+    ZBox const&   Push(ZBox const& value) {
+        if(_sp == _stack.size()) {
+            StackOverflow();
+        }
+        _stack[_sp] = value;
+        return _stack[_sp++];
+    }
+    ZType         GetType(ssize_t pos=-1) const;
+    ZBox          Pop() {
+        if(_sp == 0) {
+            throw underflow_error("Stack underflow");
+        }
+        return _stack[--_sp];
+    }
+    void          Pop(uint16_t n);
+    void          Remove(ssize_t pos);
+    ZBox const&   Get(ssize_t pos=-1) const {
+        ssize_t i = StackAbs(pos);
+        if(i >= StackSize()) {
+            throw out_of_range("Stack access out of range");
+        }
+        return _stack[static_cast<size_t>(i)];
+    }
+    // {{{ stack templates: GetPtr<T>(), T CopyCppValue()
     template<typename T> T const* GetPtr(ssize_t pos=-1) const {
-        ZValue const* ptr = GetPtr(pos);
-        ValidateType<T>(ptr->Type());
-        return static_cast<T const*>(ptr);
+        ZBox const& box = Get(pos);
+        ValidateType<T>(box.Type());
+        return box.Ptr<T>();
     }
 
-    template<typename T> shared_ptr<T> GetCopy(ssize_t pos=-1) const {
-        auto ptr = GetCopy(pos);
-        ValidateType<T>(ptr->Type());
-        return static_pointer_cast<T>(ptr);
+    template<typename T> typename enable_if<is_arithmetic<T>::value, T>::type CopyCppValue(ssize_t pos=-1) const {
+        return Get(pos).Value<T>();
     }
 
-    template<typename T> T CopyCppValue(ssize_t pos=-1) const {
+    template<typename T> typename enable_if<!is_arithmetic<T>::value, T>::type CopyCppValue(ssize_t pos=-1) const {
         auto ptr = GetPtr<typename cpp_type<T>::type>(pos);
         return static_cast<T>(ptr->Value());
     }
@@ -62,19 +97,204 @@ public:
     // code execution
     //
     void ExecuteBytecode(vector<uint8_t> const& bytecode);
+    void ExecuteBytecode(class BytecodeView const& bytecode);      // the view can be reused
+    void ExecuteChunk(shared_ptr<class CompiledChunk const> const& chunk);     // can be shared by many VMs (see compiler/compiledchunk.hh)
+
+    // What an execution learns about the code (the quickened instructions,
+    // the inline caches, the functions compiled by the JIT) is kept by the VM
+    // while it executes the same chunk again, so running a script many times
+    // in the same VM only pays for it once. ExecuteBytecode (and
+    // ExecuteNative) prepare a new chunk each time, and keep nothing.
+
+    // code compiled ahead of time to C++ (see compiler/ccode.hh): a function
+    // that runs each instruction of the bytecode through the Native interface
+    class Native;
+    typedef void (*NativeCode)(Native& z);
+    void ExecuteNative(class BytecodeView const& bytecode, NativeCode code);
+
+    // 
+    // strings
+    //
+    ZBox Intern(string const& str) { return _strings.Intern(str); }
+
+    // 
+    // memory
+    //
+    ZHeap& Heap() { return _heap; }
+    size_t Collect();           // returns the number of values freed
+
+    ZHeap::Counters const& LastAllocations() const { return _last_allocations; }   // during the last ExecuteBytecode
+
+    // 
+    // inline caches (GET/SET)
+    //
+    struct InlineCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+    InlineCacheStats const& ICStats() const { return _ic_stats; }
 
     // 
     // debugging
     //
-    bool Tracer = false;
+    bool            Tracer = false;
+    class ZProfile* Profiler = nullptr;     // when set, counts the opcodes executed (see vm/zprofile.hh)
+    class ZTraceBuffer* TraceBuffer = nullptr;  // when set, records the last instructions executed (see vm/ztracebuffer.hh)
+
+    // 
+    // backend: when set, code is translated to registers (see compiler/registercode.hh)
+    // before running. Code that can't be translated runs in the stack VM.
+    //
+    bool RegisterBackend = false;
+
+    // 
+    // coroutines (see vm/zcoroutine.hh)
+    //
+    static constexpr size_t COROUTINE_STACK = 1024;     // values in the stack of each coroutine (and nested calls, and coroutines resumed)
+
+    /* Each call gets a frame. The arguments are moved from the stack to the
+     * variables, where they are followed by the locals of the function: GLOC
+     * and SLOC address them relative to the frame (_fp). Global variables
+     * are addressed from the start (GVAR/SVAR), and the variables captured
+     * from the enclosing functions through the upvalues of the closure
+     * (GUPV/SUPV). */
+    struct Frame {
+        uint64_t              ret;        // return address
+        size_t                base;       // stack size when the function was called (without the function and its arguments)
+        size_t                vars;       // first variable of the frame
+        size_t                scopes;     // number of scopes when the function was called
+        uint8_t               nargs;      // number of arguments
+        class ZClosure const* closure;    // nullptr if the function is not a closure
+    };
+
+    /* The state of the execution that is switched when a coroutine is
+     * resumed or yields: each coroutine keeps its own. The globals stay in
+     * the variables of the main context. */
+    struct Context {
+        vector<ZBox>            stack;
+        size_t                  sp;
+        vector<ZBox>            vars;
+        vector<uint32_t>        scopes;
+        vector<Frame>           call_stack;
+        size_t                  fp;
+        class ZClosure const*   closure;
+        vector<class ZUpvalue*> open_upvalues;
+    };
+
+    // 
+    // JIT: functions called `threshold` times are compiled to machine code
+    // (see vm/zjit.hh). Not used when tracing or profiling. Returns false if
+    // the platform is not supported.
+    //
+    bool        EnableJit(uint32_t threshold=ZJit::DEFAULT_THRESHOLD, bool perf_map=false);
+    ZJit const* Jit() const { return _jit.get(); }
 
 private:
-    void CreateVariables(uint16_t n);
+    friend class ZSnapshot;
+    struct ExecState;
+    void ExecuteCode(shared_ptr<class CompiledChunk const> const& chunk, NativeCode native, bool keep_state);
+    ExecState& State(shared_ptr<class CompiledChunk const> const& chunk);
+    template<bool TRACE, bool RECORD> void Execute(ExecState& st);     // RECORD: in the trace buffer
+    void RunNative(ExecState& st, NativeCode native);
+    template<Opcode OP> void Instruction(ExecState& st, uint8_t const* ip);
+    template<Opcode OP> static bool JitInstruction(void* ctx, uint8_t const* ip);
+    template<Opcode OP, Opcode QUICK> void Arithmetic(ExecState& st, uint8_t const* ip);
+    template<Opcode OP> void Quickened(ExecState& st, uint8_t const* ip);
+    uint64_t EnterJit(ExecState& st, uint64_t addr);
+    void ExecuteRegisters(class RegisterCode const& rc, class BytecodeView const& b);
+    vector<ZBox> InternStrings(class BytecodeView const& b);
+    void LoadConstants(class BytecodeView const& b, vector<ZBox> const& strings);
+    ZBox Constant(class BytecodeView const& b, uint32_t idx, vector<ZBox> const& strings);
+
+    string TraceInstruction(class BytecodeView const& b, size_t pos) const;
+    void   TraceStack(string const& instruction) const;
+
+    void     CreateVariables(uint16_t n);
+    ZBox&    Variable(uint32_t n) {                 // globals
+        if(n >= _globals->size()) {
+            throw zoe_internal_error("Variable stack overflow.");
+        }
+        return (*_globals)[n];
+    }
+    ZBox&    Local(uint32_t n) {
+        if(_fp + n >= _vars.size()) {
+            throw zoe_internal_error("Variable stack overflow.");
+        }
+        return _vars[_fp + n];
+    }
 
-    vector<shared_ptr<ZValue>> _stack = {};
-    vector<shared_ptr<ZValue>> _vars = {};
+    // functions
+    uint64_t FunctionAddress(ZBox const& func, uint8_t nargs) const;
+    uint64_t CallFunction(ZBox const& func, uint8_t nargs, uint8_t below, uint64_t ret);
+    uint64_t TailCall(ZBox const& func, uint8_t nargs);
+    uint64_t Return();
+    void     UnwindFrames();
+
+    // closures
+    ZBox&    Upvalue(uint32_t n);
+    ZBox     Capture(size_t var);
+    void     CloseUpvalues(size_t from);     // closes the upvalues of the variables from `from` on
+
+    // coroutines
+    uint64_t Resume(uint64_t ret);           // the coroutine is at the top of the stack
+    uint64_t Yield(uint64_t ret);
+    uint64_t FinishCoroutine();
+    void     SwitchContext(Context& ctx);
+    void     EnterCoroutine(class ZCoroutine* co);
+    class ZCoroutine* LeaveCoroutine();
+    void     UnwindCoroutines();
+    vector<ZBox>& ContextVars(class ZCoroutine* owner);     // variables of a context, wherever they are now
+
+    ZBox* StackTop(size_t n);                   // pointer to the last n values in the stack
+    [[noreturn]] void StackOverflow() const;
+
+    ZHeap              _heap = {};
+    ZStringTable       _strings { _heap };
+    unique_ptr<ZShape> _shapes;           // root of the shape tree of tables created by this VM
+    vector<ZBox>     _stack;            // preallocated, never resized
+    size_t           _sp = 0;           // number of values in the stack
+    vector<ZBox>     _vars = {};
+    vector<ZBox>     _frame = {};       // registers, when using the register backend
+    vector<ZBox>     _constants = {};   // constant pool of the code being executed (nil: built by each PCON)
     vector<uint32_t> _scopes = { 0 };
-    vector<uint64_t> _call_stack = {};
+    vector<Frame>    _call_stack = {};
+    size_t           _fp = 0;           // first variable of the current frame
+    class ZClosure const*   _closure = nullptr;         // closure being executed
+    vector<class ZUpvalue*> _open_upvalues = {};        // sorted by variable
+    vector<class ZCoroutine*> _coroutines = {};         // running: each one was resumed by the previous one
+    vector<ZBox>*    _globals = &_vars;                 // variables of the main context
+    uint64_t         _executions = 0;                   // coroutines can only be resumed by the code that created them
+    class CompiledChunk const* _chunk = nullptr;        // being executed (functions can only be called by the code that created them)
+    InlineCacheStats _ic_stats = {};
+    ZHeap::Counters  _last_allocations = {};
+    unique_ptr<ZJit> _jit = nullptr;
+    unique_ptr<ExecState> _state;       // of the last code executed
+};
+
+
+/* Interface used by the code generated by `zoe --emit-c`. The instructions
+ * that change the flow of the code are implemented by the generated code
+ * (with gotos), with the help of Call and Return. `ip` is the position of
+ * the instruction in the bytecode (for its operands). */
+class ZoeVM::Native {
+public:
+    Native(ZoeVM& vm, ExecState& st) : _vm(vm), _st(st) {}
+
+    ZoeVM&         VM() { return _vm; }
+    uint8_t const* Code() const;
+
+    template<Opcode OP> void Step(uint8_t const* ip);     // one of SHARED_OPCODES
+
+    uint64_t Call(uint8_t nargs, uint64_t ret);             // returns the address of the function (below the arguments)
+    uint64_t CallVariable(uint32_t n, uint8_t nargs, uint64_t ret);
+    uint64_t TailCall(uint8_t nargs);
+    uint64_t Return();                                      // returns the return address
+    uint64_t Resume(uint64_t ret);                          // returns the address where the coroutine continues
+    uint64_t Yield(uint64_t ret);                           // returns the address where the resumer continues
+
+private:
+    ZoeVM&     _vm;
+    ExecState& _st;
 };
 
 #endif
@@ -0,0 +1,82 @@
+#include "vm/zprofile.hh"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+uint64_t ZProfile::Count(vector<Opcode> const& sequence) const
+{
+    uint32_t key = 0;
+    for(Opcode op: sequence) {
+        key = (key << 8) | op;
+    }
+    switch(sequence.size()) {
+        case 1:
+            return _count[key];
+        case 2:
+        case 3: {
+                auto it = _sequences[sequence.size() - 2].find(key);
+                return (it == _sequences[sequence.size() - 2].end()) ? 0 : it->second;
+            }
+        default:
+            return 0;
+    }
+}
+
+
+vector<ZProfile::Sequence> ZProfile::Top(size_t length, size_t n) const
+{
+    vector<Sequence> top;
+    auto add = [&](uint32_t key, uint64_t count) {
+        Sequence seq = { {}, count };
+        for(size_t i = length; i > 0; --i) {
+            seq.opcodes.push_back(static_cast<Opcode>((key >> ((i - 1) * 8)) & 0xFF));
+        }
+        top.push_back(seq);
+    };
+
+    if(length == 1) {
+        for(uint32_t op = 0; op < opcode_count; ++op) {
+            if(_count[op]) {
+                add(op, _count[op]);
+            }
+        }
+    } else if(length == 2 || length == 3) {
+        for(auto const& kv: _sequences[length - 2]) {
+            add(kv.first, kv.second);
+        }
+    }
+
+    sort(begin(top), end(top), [](Sequence const& a, Sequence const& b) {
+        return a.count != b.count ? a.count > b.count : a.opcodes < b.opcodes;
+    });
+    if(top.size() > n) {
+        top.resize(n);
+    }
+    return top;
+}
+
+
+string ZProfile::Report(size_t n) const
+{
+    static const char* titles[] = { "opcodes", "pairs", "triples" };
+
+    stringstream ss;
+    ss << "instructions executed: " << _instructions << "\n";
+    for(size_t length = 1; length <= 3; ++length) {
+        ss << "most frequent " << titles[length - 1] << ":\n";
+        for(Sequence const& seq: Top(length, n)) {
+            double pct = _instructions ? 100.0 * static_cast<double>(seq.count) / static_cast<double>(_instructions) : 0;
+            ss << setw(12) << seq.count << "  " << fixed << setprecision(1) << setw(5) << pct << "%  ";
+            for(Opcode op: seq.opcodes) {
+                string name = opcode_names[op];
+                transform(begin(name), end(name), begin(name), ::tolower);
+                ss << " " << name;
+            }
+            ss << "\n";
+        }
+    }
+    return ss.str();
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,66 @@
+#ifndef VM_ZPROFILE_H_
+#define VM_ZPROFILE_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "vm/opcode.hh"
+
+// A ZProfile counts how many times each opcode, and each sequence of two and
+// three opcodes, was executed. It is used to choose the superinstructions
+// (see Bytecode::Optimize), and can be shared by many VMs and executions, to
+// profile a whole corpus of scripts:
+//
+//     ZProfile profile;
+//     Z.Profiler = &profile;
+//     Z.ExecuteBytecode(...);
+//     cerr << profile.Report();
+//
+// Only instructions that are next to each other in the code form a sequence:
+// a jump starts a new one.
+class ZProfile {
+public:
+    void Record(uint8_t const* ip) {
+        if(ip != _next) {
+            _len = 0;
+        }
+        _history = ((_history << 8) | *ip) & 0xFFFFFF;
+        if(_len < 3) {
+            ++_len;
+        }
+        ++_instructions;
+        ++_count[*ip];
+        if(_len >= 2) {
+            ++_sequences[0][_history & 0xFFFF];
+        }
+        if(_len == 3) {
+            ++_sequences[1][_history];
+        }
+        _next = ip + opcode_size(*ip);
+    }
+
+    uint64_t Instructions() const { return _instructions; }
+    uint64_t Count(vector<Opcode> const& sequence) const;       // 1 to 3 opcodes
+
+    struct Sequence {
+        vector<Opcode> opcodes = {};
+        uint64_t       count = 0;
+    };
+    vector<Sequence> Top(size_t length, size_t n) const;       // the n most frequent sequences of this length
+    string           Report(size_t n = 10) const;
+
+private:
+    uint64_t                           _instructions = 0;
+    uint64_t                           _count[256] = {};
+    unordered_map<uint32_t, uint64_t>  _sequences[2] = {};      // opcodes are packed in the key
+    uint8_t const*                     _next = nullptr;         // position of the instruction that follows the last one
+    uint32_t                           _history = 0;            // last opcodes
+    size_t                             _len = 0;                // number of opcodes in the history
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
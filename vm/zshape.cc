@@ -0,0 +1,68 @@
+#include "vm/zshape.hh"
+
+#include "vm/zheap.hh"
+
+constexpr size_t ZShape::MAX_KEYS, ZShape::MAX_TRANSITIONS;
+
+ZShape::ZShape(ZShape* parent)
+    : _root(parent ? parent->_root : this)
+{
+    if(parent) {
+        _props = parent->_props;
+    }
+}
+
+
+ptrdiff_t ZShape::Find(ZBox const& key) const
+{
+    // keys are interned strings most of the time, so the bits are compared first
+    for(size_t i = 0; i < _props.size(); ++i) {
+        if(_props[i].key.Bits() == key.Bits()) {
+            return static_cast<ptrdiff_t>(i);
+        }
+    }
+    if(!key.IsHeap() || key.Type() != STRING) {
+        return -1;
+    }
+    for(size_t i = 0; i < _props.size(); ++i) {
+        if(_props[i].key.OpEq(key)) {
+            return static_cast<ptrdiff_t>(i);
+        }
+    }
+    return -1;
+}
+
+
+ZShape* ZShape::Transition(ZBox const& key, TableConfig config)
+{
+    if(!key.IsHeap() || key.Type() != STRING || _props.size() >= MAX_KEYS) {
+        return nullptr;
+    }
+
+    for(auto const& t: _transitions) {
+        Property const& p = t->_props.back();
+        if(p.config == config && (p.key.Bits() == key.Bits() || p.key.OpEq(key))) {
+            return t.get();
+        }
+    }
+
+    if(_transitions.size() >= MAX_TRANSITIONS) {
+        return nullptr;
+    }
+    _transitions.emplace_back(new ZShape(this));
+    _transitions.back()->_props.push_back({ key, config });
+    return _transitions.back().get();
+}
+
+
+void ZShape::Trace(ZHeap& heap) const
+{
+    if(!_props.empty()) {
+        heap.Mark(_props.back().key);       // the other keys are marked by the ancestors
+    }
+    for(auto const& t: _transitions) {
+        t->Trace(heap);
+    }
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,59 @@
+#ifndef VM_ZSHAPE_H_
+#define VM_ZSHAPE_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+using namespace std;
+
+#include "vm/zbox.hh"
+#include "vm/opcode.hh"  // TODO - for TableConfig
+
+// A ZShape (also known as a hidden class) describes the layout of a table: the
+// sequence of keys it has, and the configuration of each one. Tables with the
+// same shape keep only their values, in a flat vector indexed by the position
+// of the key in the shape.
+//
+// Shapes form a transition tree: each shape knows the shapes created from it
+// by adding one more key, so tables created by the same code end up sharing
+// the same shape objects. The tree is owned by its root, which is owned by
+// the VM; its keys are marked by the VM on every garbage collection.
+//
+// Only string keys are kept in shapes. Tables with other keys, too many keys
+// or keys removed fall back to a dictionary (ZTableMap).
+class ZShape {
+public:
+    static unique_ptr<ZShape> NewRoot() { return unique_ptr<ZShape>(new ZShape(nullptr)); }
+
+    ZShape(ZShape const&) = delete;
+    ZShape& operator=(ZShape const&) = delete;
+
+    ZShape*     Root() { return _root; }
+    size_t      Count() const { return _props.size(); }
+    ZBox const& Key(size_t i) const { return _props[i].key; }
+    TableConfig Config(size_t i) const { return _props[i].config; }
+
+    ptrdiff_t Find(ZBox const& key) const;                    // -1 if not found
+    ZShape*   Transition(ZBox const& key, TableConfig config); // nullptr if a dictionary must be used
+
+    void Trace(class ZHeap& heap) const;         // mark the keys of this shape and its descendants
+
+    static constexpr size_t MAX_KEYS = 32;
+    static constexpr size_t MAX_TRANSITIONS = 64;
+
+private:
+    explicit ZShape(ZShape* parent);
+
+    struct Property {
+        ZBox        key;
+        TableConfig config;
+    };
+
+    ZShape*                   _root;
+    vector<Property>          _props = {};
+    vector<unique_ptr<ZShape>> _transitions = {};
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
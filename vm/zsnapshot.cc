@@ -0,0 +1,428 @@
+#include "vm/zsnapshot.hh"
+
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "vm/zarray.hh"
+#include "vm/zfunction.hh"
+#include "vm/zoevm.hh"
+#include "vm/zstring.hh"
+#include "vm/ztable.hh"
+
+static const uint8_t MAGIC[] { 0x5A, 0x53, 0x4E, 0x50, 0x01, 0x00, 0x00, 0x00 };   // "ZSNP", version 1
+
+// values in the image: scalars are written inline, heap values by their number
+enum : uint8_t { B_NIL, B_FALSE, B_TRUE, B_NUMBER, B_REF };
+
+namespace {
+
+class Writer {
+public:
+    template<typename T> void Put(T t) {
+        uint8_t const* p = reinterpret_cast<uint8_t const*>(&t);
+        data.insert(end(data), p, p + sizeof(T));
+    }
+
+    void PutBox(ZBox const& box, unordered_map<ZValue const*, uint32_t> const& numbers) {
+        switch(box.Type()) {
+            case NIL:    Put<uint8_t>(B_NIL); break;
+            case BOOL:   Put<uint8_t>(box.Bool() ? B_TRUE : B_FALSE); break;
+            case NUMBER: Put<uint8_t>(B_NUMBER); Put(box.Number()); break;
+            case STRING: case ARRAY: case TABLE: case FUNCTION: case COROUTINE: case UPVALUE:
+                Put<uint8_t>(B_REF);
+                Put(numbers.at(box.Ptr()));
+                break;
+        }
+    }
+
+    vector<uint8_t> data = {};
+};
+
+
+class Reader {
+public:
+    Reader(uint8_t const* data, size_t size) : _p(data), _end(data + size) {}
+
+    template<typename T> T Get() {
+        if(static_cast<size_t>(_end - _p) < sizeof(T)) {
+            Invalid();
+        }
+        T t;
+        memcpy(&t, _p, sizeof(T));
+        _p += sizeof(T);
+        return t;
+    }
+
+    uint8_t const* Skip(size_t n) {
+        if(static_cast<size_t>(_end - _p) < n) {
+            Invalid();
+        }
+        uint8_t const* p = _p;
+        _p += n;
+        return p;
+    }
+
+    // the value of a box; `values` are the heap values, nullptr if not created yet
+    ZBox GetBox(vector<ZValue*> const& values) {
+        switch(Get<uint8_t>()) {
+            case B_NIL:    return ZBox();
+            case B_FALSE:  return ZBox(false);
+            case B_TRUE:   return ZBox(true);
+            case B_NUMBER: return ZBox(Get<double>());
+            case B_REF: {
+                    uint32_t n = Get<uint32_t>();
+                    if(n >= values.size() || !values[n]) {
+                        Invalid();
+                    }
+                    return ZBox(values[n]);
+                }
+            default:
+                Invalid();
+        }
+    }
+
+    void SkipBox(size_t count) {
+        uint8_t tag = Get<uint8_t>();
+        if(tag == B_NUMBER) {
+            Skip(sizeof(double));
+        } else if(tag == B_REF) {
+            if(Get<uint32_t>() >= count) {
+                Invalid();
+            }
+        } else if(tag > B_REF) {
+            Invalid();
+        }
+    }
+
+    bool   AtEnd() const { return _p == _end; }
+    size_t Remaining() const { return static_cast<size_t>(_end - _p); }
+
+    [[noreturn]] static void Invalid() { throw runtime_error("Not a valid snapshot."); }
+
+private:
+    uint8_t const* _p;
+    uint8_t const* _end;
+};
+
+}
+
+// {{{ SAVE
+
+/* The values are numbered in post-order (the values referenced by a value
+ * come before it), so that strings, arrays and functions, that can't be
+ * changed once created, can be restored in the order of the image. Tables
+ * and upvalues can be part of cycles: they are created first, and filled at
+ * the end. */
+
+vector<uint8_t> ZSnapshot::Save(ZoeVM const& vm)
+{
+    // references of each heap value
+    auto children = [](ZValue const* v) {
+        vector<ZBox> refs;
+        switch(v->Type()) {
+            case ARRAY:
+                refs = static_cast<ZArray const*>(v)->Value();
+                break;
+            case TABLE: {
+                    ZTable const* t = static_cast<ZTable const*>(v);
+                    refs.push_back(t->Prototype());
+                    t->ForEach([&refs](ZBox const& key, ZBox const& value, TableConfig) {
+                        refs.push_back(key);
+                        refs.push_back(value);
+                    });
+                }
+                break;
+            case FUNCTION:
+                if(static_cast<ZFunction const*>(v)->FunctionType() == CLOSURE) {
+                    for(ZUpvalue* up: static_cast<ZClosure const*>(v)->Upvalues()) {
+                        refs.push_back(ZBox(up));
+                    }
+                }
+                break;
+            case UPVALUE: {
+                    ZUpvalue const* up = static_cast<ZUpvalue const*>(v);
+                    if(up->IsOpen()) {
+                        throw zoe_runtime_error("Variables captured by closures can't be saved in a snapshot.");
+                    }
+                    refs.push_back(up->Value());
+                }
+                break;
+            case COROUTINE:
+                throw zoe_runtime_error("Coroutines can't be saved in a snapshot.");
+            case NIL: case BOOL: case NUMBER: case STRING:
+                break;
+        }
+        return refs;
+    };
+
+    // number the values (iteratively, as the references can be very deep)
+    unordered_map<ZValue const*, uint32_t> numbers;
+    vector<ZValue const*> order;
+    struct Visit {
+        ZValue const* value;
+        vector<ZBox>  refs;
+        size_t        next;
+    };
+    vector<Visit> visiting;
+    auto visit = [&](ZBox const& box) {
+        if(box.IsHeap() && !numbers.count(box.Ptr())) {
+            numbers.emplace(box.Ptr(), UINT32_MAX);      // being visited
+            visiting.push_back({ box.Ptr(), children(box.Ptr()), 0 });
+        }
+    };
+    auto number = [&](ZBox const& root) {
+        visit(root);
+        while(!visiting.empty()) {
+            Visit& top = visiting.back();
+            if(top.next < top.refs.size()) {
+                ZBox ref = top.refs[top.next++];
+                visit(ref);                         // invalidates `top`
+            } else {
+                numbers[top.value] = static_cast<uint32_t>(order.size());
+                order.push_back(top.value);
+                visiting.pop_back();
+            }
+        }
+    };
+    for(size_t i = 0; i < vm._sp; ++i) {
+        number(vm._stack[i]);
+    }
+    for(ZBox const& var: vm._vars) {
+        number(var);
+    }
+
+    // write the image
+    Writer w;
+    for(uint8_t b: MAGIC) {
+        w.Put(b);
+    }
+    w.Put(static_cast<uint32_t>(order.size()));
+    for(ZValue const* v: order) {
+        w.Put(static_cast<uint8_t>(v->Type()));
+        switch(v->Type()) {
+            case STRING: {
+                    ZString const* s = static_cast<ZString const*>(v);
+                    w.Put<uint8_t>(s->Interned());
+                    w.Put(s->Hash());
+                    w.Put(static_cast<uint32_t>(s->Value().size()));
+                    w.data.insert(end(w.data), begin(s->Value()), end(s->Value()));
+                }
+                break;
+            case ARRAY: {
+                    vector<ZBox> const& items = static_cast<ZArray const*>(v)->Value();
+                    w.Put(static_cast<uint32_t>(items.size()));
+                    for(ZBox const& item: items) {
+                        w.PutBox(item, numbers);
+                    }
+                }
+                break;
+            case TABLE: {
+                    ZTable const* t = static_cast<ZTable const*>(v);
+                    w.Put<uint8_t>(t->_pubmut);
+                    w.PutBox(t->Prototype(), numbers);
+                    w.Put(static_cast<uint32_t>(t->Size()));
+                    t->ForEach([&](ZBox const& key, ZBox const& value, TableConfig tc) {
+                        w.PutBox(key, numbers);
+                        w.Put(static_cast<uint8_t>(tc));
+                        w.PutBox(value, numbers);
+                    });
+                }
+                break;
+            case FUNCTION: {
+                    ZFunctionPointer const* f = static_cast<ZFunctionPointer const*>(v);
+                    w.Put(f->Value());
+                    w.Put(f->NArgs());
+                    if(f->FunctionType() == CLOSURE) {
+                        vector<ZUpvalue*> const& upvalues = static_cast<ZClosure const*>(v)->Upvalues();
+                        w.Put(static_cast<uint32_t>(upvalues.size()));
+                        for(ZUpvalue* up: upvalues) {
+                            w.Put(numbers.at(up));
+                        }
+                    } else {
+                        w.Put<uint32_t>(0);
+                    }
+                }
+                break;
+            case UPVALUE:
+                w.PutBox(static_cast<ZUpvalue const*>(v)->Value(), numbers);
+                break;
+            case NIL: case BOOL: case NUMBER: case COROUTINE:
+                throw zoe_internal_error("Unexpected value in the heap.");
+        }
+    }
+
+    // the stack and the variables
+    w.Put(static_cast<uint32_t>(vm._sp));
+    for(size_t i = 0; i < vm._sp; ++i) {
+        w.PutBox(vm._stack[i], numbers);
+    }
+    w.Put(static_cast<uint32_t>(vm._vars.size()));
+    for(ZBox const& var: vm._vars) {
+        w.PutBox(var, numbers);
+    }
+    w.Put(static_cast<uint32_t>(vm._scopes.size()));
+    for(uint32_t scope: vm._scopes) {
+        w.Put(scope);
+    }
+    return w.data;
+}
+
+// }}}
+
+// {{{ RESTORE
+
+void ZSnapshot::Restore(ZoeVM& vm, uint8_t const* data, size_t size)
+{
+    Reader r(data, size);
+    if(memcmp(r.Skip(sizeof MAGIC), MAGIC, sizeof MAGIC) != 0) {
+        Reader::Invalid();
+    }
+
+    // find the values in the image, and create the tables and upvalues (that are filled later)
+    uint32_t count = r.Get<uint32_t>();
+    if(count > r.Remaining() / 2) {         // the smallest record (an upvalue with a scalar) has 2 bytes
+        Reader::Invalid();
+    }
+    vector<ZValue*> values(count, nullptr);
+    vector<uint8_t const*> records(count);
+    vector<ZBox> scratch;
+    for(uint32_t i = 0; i < count; ++i) {
+        records[i] = r.Skip(1);
+        switch(*records[i]) {
+            case STRING:
+                r.Get<uint8_t>();
+                r.Get<uint64_t>();
+                r.Skip(r.Get<uint32_t>());
+                break;
+            case ARRAY:
+                for(uint32_t n = r.Get<uint32_t>(); n > 0; --n) {
+                    r.SkipBox(count);
+                }
+                break;
+            case TABLE:
+                values[i] = vm._heap.Make<ZTable>(r.Get<uint8_t>() != 0, vm._shapes.get()).Ptr();
+                r.SkipBox(count);
+                for(uint32_t n = r.Get<uint32_t>(); n > 0; --n) {
+                    r.SkipBox(count);
+                    r.Get<uint8_t>();
+                    r.SkipBox(count);
+                }
+                break;
+            case FUNCTION:
+                r.Get<uint64_t>();
+                r.Get<uint8_t>();
+                r.Skip(r.Get<uint32_t>() * sizeof(uint32_t));
+                break;
+            case UPVALUE:
+                values[i] = vm._heap.Make<ZUpvalue>(0, nullptr).Ptr();
+                r.SkipBox(count);
+                break;
+            default:
+                Reader::Invalid();
+        }
+    }
+    Reader roots = r;
+
+    // strings, arrays and functions, in order (the references of each are already created)
+    for(uint32_t i = 0; i < count; ++i) {
+        Reader v(records[i] + 1, static_cast<size_t>(data + size - records[i] - 1));
+        switch(*records[i]) {
+            case STRING: {
+                    bool interned = v.Get<uint8_t>() != 0;
+                    uint64_t hsh = v.Get<uint64_t>();
+                    uint32_t len = v.Get<uint32_t>();
+                    char const* str = reinterpret_cast<char const*>(v.Skip(len));
+                    if(hsh != ZString::HashOf(str, len)) {
+                        Reader::Invalid();
+                    }
+                    values[i] = (interned ? vm._strings.Intern(str, len, hsh)
+                                          : vm._heap.Make<ZString>(string(str, len), hsh)).Ptr();
+                }
+                break;
+            case ARRAY:
+                scratch.clear();
+                for(uint32_t n = v.Get<uint32_t>(); n > 0; --n) {
+                    scratch.push_back(v.GetBox(values));
+                }
+                values[i] = vm._heap.Make<ZArray>(begin(scratch), end(scratch)).Ptr();
+                break;
+            case FUNCTION: {
+                    uint64_t ptr = v.Get<uint64_t>();
+                    uint8_t nargs = v.Get<uint8_t>();
+                    vector<ZUpvalue*> upvalues;
+                    for(uint32_t n = v.Get<uint32_t>(); n > 0; --n) {
+                        uint32_t up = v.Get<uint32_t>();
+                        if(up >= count || *records[up] != UPVALUE) {
+                            Reader::Invalid();
+                        }
+                        upvalues.push_back(static_cast<ZUpvalue*>(values[up]));
+                    }
+                    values[i] = upvalues.empty() ? vm._heap.Make<ZFunctionPointer>(ptr, nargs).Ptr()
+                                                 : vm._heap.Make<ZClosure>(ptr, nargs, upvalues).Ptr();
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // fill the tables and the upvalues
+    for(uint32_t i = 0; i < count; ++i) {
+        Reader v(records[i] + 1, static_cast<size_t>(data + size - records[i] - 1));
+        if(*records[i] == TABLE) {
+            ZTable* t = static_cast<ZTable*>(values[i]);
+            v.Get<uint8_t>();
+            ZBox proto = v.GetBox(values);
+            if(!proto.IsNil() && proto.Type() != TABLE) {
+                Reader::Invalid();
+            }
+            t->OpProto(proto);
+            for(uint32_t n = v.Get<uint32_t>(); n > 0; --n) {
+                ZBox key = v.GetBox(values);
+                TableConfig tc = static_cast<TableConfig>(v.Get<uint8_t>());
+                ZBox value = v.GetBox(values);
+                if(t->Find(key)) {
+                    Reader::Invalid();
+                }
+                t->Add(key, value, tc);
+            }
+        } else if(*records[i] == UPVALUE) {
+            static_cast<ZUpvalue*>(values[i])->Close(v.GetBox(values));
+        }
+    }
+
+    // the stack and the variables
+    uint32_t sp = roots.Get<uint32_t>();
+    if(sp > vm._stack.size()) {
+        Reader::Invalid();
+    }
+    scratch.clear();
+    for(uint32_t i = 0; i < sp; ++i) {
+        scratch.push_back(roots.GetBox(values));
+    }
+    vector<ZBox> vars;
+    for(uint32_t n = roots.Get<uint32_t>(); n > 0; --n) {
+        vars.push_back(roots.GetBox(values));
+    }
+    vector<uint32_t> scopes;
+    for(uint32_t n = roots.Get<uint32_t>(); n > 0; --n) {
+        uint32_t scope = roots.Get<uint32_t>();
+        if(scope > vars.size() || (!scopes.empty() && scope < scopes.back())) {
+            Reader::Invalid();
+        }
+        scopes.push_back(scope);
+    }
+    if(scopes.empty() || !roots.AtEnd()) {
+        Reader::Invalid();
+    }
+
+    copy(begin(scratch), end(scratch), begin(vm._stack));
+    vm._sp = sp;
+    vm._vars = move(vars);
+    vm._scopes = move(scopes);
+}
+
+// }}}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,44 @@
+#ifndef VM_ZSNAPSHOT_H_
+#define VM_ZSNAPSHOT_H_
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+class ZoeVM;
+
+// A snapshot is the state of a VM between executions (its stack, its global
+// variables and every value reachable from them) saved to a compact binary
+// image. Restoring it in a new VM is much faster than running again the code
+// that built the values (a prelude that creates prototype tables, for
+// example):
+//
+//     ZoeVM warm;
+//     warm.ExecuteBytecode(prelude);
+//     vector<uint8_t> image = ZSnapshot::Save(warm);
+//
+//     ZoeVM Z;                                          // for each new VM
+//     ZSnapshot::Restore(Z, image.data(), image.size());  // the image can be a mapped file
+//
+// In the image, the heap values are numbered, and the references between
+// them are their numbers: the values are created again in the heap of the
+// new VM, and the numbers are replaced by the new pointers. Strings that were
+// interned are interned in the new VM, and tables get the shapes of the new
+// VM.
+//
+// Functions are saved as the address of their code, so they can only be
+// called by the same code that created them: like any function left by a
+// previous execution, a restored function called by other code is an error
+// (see ZoeVM::FunctionAddress). The variables are restored by position, and
+// each Bytecode starts with an empty symbol table, so the restored globals
+// are not visible by name to the scripts executed later. Coroutines, and
+// variables still captured by closures, can't be saved.
+class ZSnapshot {
+public:
+    static vector<uint8_t> Save(ZoeVM const& vm);
+    static void            Restore(ZoeVM& vm, uint8_t const* data, size_t size);    // replaces the stack and the variables
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
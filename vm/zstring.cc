@@ -1,22 +1,26 @@
 #include "vm/zstring.hh"
 
-#include <functional>
+#include "vm/zbox.hh"
 
 uint64_t ZString::Hash() const
 {
     if(_hash == 0) {
-        _hash = hash<string>()(_value);
+        _hash = HashOf(_value.data(), _value.size());
     }
     return _hash;
 }
 
 
-bool ZString::OpEq(shared_ptr<ZValue> other) const 
+bool ZString::OpEq(ZBox const& other) const 
 {
-    if(Type() != other->Type()) {
+    if(other.Type() != STRING) {
         return false;
     }
-    return Value() == dynamic_pointer_cast<ZString>(other)->Value();
+    ZString const* o = other.Ptr<ZString>();
+    if(_interned && o->_interned) {
+        return this == o;    // there's only one copy of each interned string
+    }
+    return Value() == o->Value();
 }
 
 
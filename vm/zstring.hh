@@ -1,6 +1,7 @@
 #ifndef VM_ZSTRING_H_
 #define VM_ZSTRING_H_
 
+#include <cstdint>
 #include <string>
 using namespace std;
 
@@ -12,16 +13,31 @@ public:
     ZString(string const& value, size_t hsh) : ZValue(StaticType()), _value(value), _hash(hsh)  {}
 
     string const& Value() const { return _value; }
-    uint64_t Hash() const override;
+    bool          Interned() const { return _interned; }
+    uint64_t      Hash() const override;
 
-    bool OpEq(shared_ptr<ZValue> other) const override;
+    bool OpEq(ZBox const& other) const override;
     string Inspect() const override;
 
     static ZType StaticType() { return STRING; }
 
+    // FNV-1a: unlike std::hash, it is the same in every build, so it can be
+    // kept in ZB images and snapshots
+    static uint64_t HashOf(char const* str, size_t len) {
+        uint64_t h = 0xCBF29CE484222325;
+        for(size_t i = 0; i < len; ++i) {
+            h ^= static_cast<uint8_t>(str[i]);
+            h *= 0x100000001B3;
+        }
+        return h;
+    }
+
 private:
     string _value;
     mutable size_t _hash;
+    bool _interned = false;         // set by ZStringTable
+
+    friend class ZStringTable;
 };
 
 template<> struct cpp_type<string> { typedef ZString type; };
@@ -0,0 +1,61 @@
+#include "vm/zstringtable.hh"
+
+#include <cstring>
+
+#include "vm/zheap.hh"
+#include "vm/zstring.hh"
+
+ZBox ZStringTable::Intern(char const* str, size_t len, uint64_t hsh)
+{
+    if((_count + 1) * 4 > _slots.size() * 3) {   // keep load factor under 75%
+        Grow();
+    }
+
+    size_t mask = _slots.size() - 1;
+    for(size_t i = hsh & mask; ; i = (i + 1) & mask) {
+        ZBox& slot = _slots[i];
+        if(slot.IsNil()) {
+            slot = _heap.Make<ZString>(string(str, len), hsh);
+            slot.Ptr<ZString>()->_interned = true;
+            ++_count;
+            return slot;
+        }
+        ZString const* s = slot.Ptr<ZString>();
+        if(s->Hash() == hsh && s->Value().size() == len && memcmp(s->Value().data(), str, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+
+ZBox ZStringTable::Intern(string const& str)
+{
+    return Intern(str.data(), str.size(), ZString::HashOf(str.data(), str.size()));
+}
+
+
+void ZStringTable::Trace(ZHeap& heap) const
+{
+    for(ZBox const& s: _slots) {
+        heap.Mark(s);
+    }
+}
+
+
+void ZStringTable::Grow()
+{
+    vector<ZBox> old = move(_slots);
+    _slots = vector<ZBox>(old.empty() ? 64 : old.size() * 2);
+    size_t mask = _slots.size() - 1;
+    for(ZBox& s: old) {
+        if(!s.IsNil()) {
+            size_t i = s.Ptr<ZString>()->Hash() & mask;
+            while(!_slots[i].IsNil()) {
+                i = (i + 1) & mask;
+            }
+            _slots[i] = move(s);
+        }
+    }
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
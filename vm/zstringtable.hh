@@ -0,0 +1,39 @@
+#ifndef VM_ZSTRINGTABLE_H_
+#define VM_ZSTRINGTABLE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "vm/zbox.hh"
+
+// The string table keeps one single ZString for each distinct interned
+// string, so that interned strings can be compared by their pointer. Interned
+// strings live as long as the table (that is, as long as the VM): the table
+// is a root of the garbage collector.
+//
+// The table uses open addressing with linear probing, so that strings can be
+// looked up directly from the ZB string table, without building a C++ string.
+// The hash given to Intern must be ZString::HashOf the string (the one in
+// the ZB image is checked by BytecodeView).
+class ZStringTable {
+public:
+    explicit ZStringTable(class ZHeap& heap) : _heap(heap) {}
+
+    ZBox   Intern(char const* str, size_t len, uint64_t hsh);
+    ZBox   Intern(string const& str);
+    size_t Size() const { return _count; }
+    void   Trace(class ZHeap& heap) const;
+
+private:
+    ZHeap&       _heap;
+    vector<ZBox> _slots = {};   // nil = empty slot
+    size_t       _count = 0;
+
+    void Grow();
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
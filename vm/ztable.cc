@@ -1,77 +1,158 @@
 #include "vm/ztable.hh"
 
+#include "vm/zheap.hh"
 #include "vm/zstring.hh"
 
-bool ZTable::OpEq(shared_ptr<ZValue> other) const 
+ZTable::ZTable(bool pubmut, ZShape* root)
+    : ZValue(StaticType()), _shape(root), _dict(root ? nullptr : new ZTableMap()), _pubmut(pubmut)
+{
+}
+
+
+bool ZTable::OpEq(ZBox const& other) const 
 {
     (void) other;
     return false;  // TODO
 }
 
 
-void ZTable::OpSet(shared_ptr<ZValue> key, shared_ptr<ZValue> value, TableConfig tc)
+void ZTable::OpSet(ZBox const& key, ZBox const& value, TableConfig tc)
 {
-    // find attribute configuration (PUB|MUT if no element)
-    TableConfig t = static_cast<TableConfig>(PUB|MUT);
-    auto search = _items.find(key);
-    if(search == _items.end()) {
+    TableConfig config;
+    ZBox* v = const_cast<ZBox*>(Find(key, &config));
+    if(!v) {
         // look in prototypes
-        auto current = static_cast<ZTable*>(_prototype.get());
+        auto current = _prototype.IsNil() ? nullptr : _prototype.Ptr<ZTable>();
         while(current) {
-            auto search2 = current->_items.find(key);
-            if(search2 != current->_items.end()) {
+            if(current->Find(key)) {
                 current->OpSet(key, value, tc);
                 return;
             }
-            current = static_cast<ZTable*>(current->_prototype.get());
+            current = current->_prototype.IsNil() ? nullptr : current->_prototype.Ptr<ZTable>();
         }
         // if the program got here, it is because the key was not found
-        // in the prototypes, so we set is as soon as we leave this if block
+        // in the prototypes, so we add it to this table
+        Add(key, value, tc);
 
     } else {
         // verify configuration
-        t = search->second.config;
-        if(!(t & MUT)) {
-            throw zoe_runtime_error("Property " + key->Inspect() + " is not mutable.");
+        if(!(config & MUT)) {
+            throw zoe_runtime_error("Property " + key.Inspect() + " is not mutable.");
         }
-        if(!(t & PUB)) {
+        if(!(config & PUB)) {
             // TODO - fix this for @this
-            throw zoe_runtime_error("Property " + key->Inspect() + " is private.");
+            throw zoe_runtime_error("Property " + key.Inspect() + " is private.");
         }
 
-        // remove existing item (prepare for insertion)
-        _items.erase(search);
+        // overwrite in place
+        if(config == tc) {
+            *v = value;
+        } else {
+            if(_shape) {
+                ToDictionary();    // the configuration is part of the shape
+            }
+            _dict->Set(key, ZTableValue { value, tc });
+        }
     }
-
-    // add to table
-    _items.emplace(make_pair(key, ZTableValue { value, tc }));
 }
 
 
-shared_ptr<ZValue> ZTable::OpGet(shared_ptr<ZValue> key) const
+ZBox ZTable::OpGet(ZBox const& key) const
 {
-    auto search = _items.find(key);
-    if(search == _items.end()) {
-        if(_prototype) {
-            return static_pointer_cast<ZTable>(_prototype)->OpGet(key);
+    TableConfig config;
+    ZBox const* v = Find(key, &config);
+    if(!v) {
+        if(!_prototype.IsNil()) {
+            return _prototype.Ptr<ZTable>()->OpGet(key);
         }
-        throw zoe_runtime_error("Property " + key->Inspect() + " not found.");
+        throw zoe_runtime_error("Property " + key.Inspect() + " not found.");
     }
 
-    ZTableValue const& v = search->second;
-    if(!(v.config & PUB)) {
+    if(!(config & PUB)) {
         // TODO - fix this for @this
-        throw zoe_runtime_error("Property " + key->Inspect() + " is private.");
+        throw zoe_runtime_error("Property " + key.Inspect() + " is private.");
+    }
+    return *v;
+}
+
+
+ZBox const* ZTable::Find(ZBox const& key, TableConfig* config) const
+{
+    if(_shape) {
+        ptrdiff_t i = _shape->Find(key);
+        if(i < 0) {
+            return nullptr;
+        }
+        if(config) {
+            *config = _shape->Config(static_cast<size_t>(i));
+        }
+        return &_slots[static_cast<size_t>(i)];
+    } else {
+        ZTableValue const* v = _dict->Find(key);
+        if(!v) {
+            return nullptr;
+        }
+        if(config) {
+            *config = v->config;
+        }
+        return &v->value;
+    }
+}
+
+
+void ZTable::Add(ZBox const& key, ZBox const& value, TableConfig tc)
+{
+    if(_shape) {
+        ZShape* next = _shape->Transition(key, tc);
+        if(next) {
+            _shape = next;
+            _slots.push_back(value);
+            return;
+        }
+        ToDictionary();
+    }
+    _dict->Set(key, ZTableValue { value, tc });
+}
+
+
+void ZTable::ToDictionary()
+{
+    _dict.reset(new ZTableMap());
+    for(size_t i = 0; i < _slots.size(); ++i) {
+        _dict->Set(_shape->Key(i), ZTableValue { _slots[i], _shape->Config(i) });
+    }
+    _slots.clear();
+    _slots.shrink_to_fit();
+    _shape = nullptr;
+}
+
+
+void ZTable::Clear()
+{
+    if(_shape) {
+        _shape = _shape->Root();
+        _slots.clear();
+    } else {
+        _dict->Clear();
     }
-    return _items.at(key).value;
 }
 
 
-void ZTable::OpProto(shared_ptr<ZValue> proto)
+void ZTable::Trace(ZHeap& heap) const
 {
-    if(proto->Type() == TABLE) {
+    heap.Mark(_prototype);
+    ForEach([&](ZBox const& key, ZBox const& value, TableConfig) {
+        heap.Mark(key);
+        heap.Mark(value);
+    });
+}
+
+
+void ZTable::OpProto(ZBox const& proto)
+{
+    if(proto.Type() == TABLE) {
         _prototype = proto;
-    } else if(proto->Type() != NIL) { 
+    } else if(proto.Type() != NIL) { 
         throw zoe_runtime_error("Table prototype must be a table");
     }
 }
@@ -81,19 +162,19 @@ string ZTable::Inspect() const
 {
     string s = _pubmut ? "&{" : "%{";
     bool fst = true;
-    for(auto const& kv: _items) {
+    ForEach([&](ZBox const& key, ZBox const& value, TableConfig) {
         if(!fst) {
             s.append(", ");
         } else {
             fst = false;
         }
-        if(kv.first->Type() == STRING) {
-            s.append(static_pointer_cast<ZString>(kv.first)->Value());
+        if(key.Type() == STRING) {
+            s.append(key.Ptr<ZString>()->Value());
         } else {
-            s.append("[" + kv.first->Inspect() + "]");
+            s.append("[" + key.Inspect() + "]");
         }
-        s.append(": " + kv.second.value->Inspect());
-    }
+        s.append(": " + value.Inspect());
+    });
     s.append("}");
     return s;
 }
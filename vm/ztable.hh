@@ -1,40 +1,21 @@
 #ifndef VM_ZTABLE_H_
 #define VM_ZTABLE_H_
 
-#include <unordered_map>
+#include <memory>
 using namespace std;
 
-#include "vm/zvalue.hh"
-#include "vm/znumber.hh"
-#include "vm/opcode.hh"  // TODO - for TableConfig
-
-struct ZTableHash {
-    
-    size_t operator()(shared_ptr<ZValue> const& k) const {
-        return k->Hash();
-    }
-
-    bool operator()(shared_ptr<ZValue> const& a, shared_ptr<ZValue> const& b) const {
-        return a->OpEq(b);
-    }
-
-};
-
-
-struct ZTableValue {
-    shared_ptr<ZValue> value;
-    TableConfig        config;
-    ZTableValue(shared_ptr<ZValue> v, TableConfig c) : value(v), config(c) {}
-};
-
-
-typedef unordered_map<shared_ptr<ZValue>, ZTableValue, ZTableHash, ZTableHash> ZTableHashMap;
+#include "vm/zshape.hh"
+#include "vm/ztablemap.hh"
 
 class ZTable : public ZValue {
 public:
-    explicit ZTable(bool pubmut) : ZValue(StaticType()), _pubmut(pubmut) {}
+    // tables created with a root shape start in shape mode, otherwise they are dictionaries
+    explicit ZTable(bool pubmut, ZShape* root=nullptr);
+
+    ZTable(ZTable const&) = delete;
+    ZTable& operator=(ZTable const&) = delete;
 
-    template<typename Iter> ZTable(Iter const& _begin, Iter const& _end, bool pubmut) : ZTable(pubmut) {{{
+    template<typename Iter> ZTable(Iter const& _begin, Iter const& _end, bool pubmut, ZShape* root=nullptr) : ZTable(pubmut, root) {{{
     
         // find prototypes
         auto t = _begin;
@@ -42,37 +23,65 @@ public:
 
         // load data
         while(t != _end) {
-            auto key = *t++;
+            ZBox const& key = *t++;
 
             /* If using PTBL opcode, then pubmut = false, else if using PTBX, pubmut = true.
              * If pubmut = false, we have 3 parameters stacked in the iterator (key, property, value), 
              *   else we have two (key, property). Thus we advance the iterator depending on pubmut. */
             TableConfig n = static_cast<TableConfig>(PUB|MUT);
             if(!pubmut) {
-                n = static_cast<TableConfig>(dynamic_pointer_cast<ZNumber>(*t++)->Value());
+                n = static_cast<TableConfig>((*t++).Number());
             }
 
-            _items.emplace(make_pair(key, ZTableValue { *t++, n }));
+            if(!Find(key)) {     // on repeated keys, the first one is kept
+                Add(key, *t++, n);
+            } else {
+                ++t;
+            }
         }
     }}}
 
     string Inspect() const override;
-    void   Clear() { _items.clear(); }
+    void   Clear();
 
-    bool OpEq(shared_ptr<ZValue> other) const override;
-    void OpSet(shared_ptr<ZValue> key, shared_ptr<ZValue> value, TableConfig tc) override;
-    void OpProto(shared_ptr<ZValue> proto) override;
-    shared_ptr<ZValue> OpGet(shared_ptr<ZValue> key) const override;
+    bool OpEq(ZBox const& other) const override;
+    void OpSet(ZBox const& key, ZBox const& value, TableConfig tc) override;
+    void OpProto(ZBox const& proto) override;
+    ZBox OpGet(ZBox const& key) const override;
+    void Trace(ZHeap& heap) const override;
 
     static ZType StaticType() { return TABLE; }
-    ZTableHashMap const& Value() const { return _items; }
 
-    shared_ptr<ZValue> Prototype() const { return _prototype; }
+    // raw access to the fields (doesn't check configuration or look into prototypes)
+    ZBox const* Find(ZBox const& key, TableConfig* config=nullptr) const;
+    size_t      Size() const { return _shape ? _slots.size() : _dict->Size(); }
+    template<typename F> void ForEach(F f) const {
+        if(_shape) {
+            for(size_t i = 0; i < _slots.size(); ++i) {
+                f(_shape->Key(i), _slots[i], _shape->Config(i));
+            }
+        } else {
+            _dict->ForEach([&](ZBox const& key, ZTableValue const& v) { f(key, v.value, v.config); });
+        }
+    }
+
+    // shape mode: values are indexed by the position of the key in the shape
+    ZShape const* Shape() const { return _shape; }       // nullptr in dictionary mode
+    ZBox const&   Slot(size_t i) const { return _slots[i]; }
+    void          SetSlot(size_t i, ZBox const& value) { _slots[i] = value; }
+
+    ZBox const& Prototype() const { return _prototype; }
 
 private:
-    ZTableHashMap _items = {};
+    friend class ZSnapshot;
+    void Add(ZBox const& key, ZBox const& value, TableConfig tc);   // key must not exist yet
+    void ToDictionary();
+
+    ZShape*               _shape = nullptr;
+    vector<ZBox>          _slots = {};
+    unique_ptr<ZTableMap> _dict = nullptr;
     bool _pubmut;                   // fields are public and mutable by default
-    shared_ptr<ZValue> _prototype = nullptr;
+    ZBox _prototype = nullptr;
 };
 
 #endif
@@ -0,0 +1,271 @@
+#include "vm/ztablemap.hh"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr uint8_t ZTableMap::EMPTY, ZTableMap::DELETED;
+constexpr size_t ZTableMap::GROUP;
+
+// {{{ CONTROL BYTES
+
+/* The control bytes of a group of 8 slots are read as a single 64-bit word,
+ * and matched all at once with the bit tricks below (this requires a little
+ * endian machine). The result has the high bit set for each matching byte.
+ *
+ *   full slot:     0b0hhhhhhh   (7 lower bits of the key hash)
+ *   empty slot:    0b10000000
+ *   deleted slot:  0b11111110
+ */
+
+static const uint64_t LSBS = 0x0101010101010101;
+static const uint64_t MSBS = 0x8080808080808080;
+
+static inline uint64_t LoadGroup(uint8_t const* ctrl)
+{
+    uint64_t w;
+    memcpy(&w, ctrl, 8);
+    return w;
+}
+
+static inline uint64_t MatchByte(uint64_t w, uint8_t b)    // may have false positives, the key is always checked
+{
+    uint64_t x = w ^ (LSBS * b);
+    return (x - LSBS) & ~x & MSBS;
+}
+
+static inline uint64_t MatchEmpty(uint64_t w)
+{
+    return w & (~w << 6) & MSBS;
+}
+
+static inline uint64_t MatchEmptyOrDeleted(uint64_t w)
+{
+    return w & (~w << 7) & MSBS;
+}
+
+static inline size_t LowestByte(uint64_t match)
+{
+#ifdef __GNUC__
+    return static_cast<size_t>(__builtin_ctzll(match)) / 8;
+#else
+    size_t i = 0;
+    while(!(match & 0x80)) {
+        match >>= 8;
+        ++i;
+    }
+    return i;
+#endif
+}
+
+static inline bool KeyEq(ZBox const& a, ZBox const& b)
+{
+    return a.Bits() == b.Bits() || a.OpEq(b);   // same bits: same scalar, or same heap value (interned strings)
+}
+
+// }}}
+
+// {{{ PUBLIC INTERFACE
+
+ZTableValue const* ZTableMap::Find(ZBox const& key) const
+{
+    size_t idx;
+    if(ArrayIndex(key, &idx) && idx < _array.size()) {
+        return _array_used[idx] ? &_array[idx] : nullptr;
+    }
+    ptrdiff_t i = FindSlot(key, key.Hash());
+    return (i >= 0) ? &_slots[static_cast<size_t>(i)].value : nullptr;
+}
+
+
+ZTableValue* ZTableMap::Find(ZBox const& key)
+{
+    return const_cast<ZTableValue*>(static_cast<ZTableMap const*>(this)->Find(key));
+}
+
+
+void ZTableMap::Set(ZBox const& key, ZTableValue const& value)
+{
+    // array part
+    size_t idx;
+    if(ArrayIndex(key, &idx) && ArrayFits(idx)) {
+        if(idx >= _array.size()) {
+            GrowArray(idx);
+        }
+        if(!_array_used[idx]) {
+            _array_used[idx] = true;
+            ++_array_count;
+        }
+        _array[idx] = value;
+        return;
+    }
+
+    // hash part
+    uint64_t hsh = key.Hash();
+    ptrdiff_t i = FindSlot(key, hsh);
+    if(i >= 0) {
+        _slots[static_cast<size_t>(i)].value = value;
+    } else {
+        Insert(key, value, hsh);
+    }
+}
+
+
+bool ZTableMap::Erase(ZBox const& key)
+{
+    size_t idx;
+    if(ArrayIndex(key, &idx) && idx < _array.size()) {
+        if(!_array_used[idx]) {
+            return false;
+        }
+        _array_used[idx] = false;
+        _array[idx] = ZTableValue();
+        --_array_count;
+        return true;
+    }
+
+    ptrdiff_t i = FindSlot(key, key.Hash());
+    if(i < 0) {
+        return false;
+    }
+    _ctrl[static_cast<size_t>(i)] = DELETED;
+    _slots[static_cast<size_t>(i)] = Slot();
+    --_count;
+    return true;
+}
+
+
+void ZTableMap::Clear()
+{
+    _ctrl.clear();
+    _slots.clear();
+    _count = _growth_left = 0;
+    _array.clear();
+    _array_used.clear();
+    _array_count = 0;
+}
+
+// }}}
+
+// {{{ ARRAY PART
+
+bool ZTableMap::ArrayIndex(ZBox const& key, size_t* idx)
+{
+    if(!key.IsNumber()) {
+        return false;
+    }
+    double d = key.Number();
+    if(!(d >= 0.0 && d < 2147483648.0)) {
+        return false;
+    }
+    *idx = static_cast<size_t>(d);
+    return !(d - static_cast<double>(*idx) > 0.0);    // integral?
+}
+
+
+bool ZTableMap::ArrayFits(size_t idx) const
+{
+    // the array part grows as long as it stays at least half full
+    return idx < _array.size() || idx < 8 || (_array_count + 1) * 2 >= idx + 1;
+}
+
+
+void ZTableMap::GrowArray(size_t idx)
+{
+    size_t old_size = _array.size();
+    size_t new_size = max(max(idx + 1, old_size * 2), static_cast<size_t>(8));
+    _array.resize(new_size);
+    _array_used.resize(new_size, false);
+
+    // move keys that now belong to the array part
+    for(size_t j = old_size; j < new_size && _count > 0; ++j) {
+        ZBox key(static_cast<double>(j));
+        ptrdiff_t i = FindSlot(key, key.Hash());
+        if(i >= 0) {
+            _array[j] = _slots[static_cast<size_t>(i)].value;
+            _array_used[j] = true;
+            ++_array_count;
+            _ctrl[static_cast<size_t>(i)] = DELETED;
+            _slots[static_cast<size_t>(i)] = Slot();
+            --_count;
+        }
+    }
+}
+
+// }}}
+
+// {{{ HASH PART
+
+ptrdiff_t ZTableMap::FindSlot(ZBox const& key, uint64_t hsh) const
+{
+    if(_slots.empty()) {
+        return -1;
+    }
+
+    size_t mask = _slots.size() / GROUP - 1;
+    uint8_t h2 = hsh & 0x7F;
+    size_t g = (hsh >> 7) & mask;
+    for(size_t probe = 0; probe <= mask; ++probe) {      // triangular probing: visits every group
+        uint64_t w = LoadGroup(&_ctrl[g * GROUP]);
+        for(uint64_t m = MatchByte(w, h2); m; m &= m - 1) {
+            size_t i = g * GROUP + LowestByte(m);
+            if(_ctrl[i] == h2 && KeyEq(_slots[i].key, key)) {
+                return static_cast<ptrdiff_t>(i);
+            }
+        }
+        if(MatchEmpty(w)) {
+            return -1;
+        }
+        g = (g + probe + 1) & mask;
+    }
+    return -1;
+}
+
+
+void ZTableMap::Insert(ZBox const& key, ZTableValue const& value, uint64_t hsh)
+{
+    if(_growth_left == 0) {
+        // if there are many deleted slots, rehash in place; otherwise grow
+        size_t cap = _slots.size();
+        Rehash((cap == 0) ? GROUP : (_count * 2 < cap * 7 / 8) ? cap : cap * 2);
+    }
+
+    size_t mask = _slots.size() / GROUP - 1;
+    size_t g = (hsh >> 7) & mask;
+    for(size_t probe = 0; ; ++probe) {
+        uint64_t m = MatchEmptyOrDeleted(LoadGroup(&_ctrl[g * GROUP]));
+        if(m) {
+            size_t i = g * GROUP + LowestByte(m);
+            if(_ctrl[i] == EMPTY) {
+                --_growth_left;
+            }
+            _ctrl[i] = hsh & 0x7F;
+            _slots[i].key = key;
+            _slots[i].value = value;
+            ++_count;
+            return;
+        }
+        g = (g + probe + 1) & mask;
+    }
+}
+
+
+void ZTableMap::Rehash(size_t capacity)
+{
+    vector<uint8_t> old_ctrl = move(_ctrl);
+    vector<Slot> old_slots = move(_slots);
+
+    _ctrl.assign(capacity, EMPTY);
+    _slots = vector<Slot>(capacity);
+    _count = 0;
+    _growth_left = capacity * 7 / 8;    // maximum load factor
+
+    for(size_t i = 0; i < old_slots.size(); ++i) {
+        if(IsFull(old_ctrl[i])) {
+            Insert(old_slots[i].key, old_slots[i].value, old_slots[i].key.Hash());
+        }
+    }
+}
+
+// }}}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,86 @@
+#ifndef VM_ZTABLEMAP_H_
+#define VM_ZTABLEMAP_H_
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+#include "vm/zbox.hh"
+#include "vm/opcode.hh"  // TODO - for TableConfig
+
+struct ZTableValue {
+    ZBox        value;
+    TableConfig config;
+    ZTableValue() : value(), config(static_cast<TableConfig>(0)) {}
+    ZTableValue(ZBox const& v, TableConfig c) : value(v), config(c) {}
+};
+
+// ZTableMap is the storage of a ZTable. It has two parts:
+//
+//   - an array part, where small non-negative integer keys are stored by
+//     index, without hashing;
+//   - a hash part, for all other keys. It is an open addressing hash table
+//     in the style of SwissTable: a vector of control bytes (one per slot,
+//     holding 7 bits of the key hash) is scanned 8 slots at a time, and the
+//     key/value/configuration are stored inline in the slot vector. A lookup
+//     usually touches a single control word and a single slot.
+//
+// Iteration visits the hash part first, then the array part (in index order).
+class ZTableMap {
+public:
+    ZTableValue const* Find(ZBox const& key) const;
+    ZTableValue*       Find(ZBox const& key);
+    void               Set(ZBox const& key, ZTableValue const& value);   // insert or overwrite
+    bool               Erase(ZBox const& key);
+    void               Clear();
+
+    size_t Size() const      { return _count + _array_count; }
+    size_t ArraySize() const { return _array.size(); }
+
+    template<typename F> void ForEach(F f) const {
+        for(size_t i = 0; i < _slots.size(); ++i) {
+            if(IsFull(_ctrl[i])) {
+                f(_slots[i].key, _slots[i].value);
+            }
+        }
+        for(size_t i = 0; i < _array.size(); ++i) {
+            if(_array_used[i]) {
+                f(ZBox(static_cast<double>(i)), _array[i]);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        ZBox        key = {};
+        ZTableValue value = {};
+    };
+
+    // hash part
+    vector<uint8_t> _ctrl = {};
+    vector<Slot>    _slots = {};
+    size_t          _count = 0;       // full slots
+    size_t          _growth_left = 0; // slots that can still be used before rehashing
+
+    // array part
+    vector<ZTableValue> _array = {};
+    vector<bool>        _array_used = {};
+    size_t              _array_count = 0;
+
+    static constexpr uint8_t EMPTY   = 0x80;
+    static constexpr uint8_t DELETED = 0xFE;
+    static constexpr size_t  GROUP   = 8;
+    static bool IsFull(uint8_t c) { return (c & 0x80) == 0; }
+
+    static bool ArrayIndex(ZBox const& key, size_t* idx);
+    bool        ArrayFits(size_t idx) const;
+    void        GrowArray(size_t idx);
+
+    ptrdiff_t FindSlot(ZBox const& key, uint64_t hsh) const;
+    void      Insert(ZBox const& key, ZTableValue const& value, uint64_t hsh);
+    void      Rehash(size_t capacity);
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,135 @@
+#include "vm/ztracebuffer.hh"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "compiler/bytecode.hh"
+#include "compiler/bytecodeview.hh"
+#include "vm/opcode.hh"
+
+static const uint8_t MAGIC[] { 0x5A, 0x54, 0x52, 0x43, 0x01, 0x00, 0x00, 0x00 };   // "ZTRC", version 1
+
+ZTraceBuffer::ZTraceBuffer(size_t capacity)
+    : _entries(), _mask(0), _start(chrono::steady_clock::now())
+{
+    size_t n = 1;
+    while(n < capacity) {
+        n *= 2;
+    }
+    _entries.resize(n);
+    _mask = n - 1;
+}
+
+
+uint64_t ZTraceBuffer::Now() const
+{
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - _start).count());
+}
+
+
+vector<ZTraceBuffer::Entry> ZTraceBuffer::Entries() const
+{
+    vector<Entry> entries;
+    uint64_t first = (_recorded > _entries.size()) ? _recorded - _entries.size() : 0;
+    for(uint64_t i = first; i < _recorded; ++i) {
+        entries.push_back(_entries[i & _mask]);
+    }
+    return entries;
+}
+
+
+vector<uint8_t> ZTraceBuffer::Dump() const
+{
+    vector<uint8_t> data(begin(MAGIC), end(MAGIC));
+    auto put = [&data](auto t) {
+        uint8_t const* p = reinterpret_cast<uint8_t const*>(&t);
+        data.insert(end(data), p, p + sizeof t);
+    };
+    vector<Entry> entries = Entries();
+    put(_recorded);
+    put(static_cast<uint32_t>(entries.size()));
+    for(Entry const& e: entries) {
+        put(e.time);
+        put(e.pc);
+        put(e.depth);
+        put(e.opcode);
+        put(e.reserved);
+    }
+    return data;
+}
+
+
+string ZTraceBuffer::Decode(uint8_t const* data, size_t size, BytecodeView const& code)
+{
+    size_t pos = 0;
+    auto get = [&](auto t) {
+        if(size - pos < sizeof t) {
+            throw runtime_error("Not a valid trace.");
+        }
+        memcpy(&t, data + pos, sizeof t);
+        pos += sizeof t;
+        return t;
+    };
+    if(size < sizeof MAGIC || memcmp(data, MAGIC, sizeof MAGIC) != 0) {
+        throw runtime_error("Not a valid trace.");
+    }
+    pos = sizeof MAGIC;
+    uint64_t recorded = get(uint64_t());
+    uint32_t count = get(uint32_t());
+    if(count > (size - pos) / 16) {        // each entry has 16 bytes
+        throw runtime_error("Not a valid trace.");
+    }
+    vector<Entry> entries(count);
+    for(Entry& e: entries) {
+        e.time = get(uint64_t());
+        e.pc = get(uint32_t());
+        e.depth = get(uint16_t());
+        e.opcode = get(uint8_t());
+        e.reserved = get(uint8_t());
+    }
+
+    stringstream ss;
+    if(recorded > entries.size()) {
+        ss << "(" << (recorded - entries.size()) << " instructions before these were not kept)\n";
+    }
+    for(size_t i = 0; i < entries.size(); ++i) {
+        Entry const& e = entries[i];
+
+        // the instruction, with the opcode that was executed (it might have been quickened)
+        size_t sz = (e.pc < code.CodeSize()) ? opcode_size(code.Code()[e.pc]) : 0;
+        if(sz == 0 || opcode_size(e.opcode) != sz || code.CodeSize() - e.pc < sz) {
+            throw runtime_error("The trace was not recorded from this code.");
+        }
+        vector<uint8_t> ins(code.Code() + e.pc, code.Code() + e.pc + sz);
+        ins[0] = e.opcode;
+        string dis = Bytecode::DisassembleInstruction(ins.data(), [&code](uint32_t idx) {
+            return string(code.GetString(idx).str, code.GetString(idx).len);
+        });
+
+        // the size of the stack after the instruction is the size before the next one
+        ss << FormatInstruction(e.pc, dis) << "< ";
+        if(i + 1 < entries.size()) {
+            ss << entries[i + 1].depth << ((entries[i + 1].depth == 1) ? " value" : " values");
+        } else {
+            ss << "?";
+        }
+        ss << " >  +" << (e.time - entries[0].time) << " ns\n";
+    }
+    return ss.str();
+}
+
+
+string ZTraceBuffer::FormatInstruction(size_t pos, string const& disassembly)
+{
+    stringstream ss;
+    ss << setfill('0') << hex << uppercase;
+    ss << "* " << setw(8) << pos << ":   " << disassembly;
+    if(disassembly.size() < 20) {
+        ss << string(20 - disassembly.size(), ' ');
+    }
+    return ss.str();
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
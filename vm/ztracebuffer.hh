@@ -0,0 +1,92 @@
+#ifndef VM_ZTRACEBUFFER_H_
+#define VM_ZTRACEBUFFER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+// A ZTraceBuffer records the last instructions executed by a VM, in binary:
+// the position of each instruction, its opcode (as executed, after
+// quickening), the number of values in the stack and the time. Unlike
+// ZoeVM::Tracer, that disassembles the instruction and inspects the whole
+// stack every time, it is cheap enough to be left on in production, and read
+// only when something goes wrong:
+//
+//     ZTraceBuffer trace;
+//     Z.TraceBuffer = &trace;
+//     try {
+//         Z.ExecuteBytecode(view);
+//     } catch(exception const& e) {
+//         vector<uint8_t> dump = trace.Dump();      // saved somewhere...
+//     }
+//     cout << ZTraceBuffer::Decode(dump.data(), dump.size(), view);    // ...and decoded later
+//
+// The buffer has a fixed number of entries, and the oldest ones are
+// overwritten, so recording never allocates or locks. Reading the clock
+// costs more than executing most instructions, so it is only read every
+// CLOCK_INTERVAL entries: the entries in between get the same time. The VM
+// records from its fast loop, and keeps the JIT on; the instructions
+// executed by compiled functions are not recorded (only the call is). The
+// register backend is not used, as its instructions are not the ones in the
+// bytecode.
+//
+// The buffer is written by the thread running the VM: Dump must be called
+// from that thread, or when the VM is not running.
+class ZTraceBuffer {
+public:
+    explicit ZTraceBuffer(size_t capacity=DEFAULT_CAPACITY);      // rounded up to a power of two
+
+    static constexpr size_t   DEFAULT_CAPACITY = 64 * 1024;
+    static constexpr uint64_t CLOCK_INTERVAL = 64;     // entries (a power of two)
+
+    ZTraceBuffer(ZTraceBuffer const&) = delete;
+    ZTraceBuffer& operator=(ZTraceBuffer const&) = delete;
+
+    struct Entry {
+        uint64_t time;      // nanoseconds since the buffer was created (see CLOCK_INTERVAL)
+        uint32_t pc;        // position of the instruction in the code
+        uint16_t depth;     // values in the stack, before the instruction (at most UINT16_MAX)
+        uint8_t  opcode;
+        uint8_t  reserved;
+    };
+
+    void Record(uint32_t pc, uint8_t opcode, size_t depth) {
+        if((_recorded & (CLOCK_INTERVAL - 1)) == 0) {
+            _now = Now();
+        }
+        Entry& e = _entries[_recorded & _mask];
+        e.time = _now;
+        e.pc = pc;
+        e.depth = static_cast<uint16_t>(depth < UINT16_MAX ? depth : UINT16_MAX);
+        e.opcode = opcode;
+        e.reserved = 0;
+        ++_recorded;
+    }
+
+    size_t        Capacity() const { return _entries.size(); }
+    uint64_t      Recorded() const { return _recorded; }     // since created (or cleared)
+    vector<Entry> Entries() const;                           // the ones still in the buffer, oldest first
+    void          Clear() { _recorded = 0; }
+
+    // binary dump of the entries, and the trace, as text (in the format of
+    // ZoeVM::Tracer), decoded with the code that was running
+    vector<uint8_t> Dump() const;
+    static string   Decode(uint8_t const* data, size_t size, class BytecodeView const& code);
+
+    static string FormatInstruction(size_t pos, string const& disassembly);     // first column of the trace
+
+private:
+    uint64_t Now() const;
+
+    vector<Entry>                    _entries;
+    size_t                           _mask;
+    uint64_t                         _recorded = 0;
+    uint64_t                         _now = 0;          // time of the last clock reading
+    chrono::steady_clock::time_point _start;
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -8,6 +8,9 @@ string Typename(ZType type) {
         case STRING: return "string";
         case ARRAY:  return "array";
         case TABLE:  return "table";
+        case FUNCTION: return "function";
+        case COROUTINE: return "coroutine";
+        case UPVALUE: return "upvalue";
         default:     return "(undefined = " + to_string(type) + ")";
     }
 }
@@ -5,7 +5,8 @@
 using namespace std;
 
 enum ZType {
-    NIL, BOOL, NUMBER, STRING, ARRAY, TABLE, FUNCTION
+    NIL, BOOL, NUMBER, STRING, ARRAY, TABLE, FUNCTION, COROUTINE,
+    UPVALUE     // internal: a variable captured by closures (see vm/zfunction.hh)
 };
 
 // This template is the basis for converting C++ types to the C++ 
@@ -0,0 +1,9 @@
+#include "vm/zvalue.hh"
+
+#include "vm/zbox.hh"
+
+void ZValue::Trace(ZHeap& /* heap */) const
+{
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -1,38 +1,55 @@
 #ifndef VM_ZVALUE_H_
 #define VM_ZVALUE_H_
 
-#include <memory>
+#include <cstdint>
+#include <string>
 using namespace std;
 
 #include "vm/ztype.hh"
 #include "vm/opcode.hh"
 #include "vm/exceptions.hh"
 
+class ZBox;
+class ZHeap;
+
+// ZValue is the base class for the values that live in the heap (strings,
+// arrays, tables and functions). The VM never holds a ZValue directly: it
+// holds ZBoxes (see vm/zbox.hh), which point to ZValues when the value is
+// not a scalar. ZValues are created and freed by a ZHeap (see vm/zheap.hh).
 class ZValue {
 public:
     virtual ~ZValue() {}
 
+    ZValue(ZValue const&) = delete;
+    ZValue& operator=(ZValue const&) = delete;
+
     ZType Type() const { return _type; }
-    
+
     virtual uint64_t Hash() const {
         throw zoe_runtime_error("Values of type " + Typename(_type) + " can't be used as table key.");
     }
 
-    virtual string Inspect() const = 0;
-    virtual bool   OpEq(shared_ptr<ZValue> other) const = 0;
-    virtual void   OpSet(shared_ptr<ZValue> /* key */, shared_ptr<ZValue> /* value */, TableConfig /* tc */) {
+    virtual string   Inspect() const = 0;
+    virtual bool     OpEq(ZBox const& other) const = 0;
+    virtual void     OpSet(ZBox const& /* key */, ZBox const& /* value */, TableConfig /* tc */) {
         throw zoe_runtime_error(Typename(Type()) + "s can't be set.");
     }
-    virtual shared_ptr<ZValue> OpGet(shared_ptr<ZValue> /* key */) const {
-        throw zoe_runtime_error(Typename(Type()) + "s can't be get.");
-    }
-    virtual void OpProto(shared_ptr<ZValue> /* proto */) {
+    virtual ZBox     OpGet(ZBox const& key) const;        // defined in vm/zbox.hh, where ZBox is complete
+    virtual void     OpProto(ZBox const& /* proto */) {
         throw zoe_runtime_error(Typename(Type()) + "s can't have prototypes.");
     }
 
+    virtual void     Trace(ZHeap& heap) const;      // mark the values referenced by this one
+
 protected:
     explicit ZValue(ZType type) : _type(type) {}
     const ZType _type;
+
+private:
+    friend class ZHeap;
+    ZValue*      _gc_next = nullptr;    // next value in the heap
+    mutable bool _gc_marked = false;
+    uint8_t      _gc_size_class = 0;    // slab where the value was allocated
 };
 
 #endif
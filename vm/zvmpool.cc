@@ -0,0 +1,124 @@
+#include "vm/zvmpool.hh"
+
+#include <algorithm>
+
+ZVMPool::ZVMPool(size_t threads, function<void(ZoeVM&)> const& setup)
+    : _setup(setup)
+{
+    if(threads == 0) {
+        threads = max(thread::hardware_concurrency(), 1U);
+    }
+    for(size_t i = 0; i < threads; ++i) {
+        _workers.emplace_back(new Worker());
+    }
+    for(size_t i = 0; i < threads; ++i) {       // only when all queues exist, as they steal from each other
+        _workers[i]->th = thread(&ZVMPool::Run, this, i);
+    }
+}
+
+
+ZVMPool::~ZVMPool()
+{
+    {
+        lock_guard<mutex> lock(_m);
+        _stop = true;
+    }
+    _work.notify_all();
+    for(auto& w: _workers) {
+        w->th.join();
+    }
+}
+
+
+future<string> ZVMPool::Submit(shared_ptr<CompiledChunk const> const& chunk)
+{
+    Job job { chunk, promise<string>() };
+    future<string> result = job.result.get_future();
+    Worker& w = *_workers[_next++ % _workers.size()];
+    {
+        // counted before the job is visible, so that a worker that takes it
+        // (and decrements them) never finds them at zero
+        lock_guard<mutex> lock(_m);
+        ++_queued;
+        ++_unfinished;
+    }
+    {
+        lock_guard<mutex> lock(w.m);
+        w.jobs.push_back(move(job));
+    }
+    _work.notify_one();
+    return result;
+}
+
+
+void ZVMPool::Wait()
+{
+    unique_lock<mutex> lock(_m);
+    _idle.wait(lock, [this]() { return _unfinished == 0; });
+}
+
+
+void ZVMPool::Run(size_t id)
+{
+    for(;;) {
+        Job job;
+        if(!Take(id, job)) {
+            unique_lock<mutex> lock(_m);
+            _work.wait(lock, [this]() { return _stop || _queued > 0; });
+            if(_stop && _queued == 0) {
+                return;
+            }
+            continue;
+        }
+        Execute(job);
+        lock_guard<mutex> lock(_m);
+        if(--_unfinished == 0) {
+            _idle.notify_all();
+        }
+    }
+}
+
+
+// a job from the front of the worker's own queue, or else stolen from the back of another queue
+bool ZVMPool::Take(size_t id, Job& job)
+{
+    bool found = false;
+    for(size_t i = 0; i < _workers.size() && !found; ++i) {
+        Worker& w = *_workers[(id + i) % _workers.size()];
+        lock_guard<mutex> lock(w.m);
+        if(w.jobs.empty()) {
+            continue;
+        }
+        if(i == 0) {
+            job = move(w.jobs.front());
+            w.jobs.pop_front();
+        } else {
+            job = move(w.jobs.back());
+            w.jobs.pop_back();
+            ++_stolen;
+        }
+        found = true;
+    }
+    if(found) {
+        lock_guard<mutex> lock(_m);
+        --_queued;
+    }
+    return found;
+}
+
+
+void ZVMPool::Execute(Job& job) const
+{
+    try {
+        ZoeVM Z;
+        if(_setup) {
+            _setup(Z);
+        }
+        Z.ExecuteChunk(job.chunk);
+        job.result.set_value(Z.Get().Inspect());
+    } catch(...) {
+        job.result.set_exception(current_exception());
+    }
+}
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp
@@ -0,0 +1,81 @@
+#ifndef VM_ZVMPOOL_H_
+#define VM_ZVMPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include "compiler/compiledchunk.hh"
+#include "vm/zoevm.hh"
+
+// A ZVMPool runs many independent scripts on a fixed number of worker
+// threads. Each script runs in a VM of its own, created for it, so scripts
+// never share values; the only thing shared between threads is the compiled
+// code (see compiler/compiledchunk.hh), which is never written to.
+//
+// Each worker has its own queue of scripts. New scripts are distributed
+// among the queues, and a worker runs the scripts of its queue in order;
+// when its queue is empty, it steals from the other end of another worker's
+// queue, so that the workers stay busy even when some scripts take much
+// longer than others.
+//
+//     ZVMPool pool(4);
+//     auto chunk = CompiledChunk::Create(Bytecode("1 + 2").GenerateZB());
+//     future<string> result = pool.Submit(chunk);
+//     cout << result.get();        // "3" (or the error thrown by the script)
+class ZVMPool {
+public:
+    // threads: 0 for one per core
+    // setup: called for each new VM, before it runs the script (to enable the JIT, for example)
+    explicit ZVMPool(size_t threads=0, function<void(ZoeVM&)> const& setup=nullptr);
+    ~ZVMPool();                 // the scripts already submitted are run before the workers stop
+
+    ZVMPool(ZVMPool const&) = delete;
+    ZVMPool& operator=(ZVMPool const&) = delete;
+
+    // the result is the value left by the script, inspected
+    future<string> Submit(shared_ptr<CompiledChunk const> const& chunk);
+    void           Wait();      // until every script submitted has run
+
+    size_t   Threads() const { return _workers.size(); }
+    uint64_t Stolen() const { return _stolen; }     // scripts run by a worker other than the one they were given to
+
+private:
+    struct Job {
+        shared_ptr<CompiledChunk const> chunk = {};
+        promise<string>                 result = {};
+    };
+    struct Worker {
+        mutex       m = {};
+        deque<Job>  jobs = {};
+        thread      th = {};
+    };
+
+    void Run(size_t id);
+    bool Take(size_t id, Job& job);
+    void Execute(Job& job) const;
+
+    function<void(ZoeVM&)>     _setup;
+    vector<unique_ptr<Worker>> _workers = {};
+    mutex                      _m = {};
+    condition_variable         _work = {};          // a script was submitted (or the pool is stopping)
+    condition_variable         _idle = {};          // every script has run
+    size_t                     _queued = 0;         // scripts in the queues
+    size_t                     _unfinished = 0;     // scripts submitted and not yet run
+    bool                       _stop = false;
+    atomic<size_t>             _next { 0 };         // queue that gets the next script
+    atomic<uint64_t>           _stolen { 0 };
+};
+
+#endif
+
+// vim: ts=4:sw=4:sts=4:expandtab:foldmethod=marker:syntax=cpp